@@ -1,21 +1,55 @@
 #include "buffer.h"
+#include "search.h"
 
+#include <algorithm>
+#include <array>
 #include <fstream>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <thread>
+#include <limits>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
 
 #include "jtk/file_utils.h"
 #include "jtk/utf8.h"
 
 #include "utils.h"
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define JED_SSE2
+#endif
+
 file_buffer make_empty_buffer()
   {
   file_buffer fb;
   fb.pos.row = fb.pos.col = 0;
   fb.xpos = 0;
   fb.start_selection = std::nullopt;
-  fb.modification_mask = 0;
+  fb.revision = 0;
+  fb.last_revision = 0;
+  fb.saved_revision = 0;
   fb.undo_redo_index = 0;
+  fb.undo_memory = 0;
   fb.rectangular_selection = false;
+  fb.damage_first_row = 0;
+  fb.damage_tail_rows = 0;
+  fb.damage_id = 0;
+  fb.lex_pending_row = std::numeric_limits<int64_t>::max();
   return fb;
   }
 
@@ -34,59 +68,239 @@ namespace
     }
   }
 
-file_buffer read_from_file(std::string filename)
+namespace
   {
-  using namespace jtk;
-  local_remove_quotes(filename); 
-  file_buffer fb = make_empty_buffer();
-  fb.name = filename;  
-  if (file_exists(filename))
+  /*
+  Read-only view on the bytes of a file. The file is memory mapped; if mapping fails the
+  file is read into memory instead.
+  */
+  class file_view
     {
+    public:
+      file_view(const std::string& filename) : _data(nullptr), _size(0), _mapped(false)
+        {
+#ifdef _WIN32
+        _file = INVALID_HANDLE_VALUE;
+        _mapping = nullptr;
+        std::wstring wfilename = jtk::convert_string_to_wstring(filename);
+        _file = CreateFileW(wfilename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (_file == INVALID_HANDLE_VALUE)
+          return;
+        LARGE_INTEGER sz;
+        if (!GetFileSizeEx(_file, &sz))
+          return;
+        _size = (uint64_t)sz.QuadPart;
+        if (_size == 0)
+          return;
+        _mapping = CreateFileMappingW(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (_mapping)
+          {
+          _data = (const char*)MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+          _mapped = _data != nullptr;
+          }
+#else
+        _fd = ::open(filename.c_str(), O_RDONLY);
+        if (_fd < 0)
+          return;
+        struct stat st;
+        if (fstat(_fd, &st) != 0)
+          return;
+        _size = (uint64_t)st.st_size;
+        if (_size == 0)
+          return;
+        void* p = mmap(nullptr, (size_t)_size, PROT_READ, MAP_PRIVATE, _fd, 0);
+        if (p != MAP_FAILED)
+          {
+          _data = (const char*)p;
+          _mapped = true;
+#ifdef MADV_SEQUENTIAL
+          madvise(p, (size_t)_size, MADV_SEQUENTIAL);
+#endif
+          }
+#endif
+        if (!_mapped)
+          {
 #ifdef _WIN32
-    std::wstring wfilename = convert_string_to_wstring(filename);
+          auto f = std::ifstream{ wfilename, std::ios::binary };
 #else
-    std::string wfilename(filename);
+          auto f = std::ifstream{ filename, std::ios::binary };
 #endif
-    auto f = std::ifstream{ wfilename };
-    auto trans_lines = fb.content.transient();
-    try
+          _fallback.resize((size_t)_size);
+          f.read(_fallback.data(), _fallback.size());
+          _fallback.resize((size_t)f.gcount());
+          _size = _fallback.size();
+          _data = _fallback.data();
+          }
+        }
+
+      ~file_view()
+        {
+#ifdef _WIN32
+        if (_mapped)
+          UnmapViewOfFile(_data);
+        if (_mapping)
+          CloseHandle(_mapping);
+        if (_file != INVALID_HANDLE_VALUE)
+          CloseHandle(_file);
+#else
+        if (_mapped)
+          munmap((void*)_data, (size_t)_size);
+        if (_fd >= 0)
+          ::close(_fd);
+#endif
+        }
+
+      file_view(const file_view&) = delete;
+      file_view& operator = (const file_view&) = delete;
+
+      const char* data() const { return _data; }
+      uint64_t size() const { return _size; }
+
+    private:
+      const char* _data;
+      uint64_t _size;
+      bool _mapped;
+      std::vector<char> _fallback;
+#ifdef _WIN32
+      HANDLE _file, _mapping;
+#else
+      int _fd;
+#endif
+    };
+
+  /*
+  Returns a pointer to the first '\n' in [first, last), or last if there is none.
+  */
+  const char* _find_newline(const char* first, const char* last)
+    {
+    if (first == last)
+      return last;
+#ifdef JED_SSE2
+    const __m128i newline = _mm_set1_epi8('\n');
+    while (last - first >= 16)
       {
-      while (!f.eof())
+      __m128i chunk = _mm_loadu_si128((const __m128i*)first);
+      int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+      if (mask)
         {
-        std::string file_line;
-        std::getline(f, file_line);
-        auto trans = line().transient();
-        auto it = file_line.begin();
-        auto it_end = file_line.end();
-        utf8::utf8to16(it, it_end, std::back_inserter(trans));
-        if (!f.eof())
-          trans.push_back('\n');
-        trans_lines.push_back(trans.persistent());
+        int offset = 0;
+        while ((mask & 1) == 0)
+          {
+          mask >>= 1;
+          ++offset;
+          }
+        return first + offset;
         }
+      first += 16;
       }
-    catch (...)
+#endif
+    const char* p = (const char*)std::memchr(first, '\n', (size_t)(last - first));
+    return p ? p : last;
+    }
+
+  /*
+  Decodes the lines in [first, last). All lines but the last one end in '\n'. If last_chunk is true,
+  the bytes after the final '\n' form an extra line (which can be empty), similar to std::getline.
+  If the chunk is not valid utf8, the chunk is decoded byte per byte with ascii_to_utf16 instead.
+  */
+  text _decode_chunk(const char* first, const char* last, bool last_chunk)
+    {
+    auto decode = [&](bool utf8_encoded)
       {
-      while (!trans_lines.empty())
-        trans_lines.pop_back();
-      f.seekg(0);
-      while (!f.eof())
+      text out;
+      auto trans_lines = out.transient();
+      const char* line_begin = first;
+      while (line_begin != last || last_chunk)
         {
-        std::string file_line;
-        std::getline(f, file_line);
+        const char* line_end = _find_newline(line_begin, last);
         auto trans = line().transient();
-        auto it = file_line.begin();
-        auto it_end = file_line.end();
-        for (; it != it_end; ++it)
+        if (utf8_encoded)
+          utf8::utf8to16(line_begin, line_end, std::back_inserter(trans));
+        else
+          {
+          for (const char* it = line_begin; it != line_end; ++it)
+            trans.push_back(ascii_to_utf16((unsigned char)*it));
+          }
+        if (line_end == last)
           {
-          trans.push_back(ascii_to_utf16(*it));
+          trans_lines.push_back(trans.persistent());
+          break;
           }
-        if (!f.eof())
-          trans.push_back('\n');
+        trans.push_back(L'\n');
         trans_lines.push_back(trans.persistent());
+        line_begin = line_end + 1;
         }
+      return trans_lines.persistent();
+      };
+    try
+      {
+      return decode(true);
       }
-    fb.content = trans_lines.persistent();
-    f.close();
+    catch (...)
+      {
+      return decode(false);
+      }
+    }
+
+  /*
+  _decode_chunk in parallel for large files.
+  */
+  text _decode_file(const char* first, const char* last, bool last_chunk)
+    {
+    const uint64_t minimum_chunk_size = 1 << 20;
+    uint64_t size = (uint64_t)(last - first);
+    uint64_t nr_of_chunks = std::thread::hardware_concurrency();
+    if (nr_of_chunks == 0)
+      nr_of_chunks = 1;
+    if (size / minimum_chunk_size < nr_of_chunks)
+      nr_of_chunks = size / minimum_chunk_size;
+    if (nr_of_chunks < 2)
+      return _decode_chunk(first, last, last_chunk);
+
+    std::vector<const char*> boundaries;
+    boundaries.push_back(first);
+    for (uint64_t i = 1; i < nr_of_chunks; ++i)
+      {
+      const char* split = first + (size * i) / nr_of_chunks;
+      if (split < boundaries.back())
+        split = boundaries.back();
+      split = _find_newline(split, last);
+      if (split == last)
+        break;
+      boundaries.push_back(split + 1);
+      }
+    boundaries.push_back(last);
+
+    std::vector<text> chunks(boundaries.size() - 1);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < chunks.size(); ++i)
+      {
+      threads.emplace_back([&, i]()
+        {
+        chunks[i] = _decode_chunk(boundaries[i], boundaries[i + 1], last_chunk && i + 1 == chunks.size());
+        });
+      }
+    chunks[0] = _decode_chunk(boundaries[0], boundaries[1], last_chunk && chunks.size() == 1);
+    for (auto& t : threads)
+      t.join();
+
+    text out = chunks[0];
+    for (size_t i = 1; i < chunks.size(); ++i)
+      out = out + chunks[i];
+    return out;
+    }
+  }
+
+file_buffer read_from_file(std::string filename)
+  {
+  using namespace jtk;
+  local_remove_quotes(filename); 
+  file_buffer fb = make_empty_buffer();
+  fb.name = filename;  
+  if (file_exists(filename))
+    {
+    file_view f(filename);
+    fb.content = _decode_file(f.data(), f.data() + f.size(), true);
     }
   else if (is_directory(filename))
     {
@@ -144,41 +358,266 @@ file_buffer read_from_file(std::string filename)
   return fb;
   }
 
-file_buffer save_to_file(bool& success, file_buffer fb, const std::string& filename)
+namespace
   {
+  /*
+  Output file that is written through a large block buffer with a few big write calls.
+  */
+  class block_writer
+    {
+    public:
+      block_writer() : _ok(false), _used(0)
+        {
 #ifdef _WIN32
-  std::wstring wfilename = jtk::convert_string_to_wstring(filename); // filenames are in utf8 encoding
+        _file = INVALID_HANDLE_VALUE;
 #else
-  std::string wfilename(filename);
+        _fd = -1;
 #endif
-  success = false;
-  auto f = std::ofstream{ wfilename };
-  if (f.is_open())
+        _buffer().resize(1 << 20);
+        }
+
+      ~block_writer()
+        {
+        close();
+        }
+
+      bool open(const std::string& filename, const std::string& mode_reference)
+        {
+#ifdef _WIN32
+        (void)mode_reference;
+        std::wstring wfilename = jtk::convert_string_to_wstring(filename);
+        _file = CreateFileW(wfilename.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        _ok = _file != INVALID_HANDLE_VALUE;
+#else
+        struct stat st;
+        const bool has_reference = stat(mode_reference.c_str(), &st) == 0;
+        const mode_t mode = has_reference ? (st.st_mode & 07777) : 0666; // a new file gets 0666 minus the umask
+        _fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, mode);
+        _ok = _fd >= 0;
+        if (_ok && has_reference)
+          fchmod(_fd, mode); // not affected by the umask, so the permissions of the original file survive
+#endif
+        _used = 0;
+        return _ok;
+        }
+
+      /*
+      Returns a pointer to at least 'bytes' free bytes, flushing the buffer when necessary.
+      */
+      char* reserve(size_t bytes)
+        {
+        if (_used + bytes > _buffer().size())
+          {
+          flush();
+          if (bytes > _buffer().size())
+            _buffer().resize(bytes);
+          }
+        return _buffer().data() + _used;
+        }
+
+      void commit(size_t bytes)
+        {
+        _used += bytes;
+        }
+
+      size_t capacity() const
+        {
+        return _buffer().size();
+        }
+
+      void flush()
+        {
+        const char* data = _buffer().data();
+        size_t remaining = _used;
+        while (_ok && remaining > 0)
+          {
+#ifdef _WIN32
+          DWORD written = 0;
+          DWORD to_write = remaining > (1u << 30) ? (1u << 30) : (DWORD)remaining;
+          if (!WriteFile(_file, data, to_write, &written, nullptr))
+            _ok = false;
+#else
+          ssize_t written = ::write(_fd, data, remaining);
+          if (written < 0)
+            {
+            if (errno == EINTR)
+              continue;
+            _ok = false;
+            break;
+            }
+#endif
+          data += written;
+          remaining -= (size_t)written;
+          }
+        _used = 0;
+        }
+
+      /*
+      Flushes all data to the disk and closes the file. Returns false if anything went wrong.
+      */
+      bool sync_and_close()
+        {
+        flush();
+#ifdef _WIN32
+        if (_ok && !FlushFileBuffers(_file))
+          _ok = false;
+#else
+        if (_ok && fsync(_fd) != 0)
+          _ok = false;
+#endif
+        close();
+        return _ok;
+        }
+
+    private:
+      void close()
+        {
+#ifdef _WIN32
+        if (_file != INVALID_HANDLE_VALUE)
+          CloseHandle(_file);
+        _file = INVALID_HANDLE_VALUE;
+#else
+        if (_fd >= 0 && ::close(_fd) != 0)
+          _ok = false;
+        _fd = -1;
+#endif
+        }
+
+      static std::vector<char>& _buffer()
+        {
+        static thread_local std::vector<char> buffer; // reused over saves
+        return buffer;
+        }
+
+    private:
+      bool _ok;
+      size_t _used;
+#ifdef _WIN32
+      HANDLE _file;
+#else
+      int _fd;
+#endif
+    };
+
+  void _write_line(block_writer& out, const line& ln)
+    {
+    const size_t max_chars = out.capacity() / 4; // an utf16 character never takes more than 3 bytes in utf8, a surrogate pair 4
+    auto it = ln.begin();
+    auto it_end = ln.end();
+    while (it != it_end)
+      {
+      size_t n = (size_t)std::distance(it, it_end);
+      if (n > max_chars)
+        {
+        n = max_chars;
+        wchar_t last = *(it + (n - 1));
+        if (last >= 0xD800 && last <= 0xDBFF) // don't split a surrogate pair
+          --n;
+        }
+      char* buf = out.reserve(n * 3 + 1);
+      char* buf_end = utf8::utf16to8(it, it + n, buf);
+      out.commit((size_t)(buf_end - buf));
+      it += n;
+      }
+    }
+
+  std::string _temporary_save_filename(const std::string& filename)
     {
-    for (auto ln : fb.content)
+    return jtk::get_folder(filename) + "." + jtk::get_filename(filename) + ".jedsave";
+    }
+
+  bool _replace_file(const std::string& source, const std::string& target)
+    {
+#ifdef _WIN32
+    std::wstring wsource = jtk::convert_string_to_wstring(source);
+    std::wstring wtarget = jtk::convert_string_to_wstring(target);
+    return MoveFileExW(wsource.c_str(), wtarget.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    if (::rename(source.c_str(), target.c_str()) != 0)
+      return false;
+    std::string folder = jtk::get_folder(target);
+    int dir = ::open(folder.empty() ? "." : folder.c_str(), O_RDONLY);
+    if (dir >= 0)
       {
-      std::string str;
-      auto it = ln.begin();
-      auto it_end = ln.end();
-      str.reserve(std::distance(it, it_end));
-      utf8::utf16to8(it, it_end, std::back_inserter(str));
-      f << str;
+      fsync(dir); // make the rename itself durable
+      ::close(dir);
       }
-    f.close();
-    success = true;
-    fb.modification_mask = 0;
-    auto thistory = fb.history.transient();
-    for (uint32_t idx = 0; idx < thistory.size(); ++idx)
+    return true;
+#endif
+    }
+
+  void _remove_file(const std::string& filename)
+    {
+#ifdef _WIN32
+    DeleteFileW(jtk::convert_string_to_wstring(filename).c_str());
+#else
+    ::unlink(filename.c_str());
+#endif
+    }
+
+  /*
+  Replacing a file by a rename gives it a new inode, so hardlinks to it would keep the old content, and the owner
+  and group would become those of the user that saves.
+  */
+  bool _must_save_in_place(const std::string& filename)
+    {
+#ifdef _WIN32
+    (void)filename;
+    return false;
+#else
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0)
+      return false;
+    return st.st_nlink > 1 || st.st_uid != geteuid() || st.st_gid != getegid();
+#endif
+    }
+
+  std::string _resolve_symlinks(const std::string& filename)
+    {
+#ifndef _WIN32
+    char* resolved = realpath(filename.c_str(), nullptr);
+    if (resolved)
       {
-      auto h = thistory[idx];
-      h.modification_mask = 1;
-      thistory.set(idx, h);
+      std::string out(resolved);
+      free(resolved);
+      return out;
       }
-    fb.history = thistory.persistent();
+#endif
+    return filename;
+    }
+  }
+
+file_buffer save_to_file(bool& success, file_buffer fb, const std::string& filename)
+  {
+  success = false;
+  std::string target = _resolve_symlinks(filename); // renaming over a symlink would replace the link instead of the file
+  std::string temporary = _temporary_save_filename(target);
+  block_writer out;
+  const bool in_place = _must_save_in_place(target) || !out.open(temporary, target); // e.g. a writable file in a folder that is not writable
+  if (in_place && !out.open(target, target))
+    return fb;
+  for (const auto& ln : fb.content)
+    _write_line(out, ln);
+  if (in_place)
+    {
+    if (!out.sync_and_close())
+      return fb;
+    }
+  else if (!out.sync_and_close() || !_replace_file(temporary, target))
+    {
+    _remove_file(temporary);
+    return fb;
     }
+  success = true;
+  fb.saved_revision = fb.revision;
   return fb;
   }
 
+bool is_modified(file_buffer fb)
+  {
+  return fb.revision != fb.saved_revision;
+  }
+
 position get_actual_position(file_buffer fb, position pos)
   {
   position out = pos;
@@ -232,30 +671,34 @@ uint32_t character_width(uint32_t character, int64_t x_pos, const env_settings&
 
 int64_t line_length_up_to_column(line ln, int64_t column, const env_settings& s)
   {
+  if (column < 0)
+    return 0;
+  int64_t n = std::min<int64_t>(column + 1, ln.size());
+#ifdef JED_COMPACT_LINES
+  return (int64_t)ln.display_width((uint32_t)n, s.tab_space, s.show_all_characters);
+#else
   int64_t length = 0;
-  int64_t col = 0;
-  for (int64_t i = 0; i <= column && i < ln.size(); ++i)
-    {
-    uint32_t w = character_width(ln[i], col, s);
-    length += w;
-    col += w;
-    }
+  auto it = ln.begin();
+  for (int64_t i = 0; i < n; ++i, ++it)
+    length += character_width(*it, length, s);
   return length;
+#endif
   }
 
 int64_t get_col_from_line_length(line ln, int64_t length, const env_settings& s)
   {
+  if (length <= 0)
+    return 0;
+#ifdef JED_COMPACT_LINES
+  return (int64_t)ln.characters_in_display_width((uint64_t)length, s.tab_space, s.show_all_characters);
+#else
   int64_t le = 0;
-  int64_t col = 0;
   int64_t out = 0;
-  for (int i = 0; le < length && i < ln.size(); ++i)
-    {
-    uint32_t w = character_width(ln[i], col, s);
-    le += w;
-    col += w;
-    ++out;
-    }
+  const int64_t size = (int64_t)ln.size();
+  for (auto it = ln.begin(); le < length && out < size; ++it, ++out)
+    le += character_width(*it, le, s);
   return out;
+#endif
   }
 
 bool in_selection(file_buffer fb, position current, position cursor, position buffer_pos, std::optional<position> start_selection, bool rectangular, const env_settings& s)
@@ -329,63 +772,339 @@ file_buffer clear_selection(file_buffer fb)
   return fb;
   }
 
-file_buffer push_undo(file_buffer fb)
-  {
-  snapshot ss;
-  ss.content = fb.content;
-  ss.lex = fb.lex;
-  ss.pos = fb.pos;
-  ss.start_selection = fb.start_selection;
-  ss.modification_mask = fb.modification_mask;
-  ss.rectangular_selection = fb.rectangular_selection;
-  fb.history = fb.history.push_back(ss);
-  fb.undo_redo_index = fb.history.size();
-  return fb;
-  }
-
-void get_rectangular_selection(int64_t& min_row, int64_t& max_row, int64_t& min_x, int64_t& max_x, file_buffer fb, position p1, position p2, const env_settings& s)
-  {
-  min_x = line_length_up_to_column(fb.content[p1.row], p1.col - 1, s);
-  max_x = line_length_up_to_column(fb.content[p2.row], p2.col - 1, s);
-  min_row = p1.row;
-  max_row = p2.row;
-  if (max_x < min_x)
-    std::swap(max_x, min_x);
-  if (max_row < min_row)
-    std::swap(max_row, min_row);
-  }
-
-
 namespace
   {
-  file_buffer insert_rectangular(file_buffer fb, std::wstring wtxt, const env_settings& s, bool save_undo)
+  uint64_t _memory_used(const text& lines)
     {
-    fb.modification_mask |= 1;
+    uint64_t bytes = 0;
+    for (const auto& ln : lines)
+      bytes += sizeof(line) + ln.size() * sizeof(wchar_t);
+    return bytes;
+    }
 
-    int64_t minrow, maxrow, minx, maxx;
-    get_rectangular_selection(minrow, maxrow, minx, maxx, fb, *fb.start_selection, fb.pos, s);
+  undo_group _make_undo_group(const file_buffer& fb, edit_kind kind)
+    {
+    undo_group g;
+    g.content = fb.content;
+    g.pos = fb.pos;
+    g.start_selection = fb.start_selection;
+    g.rectangular_selection = fb.rectangular_selection;
+    g.revision = fb.revision;
+    g.first_row = std::numeric_limits<int64_t>::max();
+    g.tail_rows = std::numeric_limits<int64_t>::max();
+    g.kind = kind;
+    g.word_start = false;
+    g.keystroke_pos = kind == ek_other ? fb.pos : get_actual_position(fb);
+    return g;
+    }
 
-    bool single_line = wtxt.find_first_of(L'\n') == std::wstring::npos;
+  /*
+  The keystroke of g continues the keystrokes of previous if it is of the same kind, at the position where the
+  last of them left the cursor.
+  */
+  bool _can_merge(const undo_record& previous, const undo_record& rec, const undo_group& g)
+    {
+    if (rec.kind == ek_other || previous.kind != rec.kind)
+      return false;
+    if (rec.kind == ek_typing && g.word_start)
+      return false;
+    // both records cover the same rows around the cursor (see _track_edit), and neither joined or split lines
+    return previous.row == rec.row && previous.old_lines.size() == previous.new_lines.size()
+      && rec.old_lines.size() == previous.new_lines.size() && rec.new_lines.size() == rec.old_lines.size()
+      && previous.keystroke_pos_after == g.keystroke_pos && previous.revision_after == rec.revision_before;
+    }
 
-    if (single_line)
+  /*
+  Turns the open undo group into an undo record.
+  */
+  void _close_undo_group(file_buffer& fb)
+    {
+    if (!fb.open_undo_group)
+      return;
+    undo_group g = *fb.open_undo_group;
+    fb.open_undo_group = std::nullopt;
+    if (g.first_row == std::numeric_limits<int64_t>::max())
+      return; // nothing was edited
+    int64_t old_rows = (int64_t)g.content.size();
+    int64_t new_rows = (int64_t)fb.content.size();
+    int64_t row = g.first_row;
+    int64_t old_end = std::max(row, old_rows - g.tail_rows);
+    int64_t new_end = std::max(row, new_rows - g.tail_rows);
+    undo_record rec;
+    rec.row = row;
+    rec.old_lines = g.content.slice((uint32_t)row, (uint32_t)old_end);
+    rec.new_lines = fb.content.slice((uint32_t)row, (uint32_t)new_end);
+    rec.pos_before = g.pos;
+    rec.pos_after = fb.pos;
+    rec.start_selection_before = g.start_selection;
+    rec.start_selection_after = fb.start_selection;
+    rec.rectangular_selection_before = g.rectangular_selection;
+    rec.rectangular_selection_after = fb.rectangular_selection;
+    rec.revision_before = g.revision;
+    rec.revision_after = fb.revision;
+    rec.kind = g.kind;
+    rec.keystroke_pos_after = g.keystroke_pos;
+    if (g.kind == ek_typing)
+      ++rec.keystroke_pos_after.col;
+    else if (g.kind == ek_backspace)
+      --rec.keystroke_pos_after.col;
+
+    if (fb.undo_redo_index < fb.history.size()) // a new edit discards the redo steps
       {
-      line input;
-      auto trans = input.transient();
-      for (auto ch : wtxt)
-        trans.push_back(ch);
-      input = trans.persistent();
+      for (uint64_t i = fb.undo_redo_index; i < fb.history.size(); ++i)
+        fb.undo_memory -= fb.history[(uint32_t)i].memory;
+      fb.history = fb.history.take((uint32_t)fb.undo_redo_index);
+      }
 
-      for (int64_t r = minrow; r <= maxrow; ++r)
-        {
-        auto ln = fb.content[r];
-        int64_t current_col = get_col_from_line_length(fb.content[r], minx, s);
-        int64_t len = line_length_up_to_column(fb.content[r], current_col - 1, s);
-        if (len == minx)
-          {
-          ln = ln.take(current_col) + input + ln.drop(current_col);
-          }
-        fb.content = fb.content.set(r, ln);
-        }
+    if (!fb.history.empty() && _can_merge(fb.history.back(), rec, g))
+      {
+      undo_record merged = fb.history.back();
+      fb.undo_memory -= merged.memory;
+      merged.new_lines = rec.new_lines;
+      merged.pos_after = rec.pos_after;
+      merged.start_selection_after = rec.start_selection_after;
+      merged.rectangular_selection_after = rec.rectangular_selection_after;
+      merged.revision_after = rec.revision_after;
+      merged.keystroke_pos_after = rec.keystroke_pos_after;
+      merged.memory = sizeof(undo_record) + _memory_used(merged.old_lines) + _memory_used(merged.new_lines);
+      fb.undo_memory += merged.memory;
+      fb.history = fb.history.set(fb.history.size() - 1, merged);
+      }
+    else
+      {
+      rec.memory = sizeof(undo_record) + _memory_used(rec.old_lines) + _memory_used(rec.new_lines);
+      fb.undo_memory += rec.memory;
+      fb.history = fb.history.push_back(rec);
+      }
+    fb.undo_redo_index = fb.history.size();
+    }
+
+  void _trim_undo_history(file_buffer& fb, const env_settings& s)
+    {
+    uint32_t drop = 0;
+    while (fb.undo_memory > s.undo_memory_limit && drop + 1 < fb.undo_redo_index)
+      {
+      fb.undo_memory -= fb.history[drop].memory;
+      ++drop;
+      }
+    if (drop)
+      {
+      fb.history = fb.history.drop(drop);
+      fb.undo_redo_index -= drop;
+      }
+    }
+
+  file_buffer _push_undo(file_buffer fb, edit_kind kind, const env_settings& s)
+    {
+    _close_undo_group(fb);
+    _trim_undo_history(fb, s);
+    fb.open_undo_group = _make_undo_group(fb, kind);
+    return fb;
+    }
+
+  /*
+  Marks the rows [first, last] as damaged, in the same way as _track_rows: when called before an edit, the rows
+  after last keep counting as undamaged tail rows.
+  */
+  void _damage_rows(file_buffer& fb, int64_t first, int64_t last)
+    {
+    int64_t rows = (int64_t)fb.content.size();
+    fb.damage_first_row = std::min<int64_t>(fb.damage_first_row, std::max<int64_t>(first, 0));
+    fb.damage_tail_rows = std::min<int64_t>(fb.damage_tail_rows, std::max<int64_t>(rows - 1 - last, 0));
+    }
+
+  /*
+  Registers that the next edit can modify the rows [first, last], so that the open undo group covers them.
+  */
+  void _track_rows(file_buffer& fb, int64_t first, int64_t last)
+    {
+    _damage_rows(fb, first, last);
+    if (!fb.open_undo_group)
+      fb.open_undo_group = _make_undo_group(fb, ek_other);
+    int64_t rows = (int64_t)fb.content.size();
+    auto& g = *fb.open_undo_group;
+    g.first_row = std::min<int64_t>(g.first_row, std::max<int64_t>(first, 0));
+    g.tail_rows = std::min<int64_t>(g.tail_rows, std::max<int64_t>(rows - 1 - last, 0));
+    }
+
+  /*
+  Registers that the next edit can modify the rows around the cursor and the selection.
+  */
+  void _track_edit(file_buffer& fb)
+    {
+    int64_t rows = (int64_t)fb.content.size();
+    int64_t first = std::min<int64_t>(fb.pos.row, rows - 1);
+    int64_t last = first;
+    if (fb.start_selection)
+      {
+      first = std::min<int64_t>(first, fb.start_selection->row);
+      last = std::max<int64_t>(last, fb.start_selection->row);
+      }
+    _track_rows(fb, first - 1, std::min<int64_t>(last + 1, rows - 1)); // joining with the previous or next line
+    }
+
+  /*
+  Replaces count rows starting at row by lines and updates the lexer status of the changed rows.
+  */
+  file_buffer _replace_rows(file_buffer fb, int64_t row, int64_t count, const text& lines)
+    {
+    _damage_rows(fb, row, row + count - 1);
+    fb.content = fb.content.take((uint32_t)row) + lines + fb.content.drop((uint32_t)(row + count));
+    auto trans = lexer_status().transient();
+    for (uint32_t i = 0; i < lines.size(); ++i)
+      trans.push_back(lexer_normal);
+    fb.lex = fb.lex.take((uint32_t)row) + trans.persistent() + fb.lex.drop((uint32_t)(row + count));
+    if (!fb.content.empty())
+      {
+      if (row == 0)
+        fb.lex = fb.lex.set(0, lexer_normal);
+      fb = update_lexer_status(fb, std::max<int64_t>(row - 1, 0), row + (int64_t)lines.size());
+      }
+    return fb;
+    }
+  }
+
+file_buffer push_undo(file_buffer fb)
+  {
+  _close_undo_group(fb);
+  fb.open_undo_group = _make_undo_group(fb, ek_other);
+  return fb;
+  }
+
+namespace
+  {
+  std::wstring _flatten(const text& lines)
+    {
+    std::wstring out;
+    for (const auto& ln : lines)
+      out.append(ln.begin(), ln.end());
+    return out;
+    }
+
+  /*
+  Maps pos through rec. Only the characters in between the common begin and the common end of the old and new
+  rows of rec changed.
+  */
+  position _map_position(position pos, const undo_record& rec)
+    {
+    const int64_t old_rows = (int64_t)rec.old_lines.size();
+    const int64_t new_rows = (int64_t)rec.new_lines.size();
+    if (pos.row < rec.row)
+      return pos;
+    if (pos.row >= rec.row + old_rows)
+      return position(pos.row + new_rows - old_rows, pos.col);
+    const std::wstring old_text = _flatten(rec.old_lines);
+    const std::wstring new_text = _flatten(rec.new_lines);
+    int64_t offset = 0;
+    for (int64_t r = rec.row; r < pos.row; ++r)
+      offset += (int64_t)rec.old_lines[(uint32_t)(r - rec.row)].size();
+    offset += std::min<int64_t>(pos.col, (int64_t)rec.old_lines[(uint32_t)(pos.row - rec.row)].size());
+    const int64_t old_size = (int64_t)old_text.size();
+    const int64_t new_size = (int64_t)new_text.size();
+    int64_t common_begin = 0;
+    while (common_begin < old_size && common_begin < new_size && old_text[common_begin] == new_text[common_begin])
+      ++common_begin;
+    int64_t common_end = 0;
+    while (common_end < old_size - common_begin && common_end < new_size - common_begin && old_text[old_size - 1 - common_end] == new_text[new_size - 1 - common_end])
+      ++common_end;
+    if (offset >= common_begin)
+      offset = offset >= old_size - common_end ? offset + new_size - old_size : new_size - common_end;
+    for (int64_t r = 0; r < new_rows; ++r)
+      {
+      const int64_t row_size = (int64_t)rec.new_lines[(uint32_t)r].size();
+      if (offset < row_size)
+        return position(rec.row + r, offset);
+      offset -= row_size;
+      }
+    if (new_rows > 0 && (rec.new_lines.back().empty() || rec.new_lines.back().back() != L'\n')) // end of the last row of the text
+      return position(rec.row + new_rows - 1, (int64_t)rec.new_lines.back().size());
+    return position(rec.row + new_rows, 0);
+    }
+  }
+
+std::optional<position> map_position(file_buffer fb, position pos, uint64_t revision)
+  {
+  if (fb.revision == revision)
+    return pos;
+  _close_undo_group(fb);
+  uint64_t first = fb.undo_redo_index;
+  uint64_t current = fb.revision;
+  while (first > 0 && current != revision)
+    {
+    const undo_record& rec = fb.history[(uint32_t)(first - 1)];
+    if (rec.revision_after != current)
+      return std::nullopt;
+    current = rec.revision_before;
+    --first;
+    }
+  if (current != revision)
+    return std::nullopt;
+  for (uint64_t i = first; i < fb.undo_redo_index; ++i)
+    pos = _map_position(pos, fb.history[(uint32_t)i]);
+  return pos;
+  }
+
+file_buffer clear_damage(file_buffer fb)
+  {
+  static uint64_t last_damage_id = 0;
+  fb.damage_first_row = (int64_t)fb.content.size();
+  fb.damage_tail_rows = (int64_t)fb.content.size();
+  fb.damage_id = ++last_damage_id;
+  return fb;
+  }
+
+file_buffer clear_undo_history(file_buffer fb)
+  {
+  fb.history = immutable::vector<undo_record, false>();
+  fb.open_undo_group = std::nullopt;
+  fb.undo_redo_index = 0;
+  fb.undo_memory = 0;
+  return fb;
+  }
+
+void get_rectangular_selection(int64_t& min_row, int64_t& max_row, int64_t& min_x, int64_t& max_x, file_buffer fb, position p1, position p2, const env_settings& s)
+  {
+  min_x = line_length_up_to_column(fb.content[p1.row], p1.col - 1, s);
+  max_x = line_length_up_to_column(fb.content[p2.row], p2.col - 1, s);
+  min_row = p1.row;
+  max_row = p2.row;
+  if (max_x < min_x)
+    std::swap(max_x, min_x);
+  if (max_row < min_row)
+    std::swap(max_row, min_row);
+  }
+
+
+namespace
+  {
+  file_buffer insert_rectangular(file_buffer fb, std::wstring wtxt, const env_settings& s, bool save_undo)
+    {
+    fb.revision = ++fb.last_revision;
+
+    int64_t minrow, maxrow, minx, maxx;
+    get_rectangular_selection(minrow, maxrow, minx, maxx, fb, *fb.start_selection, fb.pos, s);
+
+    bool single_line = wtxt.find_first_of(L'\n') == std::wstring::npos;
+
+    if (single_line)
+      {
+      line input;
+      auto trans = input.transient();
+      for (auto ch : wtxt)
+        trans.push_back(ch);
+      input = trans.persistent();
+
+      for (int64_t r = minrow; r <= maxrow; ++r)
+        {
+        auto ln = fb.content[r];
+        int64_t current_col = get_col_from_line_length(fb.content[r], minx, s);
+        int64_t len = line_length_up_to_column(fb.content[r], current_col - 1, s);
+        if (len == minx)
+          {
+          ln = ln.take(current_col) + input + ln.drop(current_col);
+          }
+        fb.content = fb.content.set(r, ln);
+        }
       fb.start_selection->row = minrow;
       fb.pos.row = maxrow;
 
@@ -443,7 +1162,7 @@ namespace
     if (txt.empty())
       return fb;
 
-    fb.modification_mask |= 1;
+    fb.revision = ++fb.last_revision;
 
     int64_t minrow, maxrow, minx, maxx;
     get_rectangular_selection(minrow, maxrow, minx, maxx, fb, *fb.start_selection, fb.pos, s);
@@ -516,7 +1235,12 @@ file_buffer insert(file_buffer fb, std::wstring wtxt, const env_settings& s, boo
   if (wtxt.empty())
     return fb;
   if (save_undo)
-    fb = push_undo(fb);
+    {
+    bool typing = wtxt.size() == 1 && wtxt[0] != L'\n' && !has_selection(fb);
+    fb = _push_undo(fb, typing ? ek_typing : ek_other, s);
+    fb.open_undo_group->word_start = typing && (wtxt[0] == L' ' || wtxt[0] == L'\t');
+    }
+  _track_edit(fb);
 
   if (has_nontrivial_selection(fb, s))
     fb = erase(fb, s, false);
@@ -526,7 +1250,7 @@ file_buffer insert(file_buffer fb, std::wstring wtxt, const env_settings& s, boo
 
   fb.start_selection = std::nullopt;
 
-  fb.modification_mask |= 1;
+  fb.revision = ++fb.last_revision;
 
   auto pos = get_actual_position(fb);
   int nr_of_lines_inserted = 0;
@@ -595,15 +1319,180 @@ file_buffer insert(file_buffer fb, text txt, const env_settings& s, bool save_un
   return insert(fb, to_wstring(txt), s, save_undo);
   }
 
+namespace
+  {
+  /*
+  Appends lines at the end of fb. The first line continues the last row of fb, unless that row ends in '\n'.
+  The buffer is re-lexed from the last row on. This is not an undo step.
+  */
+  void _append_rows(file_buffer& fb, const text& lines)
+    {
+    if (lines.empty())
+      return;
+    fb.revision = ++fb.last_revision;
+
+    int64_t first_row = (int64_t)fb.content.size() - 1;
+    uint32_t next_line = 0;
+    auto trans = fb.content.transient();
+    auto trans_lex = fb.lex.transient();
+    if (first_row >= 0 && (fb.content.back().empty() || fb.content.back().back() != L'\n'))
+      {
+      _damage_rows(fb, first_row, first_row);
+      trans.set((uint32_t)first_row, fb.content.back() + lines[0]);
+      next_line = 1;
+      }
+    else
+      first_row = std::max<int64_t>(first_row, 0);
+    for (uint32_t i = next_line; i < lines.size(); ++i)
+      {
+      trans.push_back(lines[i]);
+      trans_lex.push_back(lexer_normal);
+      }
+    fb.content = trans.persistent();
+    fb.lex = trans_lex.persistent();
+    fb = update_lexer_status(fb, first_row, (int64_t)fb.content.size() - 1);
+    }
+  }
+
+file_buffer append_output(file_buffer fb, const std::string& txt, int64_t max_rows)
+  {
+  if (txt.empty())
+    return fb;
+  _close_undo_group(fb); // the next edit starts a new group from the appended content
+  const bool cursor_at_end = fb.pos == get_last_position(fb);
+  _append_rows(fb, _decode_chunk(txt.data(), txt.data() + txt.size(), true));
+
+  const int64_t rows = (int64_t)fb.content.size();
+  if (max_rows > 0 && rows > max_rows)
+    {
+    const int64_t dropped = rows - max_rows;
+    if (lexer_status_is_pending(fb))
+      fb.lex_pending_row = std::max<int64_t>(fb.lex_pending_row - dropped, 1);
+    fb.content = fb.content.drop((uint32_t)dropped);
+    fb.lex = fb.lex.drop((uint32_t)dropped);
+    fb = clear_undo_history(fb);
+    _damage_rows(fb, 0, max_rows - 1);
+    fb.pos.row -= dropped;
+    if (fb.pos.row < 0)
+      fb.pos = position(0, 0);
+    if (fb.start_selection)
+      {
+      fb.start_selection->row -= dropped;
+      if (fb.start_selection->row < 0)
+        fb.start_selection = position(0, 0);
+      }
+    }
+
+  if (cursor_at_end)
+    fb.pos = get_last_position(fb);
+  return fb;
+  }
+
+struct file_loader
+  {
+  file_loader(const std::string& filename) : file(filename), stop(false), finished(false), bytes(0) {}
+  ~file_loader()
+    {
+    stop = true;
+    if (thread.joinable())
+      thread.join();
+    }
+
+  file_view file;
+  std::thread thread;
+  std::mutex mut;
+  std::vector<text> chunks; // decoded rows that were not appended yet, guarded by mut
+  std::atomic<bool> stop, finished;
+  std::atomic<uint64_t> bytes; // bytes of the file that are decoded
+  };
+
+file_buffer read_from_file_progressively(std::shared_ptr<file_loader>& loader, std::string filename, uint64_t first_bytes, std::function<void()> rows_ready)
+  {
+  loader.reset();
+  local_remove_quotes(filename);
+  if (!jtk::file_exists(filename))
+    return read_from_file(filename);
+  auto l = std::make_shared<file_loader>(filename);
+  const char* first = l->file.data();
+  const char* last = first + l->file.size();
+  if (l->file.size() <= first_bytes)
+    return read_from_file(filename);
+  const char* split = _find_newline(first + first_bytes, last);
+  if (split == last)
+    return read_from_file(filename);
+  ++split;
+
+  file_buffer fb = make_empty_buffer();
+  fb.name = filename;
+  fb.content = _decode_chunk(first, split, false); // ends in a complete row, the loaded rows never continue a row that can be edited
+  l->bytes = (uint64_t)(split - first);
+  l->thread = std::thread([ld = l.get(), first, split, last, rows_ready]()
+    {
+    const uint64_t chunk_size = 16 << 20;
+    const char* chunk_begin = split;
+    while (chunk_begin != last && !ld->stop)
+      {
+      const char* chunk_end = last;
+      if ((uint64_t)(last - chunk_begin) > chunk_size)
+        {
+        chunk_end = _find_newline(chunk_begin + chunk_size, last);
+        if (chunk_end != last)
+          ++chunk_end;
+        }
+      text rows = _decode_file(chunk_begin, chunk_end, chunk_end == last);
+        {
+        std::scoped_lock lock(ld->mut);
+        ld->chunks.push_back(std::move(rows)); // the reference counts of text are not atomic, only the main thread may release the rows
+        }
+      ld->bytes = (uint64_t)(chunk_end - first);
+      chunk_begin = chunk_end;
+      rows_ready();
+      }
+    ld->finished = true;
+    rows_ready();
+    });
+  loader = l;
+  return fb;
+  }
+
+file_buffer append_loaded_rows(bool& finished, file_buffer fb, file_loader& loader)
+  {
+  finished = loader.finished; // before taking the rows, so that no rows are missed
+  std::vector<text> chunks;
+    {
+    std::scoped_lock lock(loader.mut);
+    chunks.swap(loader.chunks);
+    }
+  if (chunks.empty())
+    return fb;
+  _close_undo_group(fb);
+  const bool modified = is_modified(fb);
+  for (const auto& rows : chunks)
+    {
+    if (fb.content.empty() || fb.content.back().empty() || fb.content.back().back() != L'\n')
+      fb = clear_undo_history(fb); // the line break at the end was removed, so the rows continue a row that the undo records do not know
+    _append_rows(fb, rows);
+    }
+  if (!modified)
+    fb.saved_revision = fb.revision;
+  return fb;
+  }
+
+double loaded_fraction(const file_loader& loader)
+  {
+  return loader.file.size() ? (double)loader.bytes / (double)loader.file.size() : 1.0;
+  }
+
 file_buffer erase(file_buffer fb, const env_settings& s, bool save_undo)
   {
   if (fb.content.empty())
     return fb;
 
   if (save_undo)
-    fb = push_undo(fb);
+    fb = _push_undo(fb, has_selection(fb) ? ek_other : ek_backspace, s);
+  _track_edit(fb);
 
-  fb.modification_mask |= 1;
+  fb.revision = ++fb.last_revision;
 
   if (!has_selection(fb))
     {
@@ -727,15 +1616,17 @@ file_buffer erase(file_buffer fb, const env_settings& s, bool save_undo)
 
 file_buffer erase_right(file_buffer fb, const env_settings& s, bool save_undo)
   {
+  if (fb.content.empty())
+    return fb;
+
   if (save_undo)
-    fb = push_undo(fb);
+    fb = _push_undo(fb, has_selection(fb) ? ek_other : ek_delete, s);
+  _track_edit(fb);
 
-  fb.modification_mask |= 1;
+  fb.revision = ++fb.last_revision;
 
   if (!has_selection(fb))
     {
-    if (fb.content.empty())
-      return fb;
     auto pos = get_actual_position(fb);
     fb.pos = pos;
     fb.start_selection = std::nullopt;
@@ -850,22 +1741,16 @@ text get_selection(file_buffer fb, const env_settings& s)
 
 file_buffer undo(file_buffer fb, const env_settings& s)
   {
-  if (fb.undo_redo_index == fb.history.size()) // first time undo
-    {
-    fb = push_undo(fb);
-    --fb.undo_redo_index;
-    }
+  _close_undo_group(fb);
   if (fb.undo_redo_index)
     {
     --fb.undo_redo_index;
-    snapshot ss = fb.history[(uint32_t)fb.undo_redo_index];
-    fb.content = ss.content;
-    fb.lex = ss.lex;
-    fb.pos = ss.pos;
-    fb.modification_mask = ss.modification_mask;
-    fb.start_selection = ss.start_selection;
-    fb.rectangular_selection = ss.rectangular_selection;
-    fb.history = fb.history.push_back(ss);
+    const undo_record rec = fb.history[(uint32_t)fb.undo_redo_index];
+    fb = _replace_rows(fb, rec.row, rec.new_lines.size(), rec.old_lines);
+    fb.pos = rec.pos_before;
+    fb.start_selection = rec.start_selection_before;
+    fb.rectangular_selection = rec.rectangular_selection_before;
+    fb.revision = rec.revision_before;
     }
   fb.xpos = get_x_position(fb, s);
   return fb;
@@ -873,17 +1758,16 @@ file_buffer undo(file_buffer fb, const env_settings& s)
 
 file_buffer redo(file_buffer fb, const env_settings& s)
   {
-  if (fb.undo_redo_index + 1 < fb.history.size())
+  _close_undo_group(fb);
+  if (fb.undo_redo_index < fb.history.size())
     {
+    const undo_record rec = fb.history[(uint32_t)fb.undo_redo_index];
     ++fb.undo_redo_index;
-    snapshot ss = fb.history[(uint32_t)fb.undo_redo_index];
-    fb.content = ss.content;
-    fb.lex = ss.lex;
-    fb.pos = ss.pos;
-    fb.modification_mask = ss.modification_mask;
-    fb.start_selection = ss.start_selection;
-    fb.rectangular_selection = ss.rectangular_selection;
-    fb.history = fb.history.push_back(ss);
+    fb = _replace_rows(fb, rec.row, rec.old_lines.size(), rec.new_lines);
+    fb.pos = rec.pos_after;
+    fb.start_selection = rec.start_selection_after;
+    fb.rectangular_selection = rec.rectangular_selection_after;
+    fb.revision = rec.revision_after;
     }
   fb.xpos = get_x_position(fb, s);
   return fb;
@@ -1147,53 +2031,41 @@ position get_previous_position(file_buffer fb, position pos)
   return get_previous_position(fb.content, pos);
   }
 
-file_buffer find_text(file_buffer fb, text txt)
+file_buffer find_text(file_buffer fb, const search_pattern& pattern)
   {
-  if (txt.empty())
+  if (empty(pattern))
     return fb;
   if (fb.content.empty())
     return fb;
   fb.rectangular_selection = false;
   position lastpos = get_last_position(fb);
   position pos = fb.pos;
-  position text_pos(0, 0);
-  position lasttext = get_last_position(txt);
-  position first_encounter;
   if (has_selection(fb) && fb.start_selection > pos)
     pos = *fb.start_selection;
+  else if (!pattern.re.empty() && fb.start_selection && *fb.start_selection <= fb.pos) // continue after the previous match, which can be a single character
+    pos = get_next_position(fb.content, fb.pos);
   if (pos == lastpos)
     pos.col = pos.row = 0;
   pos = get_actual_position(fb, pos);
-  wchar_t current_text_char = txt[text_pos.row][text_pos.col];
-  wchar_t first_text_char = txt[text_pos.row][text_pos.col];
-  while (pos != lastpos)
+  auto match = find_next_match(fb.content, pattern, pos);
+  if (match)
     {
-    wchar_t current_char = fb.content[pos.row][pos.col];
-    if (current_char == current_text_char)
-      {
-      if (text_pos.col == 0 && text_pos.row == 0)
-        first_encounter = pos;
-      text_pos = get_next_position(txt, text_pos);
-      if (text_pos == lasttext)
-        {
-        fb.start_selection = first_encounter;
-        fb.pos = pos;
-        return fb;
-        }
-      current_text_char = txt[text_pos.row][text_pos.col];
-      }
-    else
-      {
-      current_text_char = first_text_char;
-      text_pos = position(0, 0);
-      }
-    pos = get_next_position(fb, pos);
+    fb.start_selection = match->first;
+    fb.pos = match->last;
+    return fb;
     }
   fb.pos = lastpos;
   fb.start_selection = std::nullopt;
   return fb;
   }
 
+file_buffer find_text(file_buffer fb, text txt)
+  {
+  if (txt.empty())
+    return fb;
+  return find_text(fb, make_search_pattern(txt));
+  }
+
 file_buffer find_text(file_buffer fb, const std::wstring& wtxt)
   {
   return find_text(fb, to_text(wtxt));
@@ -1204,15 +2076,106 @@ file_buffer find_text(file_buffer fb, const std::string& txt)
   return find_text(fb, jtk::convert_string_to_wstring(txt));
   }
 
-std::wstring read_next_word(line::const_iterator it, line::const_iterator it_end)
+namespace
   {
-  std::wstring out;
-  while (it != it_end && *it != L' ' && *it != L',' && *it != L'(' && *it != L'{' && *it != L')' && *it != L'}' && *it != L'[' && *it != L']'&& *it != L'\n' && *it != L'\t' && *it != L'\r')
+  line _make_line(const std::wstring& chars)
     {
-    out.push_back(*it);
-    ++it;
+    auto trans = line().transient();
+    for (auto ch : chars)
+      trans.push_back(ch);
+    return trans.persistent();
+    }
+
+  void _append(std::wstring& out, const line& ln, int64_t from, int64_t to)
+    {
+    out.insert(out.end(), ln.begin() + from, ln.begin() + to);
     }
-  return out;
+  }
+
+file_buffer replace_all(file_buffer fb, const search_pattern& pattern, const std::wstring& replace_txt, position from, position to, const env_settings& s)
+  {
+  if (empty(pattern) || fb.content.empty())
+    return fb;
+  auto matches = find_all_matches(fb.content, pattern, from, to);
+  if (matches.empty())
+    return fb;
+
+  const int64_t first_row = matches.front().first.row;
+  auto trans = text().transient();
+  int64_t new_rows = 0; // rows pushed to trans
+  std::wstring current; // the row under construction
+  int64_t row = first_row;
+  int64_t col = 0;
+  position new_pos;
+  for (const auto& m : matches)
+    {
+    for (; row < m.first.row; ++row, col = 0)
+      {
+      const line& ln = fb.content[(uint32_t)row];
+      if (col == 0 && current.empty()) // row is untouched
+        trans.push_back(ln);
+      else
+        {
+        _append(current, ln, col, ln.size());
+        trans.push_back(_make_line(current));
+        current.clear();
+        }
+      ++new_rows;
+      }
+    _append(current, fb.content[(uint32_t)row], col, m.first.col);
+    const std::wstring replacement = pattern.re.empty() ? replace_txt : expand_replacement(replace_txt, m.groups, fb.content[(uint32_t)row]);
+    for (auto ch : replacement)
+      {
+      current.push_back(ch);
+      if (ch == L'\n')
+        {
+        trans.push_back(_make_line(current));
+        current.clear();
+        ++new_rows;
+        }
+      }
+    new_pos = position(new_rows, (int64_t)current.size());
+    row = m.last.row;
+    col = m.last.col + 1;
+    if (col >= (int64_t)fb.content[(uint32_t)row].size())
+      {
+      ++row;
+      col = 0;
+      }
+    }
+  if (row < (int64_t)fb.content.size())
+    {
+    if (col != 0 || !current.empty())
+      {
+      const line& ln = fb.content[(uint32_t)row];
+      _append(current, ln, col, ln.size());
+      trans.push_back(_make_line(current));
+      ++new_rows;
+      ++row;
+      }
+    }
+  else
+    {
+    trans.push_back(_make_line(current)); // the last row of the text
+    ++new_rows;
+    }
+
+  fb = _push_undo(fb, ek_other, s);
+  _track_rows(fb, first_row, row - 1);
+  fb.revision = ++fb.last_revision;
+  fb = _replace_rows(fb, first_row, row - first_row, trans.persistent());
+  fb.pos = position(first_row + new_pos.row, new_pos.col);
+  fb.start_selection = std::nullopt;
+  fb.rectangular_selection = false;
+  fb.xpos = get_x_position(fb, s);
+  return fb;
+  }
+
+file_buffer replace_all(file_buffer fb, text find_txt, const std::wstring& replace_txt, position from, position to, const env_settings& s)
+  {
+  if (find_txt.empty())
+    return fb;
+  return replace_all(fb, make_search_pattern(find_txt), replace_txt, from, to, s);
   }
 
 namespace
@@ -1235,10 +2198,10 @@ namespace
     return false;
     }
 
-  uint8_t _get_end_of_line_lexer_status(file_buffer fb, int64_t row, uint8_t status_at_begin_of_line)
+  uint8_t _get_end_of_line_lexer_status(const file_buffer& fb, int64_t row, uint8_t status_at_begin_of_line)
     {
     uint8_t current_status = status_at_begin_of_line;
-    line ln = fb.content[row];
+    const line& ln = fb.content[(uint32_t)row];
     auto it = ln.begin();
     auto prev_it = it;
     auto prevprev_it = prev_it;
@@ -1297,6 +2260,31 @@ namespace
     return current_status;
     }
 
+  const uint8_t nr_of_lexer_states = 3;
+
+  /*
+  Lexes the rows [first_row, last_row) once for each state at the begin of first_row. states[s][i] is then
+  the state at the begin of row first_row + i + 1 when first_row begins in state s. Once two entry states
+  lead to the same state they stay equal, so each row is mostly lexed only once.
+  */
+  void _lex_rows_for_all_states(std::array<std::vector<uint8_t>, nr_of_lexer_states>& states, const file_buffer& fb, int64_t first_row, int64_t last_row)
+    {
+    std::array<uint8_t, nr_of_lexer_states> current = { lexer_normal, lexer_inside_multiline_comment, lexer_inside_multiline_string };
+    for (auto& st : states)
+      st.reserve((size_t)(last_row - first_row));
+    for (int64_t row = first_row; row < last_row; ++row)
+      {
+      const std::array<uint8_t, nr_of_lexer_states> entry = current; // current is updated in the loop below
+      for (uint8_t s = 0; s < nr_of_lexer_states; ++s)
+        {
+        uint8_t j = 0;
+        while (j < s && entry[j] != entry[s])
+          ++j;
+        current[s] = j < s ? states[j].back() : _get_end_of_line_lexer_status(fb, row, current[s]);
+        states[s].push_back(current[s]);
+        }
+      }
+    }
   }
 
 uint8_t get_end_of_line_lexer_status(file_buffer fb, int64_t row)
@@ -1311,172 +2299,298 @@ file_buffer init_lexer_status(file_buffer fb)
   lexer_status ls;
   auto trans = ls.transient();
 
-  trans.push_back(lexer_normal);
-  for (int64_t row = 1; row < fb.content.size(); ++row)
+  const int64_t minimum_rows_per_chunk = 16384;
+  const int64_t nr_of_rows = (int64_t)fb.content.size();
+  int64_t nr_of_chunks = std::thread::hardware_concurrency();
+  if (nr_of_chunks == 0)
+    nr_of_chunks = 1;
+  if (nr_of_rows / minimum_rows_per_chunk < nr_of_chunks)
+    nr_of_chunks = nr_of_rows / minimum_rows_per_chunk;
+  if (fb.syntax.multiline_begin.empty() && fb.syntax.multistring_begin.empty()) // every row starts in lexer_normal
+    {
+    for (int64_t row = 0; row < nr_of_rows; ++row)
+      trans.push_back(lexer_normal);
+    }
+  else if (nr_of_chunks < 2)
+    {
+    trans.push_back(lexer_normal);
+    for (int64_t row = 1; row < nr_of_rows; ++row)
+      {
+      trans.push_back(_get_end_of_line_lexer_status(fb, row - 1, trans.back()));
+      }
+    }
+  else
     {
-    trans.push_back(_get_end_of_line_lexer_status(fb, row - 1, trans.back()));
+    /*
+    Only the first chunk knows its entry state. The other chunks are lexed for every possible entry state
+    in parallel, and the entry state of each chunk follows from the exit state of the chunk before it.
+    */
+    std::vector<std::array<std::vector<uint8_t>, nr_of_lexer_states>> chunks(nr_of_chunks);
+    std::vector<std::thread> threads;
+    for (int64_t i = 1; i < nr_of_chunks; ++i)
+      {
+      threads.emplace_back([&, i]()
+        {
+        _lex_rows_for_all_states(chunks[i], fb, ((nr_of_rows - 1) * i) / nr_of_chunks, ((nr_of_rows - 1) * (i + 1)) / nr_of_chunks);
+        });
+      }
+    trans.push_back(lexer_normal);
+    for (int64_t row = 1; row <= (nr_of_rows - 1) / nr_of_chunks; ++row)
+      trans.push_back(_get_end_of_line_lexer_status(fb, row - 1, trans.back()));
+    for (auto& t : threads)
+      t.join();
+    for (int64_t i = 1; i < nr_of_chunks; ++i)
+      {
+      const auto& states = chunks[i][trans.back()];
+      for (uint8_t st : states)
+        trans.push_back(st);
+      }
     }
 
   fb.lex = trans.persistent();
+  fb.lex_pending_row = std::numeric_limits<int64_t>::max();
+  _damage_rows(fb, 0, (int64_t)fb.content.size() - 1);
   return fb;
   }
 
 file_buffer update_lexer_status(file_buffer fb, int64_t row)
+  {
+  return update_lexer_status(fb, row, row);
+  }
+
+file_buffer update_lexer_status(file_buffer fb, int64_t from_row, int64_t to_row)
   {
   assert(!fb.content.empty());
   if (fb.syntax.single_line.empty() && fb.syntax.multiline_begin.empty() && fb.syntax.multistring_begin.empty())
     return fb;
+  if (fb.lex_pending_row <= from_row) // the status at the begin of from_row is not known yet
+    return fb;
+  if (lexer_status_is_pending(fb))
+    {
+    /*
+    Rows may have been inserted or erased, so the pending rows after from_row cannot be told apart from
+    the ones that this edit changed. All rows after from_row become pending.
+    */
+    fb.lex_pending_row = from_row + 1;
+    return fb;
+    }
 
+  const int64_t max_rows = 1024; // rows lexed at once, the others are left to validate_lexer_status
   auto trans = fb.lex.transient();
-  /*
-  
-  while (trans.size() < fb.content.size())
-    trans.push_back(lexer_normal);
-  while (trans.size() > fb.content.size())
-    trans.pop_back();
-    */
   assert(trans.size() == fb.content.size());
 
-  for (int64_t r = row; r < fb.content.size()-1; ++r)
+  const int64_t last_row = (int64_t)fb.content.size() - 1;
+  int64_t r = from_row;
+  int64_t first_changed = std::numeric_limits<int64_t>::max();
+  int64_t last_changed = -1;
+  bool done = false;
+  for (; r < last_row && r - from_row < max_rows; ++r)
     {
     uint8_t eol = _get_end_of_line_lexer_status(fb, r, trans[r]);
-    if (eol == trans[r + 1])
+    if (eol != trans[r + 1])
+      {
+      if (first_changed > r + 1)
+        first_changed = r + 1;
+      last_changed = r + 1;
+      trans.set(r + 1, eol);
+      }
+    else if (r >= to_row)
+      {
+      done = true;
       break;
-    trans.set(r + 1, eol);
+      }
     }
+  if (!done && r < last_row)
+    fb.lex_pending_row = r + 1;
 
   fb.lex = trans.persistent();
+  if (first_changed <= last_changed)
+    _damage_rows(fb, first_changed, last_changed);
   return fb;
   }
 
-file_buffer update_lexer_status(file_buffer fb, int64_t from_row, int64_t to_row)
+file_buffer validate_lexer_status(file_buffer fb, int64_t last_row)
   {
-  assert(!fb.content.empty());
-  if (fb.syntax.single_line.empty() && fb.syntax.multiline_begin.empty() && fb.syntax.multistring_begin.empty())
+  if (!lexer_status_is_pending(fb) || fb.lex_pending_row > last_row)
     return fb;
-
+  if (last_row >= (int64_t)fb.content.size())
+    last_row = (int64_t)fb.content.size() - 1;
   auto trans = fb.lex.transient();
-  /*  while (trans.size() < fb.content.size())
-    trans.push_back(lexer_normal);
-  while (trans.size() > fb.content.size())
-    trans.pop_back();
-    */
-  assert(trans.size() == fb.content.size());
-
-  while (to_row >= fb.content.size() - 1)
-    --to_row;
-
-  int64_t r = from_row;
-  for (; r <= to_row; ++r)
+  int64_t first_changed = std::numeric_limits<int64_t>::max();
+  int64_t last_changed = -1;
+  for (int64_t r = fb.lex_pending_row - 1; r < last_row; ++r)
     {
     uint8_t eol = _get_end_of_line_lexer_status(fb, r, trans[r]);
-    trans.set(r + 1, eol);
-    }
-  for (; r < fb.content.size() - 1; ++r)
-    {
-    uint8_t eol = _get_end_of_line_lexer_status(fb, r, trans[r]);
-    if (eol == trans[r + 1])
-      break;
-    trans.set(r + 1, eol);
+    if (eol != trans[r + 1])
+      {
+      if (first_changed > r + 1)
+        first_changed = r + 1;
+      last_changed = r + 1;
+      trans.set(r + 1, eol);
+      }
     }
-
   fb.lex = trans.persistent();
+  fb.lex_pending_row = last_row + 1 < (int64_t)fb.content.size() ? last_row + 1 : std::numeric_limits<int64_t>::max();
+  if (first_changed <= last_changed)
+    _damage_rows(fb, first_changed, last_changed);
   return fb;
   }
 
-std::vector<std::pair<int64_t, text_type>> get_text_type(file_buffer fb, int64_t row)
+bool lexer_status_is_pending(const file_buffer& fb)
   {
-  std::vector<std::pair<int64_t, text_type>> out;
-  out.emplace_back((int64_t)0, (text_type)fb.lex[row]);
-  //if (fb.syntax.single_line.empty() && fb.syntax.multiline_begin.empty() && fb.syntax.multistring_begin.empty())
-  //  return out;
-  if (!fb.syntax.should_highlight)
-    return out;
+  return fb.lex_pending_row != std::numeric_limits<int64_t>::max(); // compared to the number of rows, it could be outdated by an edit that inserted or erased rows
+  }
 
-  uint8_t current_status = fb.lex[row];
-  line ln = fb.content[row];
-  auto it = ln.begin();
-  auto prev_it = it;
-  auto prevprev_it = prev_it;
-  auto it_end = ln.end();
-  bool inside_single_line_comment = false;
-  bool inside_single_line_string = false;
-  bool inside_quotes = false;
-  int64_t col = 0;
-  for (; it != it_end; ++it, ++col)
+namespace
+  {
+  std::vector<std::pair<int64_t, text_type>> _compute_text_type(const file_buffer& fb, int64_t row)
     {
-    if (inside_single_line_comment)
-      break;
-    if (current_status == lexer_normal)
+    std::vector<std::pair<int64_t, text_type>> out;
+    out.emplace_back((int64_t)0, (text_type)fb.lex[row]);
+    //if (fb.syntax.single_line.empty() && fb.syntax.multiline_begin.empty() && fb.syntax.multistring_begin.empty())
+    //  return out;
+    if (!fb.syntax.should_highlight)
+      return out;
+
+    uint8_t current_status = fb.lex[row];
+    line ln = fb.content[row];
+    auto it = ln.begin();
+    auto prev_it = it;
+    auto prevprev_it = prev_it;
+    auto it_end = ln.end();
+    bool inside_single_line_comment = false;
+    bool inside_single_line_string = false;
+    bool inside_quotes = false;
+    int64_t col = 0;
+    for (; it != it_end; ++it, ++col)
       {
-      if (!inside_single_line_string && !inside_quotes && _is_next_word(it, it_end, fb.syntax.multiline_begin))
-        {
-        out.emplace_back((int64_t)col, tt_comment);
-        current_status = lexer_inside_multiline_comment;
-        it += fb.syntax.multiline_begin.length()-1;
-        col += fb.syntax.multiline_begin.length()-1;
-        }
-      else if (!inside_single_line_string && !inside_quotes && _is_next_word(it, it_end, fb.syntax.multistring_begin))
-        {
-        out.emplace_back((int64_t)col, tt_string);
-        current_status = lexer_inside_multiline_string;
-        it += fb.syntax.multistring_begin.length()-1;
-        col += fb.syntax.multistring_begin.length()-1;
-        }
-      else if (!inside_single_line_string && !inside_quotes && _is_next_word(it, it_end, fb.syntax.single_line))
+      if (inside_single_line_comment)
+        break;
+      if (current_status == lexer_normal)
         {
-        inside_single_line_comment = true;
-        out.emplace_back((int64_t)col, tt_comment);
-        }
-      else if (!inside_quotes && *it == L'"' && (*prev_it != L'\\' || *prevprev_it == L'\\'))
-        {                
-        inside_single_line_string = !inside_single_line_string;
-        if (inside_single_line_string)
+        if (!inside_single_line_string && !inside_quotes && _is_next_word(it, it_end, fb.syntax.multiline_begin))
+          {
+          out.emplace_back((int64_t)col, tt_comment);
+          current_status = lexer_inside_multiline_comment;
+          it += fb.syntax.multiline_begin.length()-1;
+          col += fb.syntax.multiline_begin.length()-1;
+          }
+        else if (!inside_single_line_string && !inside_quotes && _is_next_word(it, it_end, fb.syntax.multistring_begin))
+          {
           out.emplace_back((int64_t)col, tt_string);
-        else
-          out.emplace_back((int64_t)col+1, tt_normal);
+          current_status = lexer_inside_multiline_string;
+          it += fb.syntax.multistring_begin.length()-1;
+          col += fb.syntax.multistring_begin.length()-1;
+          }
+        else if (!inside_single_line_string && !inside_quotes && _is_next_word(it, it_end, fb.syntax.single_line))
+          {
+          inside_single_line_comment = true;
+          out.emplace_back((int64_t)col, tt_comment);
+          }
+        else if (!inside_quotes && *it == L'"' && (*prev_it != L'\\' || *prevprev_it == L'\\'))
+          {                
+          inside_single_line_string = !inside_single_line_string;
+          if (inside_single_line_string)
+            out.emplace_back((int64_t)col, tt_string);
+          else
+            out.emplace_back((int64_t)col+1, tt_normal);
+          }
+        else if (fb.syntax.uses_quotes_for_chars && !inside_single_line_string && *it == L'\'' && (*prev_it != L'\\' || *prevprev_it == L'\\'))
+          {
+          inside_quotes = !inside_quotes;
+          if (inside_quotes)
+            out.emplace_back((int64_t)col, tt_string);
+          else
+            out.emplace_back((int64_t)col + 1, tt_normal);
+          }
         }
-      else if (fb.syntax.uses_quotes_for_chars && !inside_single_line_string && *it == L'\'' && (*prev_it != L'\\' || *prevprev_it == L'\\'))
+      else if (current_status == lexer_inside_multiline_comment)
         {
-        inside_quotes = !inside_quotes;
-        if (inside_quotes)
-          out.emplace_back((int64_t)col, tt_string);
-        else
-          out.emplace_back((int64_t)col + 1, tt_normal);
+        if (_is_next_word(it, it_end, fb.syntax.multiline_end))
+          {
+          current_status = lexer_normal;
+          it += fb.syntax.multiline_end.length()-1;
+          col += fb.syntax.multiline_end.length()-1;
+          out.emplace_back((int64_t)col+1, tt_normal);
+          }
         }
-      }
-    else if (current_status == lexer_inside_multiline_comment)
-      {
-      if (_is_next_word(it, it_end, fb.syntax.multiline_end))
+      else if (current_status == lexer_inside_multiline_string)
         {
-        current_status = lexer_normal;
-        it += fb.syntax.multiline_end.length()-1;
-        col += fb.syntax.multiline_end.length()-1;
-        out.emplace_back((int64_t)col+1, tt_normal);
+        if (_is_next_word(it, it_end, fb.syntax.multistring_end))
+          {
+          current_status = lexer_normal;
+          it += fb.syntax.multistring_end.length()-1;
+          col += fb.syntax.multistring_end.length()-1;
+          out.emplace_back((int64_t)col+1, tt_normal);
+          }
         }
-      }
-    else if (current_status == lexer_inside_multiline_string)
+      prevprev_it = prev_it;
+      prev_it = it;
+      }  
+
+    std::reverse(out.begin(), out.end());
+    out.erase(std::unique(out.begin(), out.end(), [](const std::pair<int64_t, text_type>& left, const std::pair<int64_t, text_type>& right)
       {
-      if (_is_next_word(it, it_end, fb.syntax.multistring_end))
-        {
-        current_status = lexer_normal;
-        it += fb.syntax.multistring_end.length()-1;
-        col += fb.syntax.multistring_end.length()-1;
-        out.emplace_back((int64_t)col+1, tt_normal);
-        }
-      }
-    prevprev_it = prev_it;
-    prev_it = it;
-    }  
+      return left.first == right.first;
+      })
+    , out.end());
+
+    return out;
+    }
 
-  std::reverse(out.begin(), out.end());
-  out.erase(std::unique(out.begin(), out.end(), [](const std::pair<int64_t, text_type>& left, const std::pair<int64_t, text_type>& right)
+  bool _same_syntax(const syntax_settings& left, const syntax_settings& right)
     {
-    return left.first == right.first;
-    })
-  , out.end());
+    return left.multiline_begin == right.multiline_begin && left.multiline_end == right.multiline_end && left.single_line == right.single_line
+      && left.multistring_begin == right.multistring_begin && left.multistring_end == right.multistring_end && left.uses_quotes_for_chars == right.uses_quotes_for_chars
+      && left.should_highlight == right.should_highlight;
+    }
+  }
 
-  return out;
+std::vector<std::pair<int64_t, text_type>> get_text_type(const file_buffer& fb, int64_t row)
+  {
+  return _compute_text_type(fb, row);
+  }
+
+void sync_text_type_index(text_type_index& ti, const file_buffer& fb)
+  {
+  const int64_t nr_of_rows = (int64_t)fb.content.size();
+  if (fb.damage_id == 0 || ti.damage_id != fb.damage_id || !_same_syntax(ti.syntax, fb.syntax))
+    {
+    ti.rows.clear();
+    ti.nr_of_rows = nr_of_rows;
+    ti.syntax = fb.syntax;
+    ti.damage_id = fb.damage_id;
+    return;
+    }
+  const int64_t old_nr_of_rows = ti.nr_of_rows;
+  const int64_t first = std::min<int64_t>(fb.damage_first_row, std::min<int64_t>(old_nr_of_rows, nr_of_rows));
+  const int64_t old_end = std::max<int64_t>(old_nr_of_rows - fb.damage_tail_rows, first);
+  const int64_t new_end = std::max<int64_t>(nr_of_rows - fb.damage_tail_rows, first);
+  ti.nr_of_rows = nr_of_rows;
+  if (first == old_end && old_end == new_end)
+    return;
+  std::unordered_map<int64_t, std::vector<std::pair<int64_t, text_type>>> rows;
+  for (auto& r : ti.rows)
+    {
+    if (r.first < first)
+      rows.emplace(r.first, std::move(r.second));
+    else if (r.first >= old_end)
+      rows.emplace(r.first + new_end - old_end, std::move(r.second)); // the undamaged rows at the end move along with the inserted or erased rows
+    }
+  ti.rows.swap(rows);
+  }
+
+const std::vector<std::pair<int64_t, text_type>>& get_text_type(text_type_index& ti, const file_buffer& fb, int64_t row)
+  {
+  const size_t max_rows = 4096;
+  auto it = ti.rows.find(row);
+  if (it != ti.rows.end())
+    return it->second;
+  if (ti.rows.size() >= max_rows)
+    ti.rows.clear();
+  auto& types = ti.rows[row];
+  types = _compute_text_type(fb, row);
+  return types;
   }
 
 bool valid_position(text txt, position pos)
@@ -1495,68 +2609,292 @@ bool valid_position(file_buffer fb, position pos)
   return valid_position(fb.content, pos);
   }
 
-position find_corresponding_token(file_buffer fb, position tokenpos, int64_t minrow, int64_t maxrow)
-  {  
-  if (!valid_position(fb, tokenpos))
+bool is_bracket(wchar_t ch)
+  {
+  switch (ch)
+    {
+    case L'(': case L')': case L'{': case L'}': case L'[': case L']': return true;
+    default: return false;
+    }
+  }
+
+namespace
+  {
+  const int64_t bracket_block_rows = 64; // rows per leaf of the segment tree in bracket_index
+
+  int _bracket_kind(int& value, wchar_t ch)
+    {
+    switch (ch)
+      {
+      case L'(': value = 1; return 0;
+      case L')': value = -1; return 0;
+      case L'{': value = 1; return 1;
+      case L'}': value = -1; return 1;
+      case L'[': value = 1; return 2;
+      case L']': value = -1; return 2;
+      default: value = 0; return -1;
+      }
+    }
+
+  /*
+  The brackets in row that are not inside a comment or a string, as (column, bracket) in order.
+  Rows without brackets are not lexed.
+  */
+  void _code_brackets(std::vector<std::pair<int64_t, wchar_t>>& brackets, const file_buffer& fb, int64_t row)
+    {
+    brackets.clear();
+    const line& ln = fb.content[row];
+    int64_t col = 0;
+    for (auto it = ln.begin(); it != ln.end(); ++it, ++col)
+      {
+      if (is_bracket(*it))
+        brackets.emplace_back(col, *it);
+      }
+    if (brackets.empty())
+      return;
+    const auto& tt = get_text_type(fb, row); // sorted from back to front
+    size_t t = tt.size() - 1;
+    auto out = brackets.begin();
+    for (const auto& br : brackets)
+      {
+      while (t > 0 && tt[t - 1].first <= br.first)
+        --t;
+      if (tt[t].second == tt_normal)
+        *out++ = br;
+      }
+    brackets.erase(out, brackets.end());
+    }
+
+  bracket_summary _summarise_row(std::vector<std::pair<int64_t, wchar_t>>& brackets, const file_buffer& fb, int64_t row)
+    {
+    bracket_summary bs = {};
+    _code_brackets(brackets, fb, row);
+    for (const auto& br : brackets)
+      {
+      int value;
+      const int kind = _bracket_kind(value, br.second);
+      bs.net[kind] += value;
+      bs.min[kind] = std::min<int32_t>(bs.min[kind], bs.net[kind]);
+      }
+    return bs;
+    }
+
+  bracket_summary _combine(const bracket_summary& left, const bracket_summary& right)
+    {
+    bracket_summary bs;
+    for (int kind = 0; kind < 3; ++kind)
+      {
+      bs.net[kind] = left.net[kind] + right.net[kind];
+      bs.min[kind] = std::min<int32_t>(left.min[kind], left.net[kind] + right.min[kind]);
+      }
+    return bs;
+    }
+
+  void _build_bracket_leaf(bracket_index& bi, int64_t block)
+    {
+    bracket_summary bs = {};
+    const int64_t last = std::min<int64_t>((block + 1) * bracket_block_rows, (int64_t)bi.rows.size());
+    for (int64_t r = block * bracket_block_rows; r < last; ++r)
+      bs = _combine(bs, bi.rows[r]);
+    bi.tree[bi.leaves + block] = bs;
+    }
+
+  void _build_bracket_tree(bracket_index& bi)
+    {
+    const int64_t blocks = ((int64_t)bi.rows.size() + bracket_block_rows - 1) / bracket_block_rows;
+    bi.leaves = 1;
+    while (bi.leaves < blocks)
+      bi.leaves *= 2;
+    bi.tree.assign(2 * bi.leaves, bracket_summary());
+    for (int64_t block = 0; block < blocks; ++block)
+      _build_bracket_leaf(bi, block);
+    for (int64_t i = bi.leaves - 1; i > 0; --i)
+      bi.tree[i] = _combine(bi.tree[2 * i], bi.tree[2 * i + 1]);
+    }
+
+  /*
+  Returns the first row at or after row in which the brackets of kind drop below 0, starting with depth before row.
+  depth is updated to the depth in front of the returned row. Returns -1 if there is no such row.
+  */
+  int64_t _find_row_forward(int64_t& depth, const bracket_index& bi, int kind, int64_t row)
+    {
+    const int64_t n = (int64_t)bi.rows.size();
+    for (; row < n && row % bracket_block_rows != 0; ++row)
+      {
+      if (depth + bi.rows[row].min[kind] < 0)
+        return row;
+      depth += bi.rows[row].net[kind];
+      }
+    if (row >= n)
+      return -1;
+    int64_t i = bi.leaves + row / bracket_block_rows;
+    while (depth + bi.tree[i].min[kind] >= 0) // climb to the next subtree to the right
+      {
+      depth += bi.tree[i].net[kind];
+      while (i & 1)
+        i >>= 1;
+      if (i == 0)
+        return -1;
+      ++i;
+      }
+    while (i < bi.leaves)
+      {
+      if (depth + bi.tree[2 * i].min[kind] < 0)
+        i = 2 * i;
+      else
+        {
+        depth += bi.tree[2 * i].net[kind];
+        i = 2 * i + 1;
+        }
+      }
+    for (row = (i - bi.leaves) * bracket_block_rows; row < n; ++row)
+      {
+      if (depth + bi.rows[row].min[kind] < 0)
+        return row;
+      depth += bi.rows[row].net[kind];
+      }
+    return -1;
+    }
+
+  /*
+  Mirror of _find_row_forward: walking backwards an opening bracket counts -1 and a closing bracket +1.
+  The lowest partial sum of a range walked backwards equals min - net.
+  */
+  int64_t _find_row_backward(int64_t& depth, const bracket_index& bi, int kind, int64_t row)
+    {
+    for (; row >= 0 && row % bracket_block_rows != bracket_block_rows - 1; --row)
+      {
+      if (depth + bi.rows[row].min[kind] - bi.rows[row].net[kind] < 0)
+        return row;
+      depth -= bi.rows[row].net[kind];
+      }
+    if (row < 0)
+      return -1;
+    int64_t i = bi.leaves + row / bracket_block_rows;
+    while (depth + bi.tree[i].min[kind] - bi.tree[i].net[kind] >= 0) // climb to the next subtree to the left
+      {
+      depth -= bi.tree[i].net[kind];
+      while (!(i & 1))
+        i >>= 1;
+      if (i == 1)
+        return -1;
+      --i;
+      }
+    while (i < bi.leaves)
+      {
+      const bracket_summary& right = bi.tree[2 * i + 1];
+      if (depth + right.min[kind] - right.net[kind] < 0)
+        i = 2 * i + 1;
+      else
+        {
+        depth -= right.net[kind];
+        i = 2 * i;
+        }
+      }
+    const int64_t first = (i - bi.leaves) * bracket_block_rows;
+    for (row = std::min<int64_t>(first + bracket_block_rows, (int64_t)bi.rows.size()) - 1; row >= first; --row)
+      {
+      if (depth + bi.rows[row].min[kind] - bi.rows[row].net[kind] < 0)
+        return row;
+      depth -= bi.rows[row].net[kind];
+      }
+    return -1;
+    }
+  }
+
+void sync_bracket_index(bracket_index& bi, const file_buffer& fb)
+  {
+  std::vector<std::pair<int64_t, wchar_t>> brackets;
+  const int64_t nr_of_rows = (int64_t)fb.content.size();
+  if (fb.damage_id == 0 || bi.damage_id != fb.damage_id)
+    {
+    bi.damage_id = fb.damage_id;
+    bi.rows.resize(nr_of_rows);
+    for (int64_t r = 0; r < nr_of_rows; ++r)
+      bi.rows[r] = _summarise_row(brackets, fb, r);
+    _build_bracket_tree(bi);
+    return;
+    }
+  const int64_t old_nr_of_rows = (int64_t)bi.rows.size();
+  const int64_t first = std::min<int64_t>(fb.damage_first_row, std::min<int64_t>(old_nr_of_rows, nr_of_rows));
+  const int64_t old_end = std::max<int64_t>(old_nr_of_rows - fb.damage_tail_rows, first);
+  const int64_t new_end = std::max<int64_t>(nr_of_rows - fb.damage_tail_rows, first);
+  if (old_end == new_end)
+    {
+    if (first == new_end)
+      return;
+    for (int64_t r = first; r < new_end; ++r)
+      bi.rows[r] = _summarise_row(brackets, fb, r);
+    const int64_t first_block = first / bracket_block_rows;
+    const int64_t last_block = (new_end - 1) / bracket_block_rows;
+    for (int64_t block = first_block; block <= last_block; ++block)
+      _build_bracket_leaf(bi, block);
+    for (int64_t lo = (bi.leaves + first_block) / 2, hi = (bi.leaves + last_block) / 2; lo > 0; lo /= 2, hi /= 2)
+      {
+      for (int64_t i = lo; i <= hi; ++i)
+        bi.tree[i] = _combine(bi.tree[2 * i], bi.tree[2 * i + 1]);
+      }
+    return;
+    }
+  std::vector<bracket_summary> changed;
+  changed.reserve(new_end - first);
+  for (int64_t r = first; r < new_end; ++r)
+    changed.push_back(_summarise_row(brackets, fb, r));
+  bi.rows.erase(bi.rows.begin() + first, bi.rows.begin() + old_end);
+  bi.rows.insert(bi.rows.begin() + first, changed.begin(), changed.end());
+  _build_bracket_tree(bi);
+  }
+
+position find_corresponding_token(const bracket_index& bi, file_buffer fb, position tokenpos)
+  {
+  if (!valid_position(fb, tokenpos) || !is_bracket(fb.content[tokenpos.row][tokenpos.col]))
     return position(-1, -1);
-  wchar_t token = fb.content[tokenpos.row][tokenpos.col];
-  wchar_t corresponding_token = 0;
-  bool forward = true;
-  switch (token)
-    {
-    case L'(':  corresponding_token = L')'; break;
-    case L')':  corresponding_token = L'('; forward = false;  break;
-    case L'{':  corresponding_token = L'}'; break;
-    case L'}':  corresponding_token = L'{'; forward = false;  break;
-    case L'[':  corresponding_token = L']'; break;
-    case L']':  corresponding_token = L'['; forward = false;  break;
-    }
-  if (corresponding_token == 0)
+  std::vector<std::pair<int64_t, wchar_t>> brackets;
+  _code_brackets(brackets, fb, tokenpos.row);
+  auto it = std::find_if(brackets.begin(), brackets.end(), [&](const std::pair<int64_t, wchar_t>& br) { return br.first == tokenpos.col; });
+  if (it == brackets.end()) // inside a comment or a string
     return position(-1, -1);
-  int count = 0;
-  if (forward)
-    {
-    auto last_pos = get_last_position(fb);      
-    if (tokenpos == last_pos)
-      return position(-1, -1);
-    position current = get_next_position(fb, tokenpos);
-    while (current.row <= maxrow && valid_position(fb, current))
-      {
-      wchar_t current_token = fb.content[current.row][current.col];
-      if (current_token == token)
-        ++count;
-      if (current_token == corresponding_token)
+  int value;
+  const int kind = _bracket_kind(value, it->second);
+  int64_t depth = 0;
+  if (value > 0)
+    {
+    int64_t row = tokenpos.row;
+    ++it;
+    for (;;)
+      {
+      for (; it != brackets.end(); ++it)
         {
-        if (count == 0)
-          return current;
-        else
-          --count;
+        int v;
+        if (_bracket_kind(v, it->second) == kind && (depth += v) < 0)
+          return position(row, it->first);
         }
-      current = get_next_position(fb, current);
+      row = _find_row_forward(depth, bi, kind, row + 1);
+      if (row < 0)
+        return position(-1, -1);
+      _code_brackets(brackets, fb, row);
+      it = brackets.begin();
       }
     }
   else
     {
-    auto first_pos = position(0, 0);
-    if (tokenpos == first_pos)
-      return position(-1, -1);
-    position current = get_previous_position(fb, tokenpos);
-    while (current.row >= minrow && valid_position(fb, current))
+    int64_t row = tokenpos.row;
+    auto rit = std::make_reverse_iterator(it);
+    for (;;)
       {
-      wchar_t current_token = fb.content[current.row][current.col];
-      if (current_token == token)
-        ++count;
-      if (current_token == corresponding_token)
+      for (; rit != brackets.rend(); ++rit)
         {
-        if (count == 0)
-          return current;
-        else
-          --count;
+        int v;
+        if (_bracket_kind(v, rit->second) == kind && (depth -= v) < 0)
+          return position(row, rit->first);
         }
-      current = get_previous_position(fb, current);
+      row = _find_row_backward(depth, bi, kind, row - 1);
+      if (row < 0)
+        return position(-1, -1);
+      _code_brackets(brackets, fb, row);
+      rit = brackets.rbegin();
       }
     }
-  return position(-1, -1);
   }
 
 position get_indentation_at_row(file_buffer fb, int64_t row)
@@ -3,12 +3,19 @@
 #include <immutable/vector.h>
 #include <vector>
 #include <string>
+#include <functional>
+#include <memory>
 #include <optional>
+#include <unordered_map>
 #include <stdint.h>
 
-
+#ifdef JED_COMPACT_LINES
+#include "compact_line.h"
+typedef compact_line line;
+#else
 typedef immutable::vector<wchar_t, false, 5> line;
-typedef immutable::vector<immutable::vector<wchar_t, false, 5>, false, 5> text;
+#endif
+typedef immutable::vector<line, false, 5> text;
 typedef immutable::vector<uint8_t, false, 5> lexer_status;
 
 #define lexer_normal 0
@@ -53,14 +60,46 @@ struct position
 
   };
 
-struct snapshot
+enum edit_kind
+  {
+  ek_other,
+  ek_typing,
+  ek_backspace,
+  ek_delete
+  };
+
+/*
+One step in the undo history: the rows [row, row + old_lines.size()) of the text before the edit
+were replaced by new_lines. Consecutive keystrokes on the same row are merged in one record.
+*/
+struct undo_record
+  {
+  int64_t row;
+  text old_lines, new_lines;
+  position pos_before, pos_after;
+  std::optional<position> start_selection_before, start_selection_after;
+  bool rectangular_selection_before, rectangular_selection_after;
+  uint64_t revision_before, revision_after;
+  uint64_t memory; // estimated number of bytes held by this record
+  edit_kind kind;
+  position keystroke_pos_after; // where the last keystroke of a typing, backspace or delete record left the cursor
+  };
+
+/*
+Edits since the last push_undo. Rows [0, first_row) and the last tail_rows rows of the content
+are unchanged since the group was opened, so only the rows in between end up in the undo record.
+*/
+struct undo_group
   {
   text content;
-  lexer_status lex;
   position pos;
   std::optional<position> start_selection;
-  uint8_t modification_mask;
   bool rectangular_selection;
+  uint64_t revision;
+  int64_t first_row, tail_rows;
+  edit_kind kind;
+  bool word_start;
+  position keystroke_pos; // actual position of the cursor when the group was opened
   };
 
 struct syntax_settings
@@ -75,21 +114,29 @@ struct file_buffer
   {
   text content;
   lexer_status lex;
-  immutable::vector<snapshot, false> history;
+  immutable::vector<undo_record, false> history;
+  std::optional<undo_group> open_undo_group;
+  uint64_t undo_memory;
   syntax_settings syntax;
   std::string name;  
   position pos;
   int64_t xpos;
   std::optional<position> start_selection;  
-  uint64_t undo_redo_index;
-  uint8_t modification_mask;
+  uint64_t undo_redo_index; // number of records in history that are currently applied
+  uint64_t revision; // identifies the current content, every modification gets a new revision
+  uint64_t last_revision; // highest revision handed out so far
+  uint64_t saved_revision; // revision of the content on disk
   bool rectangular_selection;
+  int64_t damage_first_row, damage_tail_rows; // rows [0, damage_first_row) and the last damage_tail_rows rows did not change content or lexer status since clear_damage
+  uint64_t damage_id; // set by clear_damage, 0 if the buffer was never cleared
+  int64_t lex_pending_row; // lex is up to date before this row, the maximum int64_t if nothing is pending, see validate_lexer_status
   };
 
 struct env_settings
   {
   int tab_space;
   bool show_all_characters;
+  uint64_t undo_memory_limit; // in bytes, older undo records are discarded beyond this limit
   };
 
 uint32_t character_width(uint32_t character, int64_t x_pos, const env_settings& s);
@@ -120,8 +167,36 @@ file_buffer make_empty_buffer();
 
 file_buffer read_from_file(std::string filename);
 
+/*
+Decodes the remainder of a file on a background thread, see read_from_file_progressively.
+*/
+struct file_loader;
+
+/*
+Reads about the first first_bytes bytes of filename, up to the end of a row, and decodes the other rows of the
+file on a background thread that calls rows_ready (from that thread) whenever new rows can be appended with
+append_loaded_rows. loader is reset if the whole file was read, e.g. because the file is small.
+*/
+file_buffer read_from_file_progressively(std::shared_ptr<file_loader>& loader, std::string filename, uint64_t first_bytes, std::function<void()> rows_ready);
+
+/*
+Appends the rows that loader decoded since the last call at the end of fb. This is not an undo step, and an
+unmodified buffer stays unmodified. finished becomes true when the whole file is in fb.
+*/
+file_buffer append_loaded_rows(bool& finished, file_buffer fb, file_loader& loader);
+
+double loaded_fraction(const file_loader& loader);
+
+/*
+Writes the buffer to a temporary file next to filename, flushes it to disk and then renames it
+over filename, so that an interrupted save never leaves a truncated file behind. Files with hardlinks,
+files of another owner or group, and files in a folder where the temporary file cannot be created are
+overwritten in place instead.
+*/
 file_buffer save_to_file(bool& success, file_buffer fb, const std::string& filename);
 
+bool is_modified(file_buffer fb);
+
 file_buffer start_selection(file_buffer fb);
 
 file_buffer clear_selection(file_buffer fb);
@@ -132,12 +207,37 @@ file_buffer insert(file_buffer fb, std::wstring wtxt, const env_settings& s, boo
 
 file_buffer insert(file_buffer fb, text txt, const env_settings& s, bool save_undo = true);
 
+/*
+Appends the utf8 text txt at the end of the buffer, for the output of a piped process. This is not an undo step.
+If max_rows > 0, rows are dropped at the front so that at most max_rows rows remain, and the undo history is
+cleared then, as its records refer to row numbers. A cursor at the end of the text stays at the end.
+*/
+file_buffer append_output(file_buffer fb, const std::string& txt, int64_t max_rows);
+
 file_buffer erase(file_buffer fb, const env_settings& s, bool save_undo = true);
 
 file_buffer erase_right(file_buffer fb, const env_settings& s, bool save_undo = true);
 
+/*
+Starts a new undo step: all edits up to the next push_undo, undo or redo are undone together.
+*/
 file_buffer push_undo(file_buffer fb);
 
+file_buffer clear_undo_history(file_buffer fb);
+
+/*
+Maps pos, a position in the content of the given revision, to the current content, through the undo records
+that lead from that revision to the current one. A position inside text that was edited moves to the end of the
+new text. Returns std::nullopt if these edits are not in the undo history, for instance after an undo.
+*/
+std::optional<position> map_position(file_buffer fb, position pos, uint64_t revision);
+
+/*
+Marks all rows as undamaged and gives fb a new damage_id. Called after the buffer was drawn, so that the next
+draw only has to repaint the rows that were edited or whose lexer status changed in the meantime.
+*/
+file_buffer clear_damage(file_buffer fb);
+
 text get_selection(file_buffer fb, const env_settings& s);
 
 file_buffer undo(file_buffer fb, const env_settings& s);
@@ -178,12 +278,25 @@ std::string to_string(text txt);
 
 std::wstring to_wstring(text txt);
 
+struct search_pattern;
+
+file_buffer find_text(file_buffer fb, const search_pattern& pattern);
+
 file_buffer find_text(file_buffer fb, text txt);
 
 file_buffer find_text(file_buffer fb, const std::wstring& wtxt);
 
 file_buffer find_text(file_buffer fb, const std::string& txt);
 
+/*
+Replaces all non-overlapping matches of the pattern that lie completely inside [from, to] by replace_txt.
+For a regular expression, \0 to \9 in replace_txt are replaced by the capture groups of the match.
+The text is rebuilt in one pass and the replacement is a single undo step.
+*/
+file_buffer replace_all(file_buffer fb, const search_pattern& pattern, const std::wstring& replace_txt, position from, position to, const env_settings& s);
+
+file_buffer replace_all(file_buffer fb, text find_txt, const std::wstring& replace_txt, position from, position to, const env_settings& s);
+
 position get_next_position(text txt, position pos);
 
 position get_next_position(file_buffer fb, position pos);
@@ -204,6 +317,16 @@ file_buffer update_lexer_status(file_buffer fb, int64_t row);
 
 file_buffer update_lexer_status(file_buffer fb, int64_t from_row, int64_t to_row);
 
+/*
+update_lexer_status relexes at most a limited number of rows after an edit, so that an edit like opening a
+multiline comment at the top of a large file does not relex the whole file. The lexer status of the rows after that is
+pending, and is brought up to date by validate_lexer_status, up to and including last_row. Call it for the
+visible rows before drawing, and for the other rows in idle time.
+*/
+file_buffer validate_lexer_status(file_buffer fb, int64_t last_row);
+
+bool lexer_status_is_pending(const file_buffer& fb);
+
 enum text_type
   {
   tt_normal,
@@ -215,15 +338,69 @@ enum text_type
 first index in pair equals the column where the text type (second index in pair) starts.
 The text type is valid till the next index or the end of the line.
 */
-std::vector<std::pair<int64_t, text_type>> get_text_type(file_buffer fb, int64_t row);
+std::vector<std::pair<int64_t, text_type>> get_text_type(const file_buffer& fb, int64_t row);
 
 /*
-When selecting ( you want to find the corresponding ).
-This method looks for corresponding tokens, inside the range (minrow, maxrow).
+Text types of the rows that were drawn, so that drawing a row that did not change, e.g. while scrolling, does not
+lex it again. A row is found by its number, and its entry is kept as long as the damage of the buffer shows that
+it did not change, as in bracket_index. So a lookup does not depend on the length of the row.
 */
-position find_corresponding_token(file_buffer fb, position tokenpos, int64_t minrow, int64_t maxrow);
+struct text_type_index
+  {
+  std::unordered_map<int64_t, std::vector<std::pair<int64_t, text_type>>> rows;
+  int64_t nr_of_rows;
+  syntax_settings syntax;
+  uint64_t damage_id; // damage_id of the buffer when the index was last synced, 0 forces a rebuild
+  };
 
-std::wstring read_next_word(line::const_iterator it, line::const_iterator it_end);
+/*
+Drops the rows of ti that were damaged since the damage_id in ti, and moves the rows after them along with
+inserted or erased rows. All rows are dropped if the damage_id differs.
+*/
+void sync_text_type_index(text_type_index& ti, const file_buffer& fb);
+
+/*
+get_text_type through ti, which has to be in sync with fb. The returned reference is valid until the next
+call with ti.
+*/
+const std::vector<std::pair<int64_t, text_type>>& get_text_type(text_type_index& ti, const file_buffer& fb, int64_t row);
+
+/*
+Brackets of each kind, (), {} and [], counted as +1 for an opening and -1 for a closing bracket.
+net is the sum over the rows, min the lowest partial sum from the start (at most 0). Brackets inside
+comments and strings are not counted.
+*/
+struct bracket_summary
+  {
+  int32_t net[3];
+  int32_t min[3];
+  };
+
+/*
+Bracket summaries of all rows, and a segment tree over blocks of rows, so that the bracket corresponding
+to a given one is found in O(log n) rows, anywhere in the buffer.
+*/
+struct bracket_index
+  {
+  std::vector<bracket_summary> rows;
+  std::vector<bracket_summary> tree; // tree[1] is the root, the blocks are the leaves starting at tree[leaves]
+  int64_t leaves;
+  uint64_t damage_id; // damage_id of the buffer when the index was last synced, 0 forces a rebuild
+  };
+
+bool is_bracket(wchar_t ch);
+
+/*
+Brings bi up to date with fb. Only the rows that were damaged since the damage_id in bi are summarised again,
+unless the damage_id differs, then the index is built from scratch.
+*/
+void sync_bracket_index(bracket_index& bi, const file_buffer& fb);
+
+/*
+When selecting ( you want to find the corresponding ).
+bi has to be in sync with fb. Returns (-1, -1) if tokenpos is no bracket in code or if it has no match.
+*/
+position find_corresponding_token(const bracket_index& bi, file_buffer fb, position tokenpos);
 
 position get_indentation_at_row(file_buffer fb, int64_t row);
 
@@ -0,0 +1,526 @@
+#include "compact_line.h"
+
+#include <algorithm>
+#include <cassert>
+#include <new>
+
+namespace
+  {
+  typedef compact_line::leaf leaf;
+  typedef compact_line::node node;
+
+  uint32_t _required_width(const wchar_t* chars, uint32_t size)
+    {
+    uint32_t width = 1;
+    for (uint32_t i = 0; i < size; ++i)
+      {
+      uint32_t ch = (uint32_t)chars[i];
+      if (ch > 0xffff)
+        return 4;
+      if (ch > 0xff)
+        width = 2;
+      }
+    return width;
+    }
+
+  leaf* _make_leaf(const wchar_t* chars, uint32_t size)
+    {
+    uint32_t width = _required_width(chars, size);
+    void* memory = ::operator new(sizeof(leaf) + (size_t)size * width);
+    leaf* l = new (memory) leaf;
+    l->ref_count.store(1, std::memory_order_relaxed);
+    l->size = size;
+    l->width = width;
+    l->display.store(0, std::memory_order_relaxed);
+    switch (width)
+      {
+      case 1:
+      {
+      uint8_t* data = l->data();
+      for (uint32_t i = 0; i < size; ++i)
+        data[i] = (uint8_t)chars[i];
+      break;
+      }
+      case 2:
+      {
+      uint16_t* data = reinterpret_cast<uint16_t*>(l->data());
+      for (uint32_t i = 0; i < size; ++i)
+        data[i] = (uint16_t)chars[i];
+      break;
+      }
+      default:
+      {
+      uint32_t* data = reinterpret_cast<uint32_t*>(l->data());
+      for (uint32_t i = 0; i < size; ++i)
+        data[i] = (uint32_t)chars[i];
+      break;
+      }
+      }
+    return l;
+    }
+
+  void _retain(leaf* l)
+    {
+    l->ref_count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+  void _release(leaf* l)
+    {
+    if (l->ref_count.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      {
+      l->~leaf();
+      ::operator delete(l);
+      }
+    }
+
+  void _copy_from_leaf(wchar_t* out, const leaf* l, uint32_t from, uint32_t to)
+    {
+    for (uint32_t i = from; i < to; ++i)
+      *out++ = l->at(i);
+    }
+
+  uint32_t _find_leaf(const node* n, uint32_t index)
+    {
+    auto it = std::upper_bound(n->offsets.begin(), n->offsets.end(), index);
+    return (uint32_t)(std::distance(n->offsets.begin(), it) - 1);
+    }
+
+  uint64_t _character_width(uint32_t ch, uint64_t x, uint32_t tab_space, bool show_all_characters)
+    {
+    switch (ch)
+      {
+      case 9: return tab_space - (x % tab_space);
+      case 10: return show_all_characters ? 2 : 1;
+      case 13: return show_all_characters ? 2 : 1;
+      default: return 1;
+      }
+    }
+
+  /*
+  How a leaf moves the display position x. Without tabs the leaf adds head. Otherwise x + head is moved to
+  the next tab stop by the first tab, middle is the advance from the first to the last tab, which does not
+  depend on x as both start on a tab stop, and tail is the width after the last tab.
+  */
+  struct leaf_display
+    {
+    bool tab;
+    uint64_t head, middle, tail;
+    };
+
+  uint64_t _advance(const leaf_display& d, uint64_t x, uint32_t tab_space)
+    {
+    if (!d.tab)
+      return x + d.head;
+    return ((x + d.head) / tab_space + 1) * tab_space + d.middle + d.tail;
+    }
+
+  /*
+  The summary is packed in leaf::display as the tab setting in bits 0 to 17, tab in bit 18, head and tail
+  in 12 bits each from bit 19 and 31, and middle in the 21 bits from bit 43. A leaf has at most
+  leaf_capacity characters of width 1 or 2, so head and tail always fit.
+  */
+  leaf_display _get_leaf_display(leaf* l, uint32_t tab_space, bool show_all_characters)
+    {
+    const uint64_t key = (uint64_t)tab_space | ((uint64_t)show_all_characters << 16) | ((uint64_t)1 << 17);
+    leaf_display d;
+    uint64_t packed = l->display.load(std::memory_order_relaxed);
+    if (tab_space <= 0xffff && (packed & 0x3ffff) == key)
+      {
+      d.tab = (packed >> 18) & 1;
+      d.head = (packed >> 19) & 0xfff;
+      d.tail = (packed >> 31) & 0xfff;
+      d.middle = packed >> 43;
+      return d;
+      }
+    d.tab = false;
+    d.head = d.middle = d.tail = 0;
+    uint64_t segment = 0;
+    for (uint32_t i = 0; i < l->size; ++i)
+      {
+      wchar_t ch = l->at(i);
+      if (ch == 9)
+        {
+        if (d.tab)
+          d.middle += (segment / tab_space + 1) * tab_space;
+        else
+          {
+          d.tab = true;
+          d.head = segment;
+          }
+        segment = 0;
+        }
+      else
+        segment += ((ch == 10 || ch == 13) && show_all_characters) ? 2 : 1;
+      }
+    if (d.tab)
+      d.tail = segment;
+    else
+      d.head = segment;
+    if (tab_space <= 0xffff && d.middle < ((uint64_t)1 << 21))
+      l->display.store(key | ((uint64_t)d.tab << 18) | (d.head << 19) | (d.tail << 31) | (d.middle << 43), std::memory_order_relaxed);
+    return d;
+    }
+
+  /*
+  Appends the leaves of ln to out, adding a reference for each. Inline lines get a new leaf.
+  */
+  void _append_leaves(std::vector<leaf*>& out, const compact_line& ln, const node* n)
+    {
+    if (ln.empty())
+      return;
+    if (n)
+      {
+      for (auto l : n->leaves)
+        {
+        _retain(l);
+        out.push_back(l);
+        }
+      }
+    else
+      {
+      wchar_t buffer[compact_line::inline_capacity];
+      ln.copy(buffer, 0, ln.size());
+      out.push_back(_make_leaf(buffer, ln.size()));
+      }
+    }
+  }
+
+void compact_line::const_iterator::_locate()
+  {
+  uint32_t nr_leaves = (uint32_t)_node->leaves.size();
+  uint32_t total = _node->offsets.back() + _node->leaves.back()->size;
+  if (_index >= total)
+    {
+    _leaf = nullptr;
+    _leaf_begin = _leaf_end = total;
+    _leaf_index = nr_leaves;
+    return;
+    }
+  if (_leaf && _index == _leaf_end && _leaf_index + 1 < nr_leaves)
+    ++_leaf_index; // sequential traversal
+  else
+    _leaf_index = _find_leaf(_node, _index);
+  _leaf = _node->leaves[_leaf_index];
+  _leaf_begin = _node->offsets[_leaf_index];
+  _leaf_end = _leaf_begin + _leaf->size;
+  }
+
+compact_line::transient_line::transient_line(const compact_line& ln)
+  {
+  _chars.resize(ln.size());
+  if (!_chars.empty())
+    ln.copy(_chars.data(), 0, ln.size());
+  }
+
+compact_line compact_line::transient_line::persistent() const
+  {
+  return compact_line::from_chars(_chars.data(), (uint32_t)_chars.size());
+  }
+
+compact_line compact_line::from_chars(const wchar_t* chars, uint32_t size)
+  {
+  compact_line out;
+  if (size == 0)
+    return out;
+  if (size <= inline_capacity && _required_width(chars, size) == 1)
+    {
+    out._size = size;
+    for (uint32_t i = 0; i < size; ++i)
+      out._chars[i] = (uint8_t)chars[i];
+    return out;
+    }
+  std::vector<leaf*> leaves;
+  leaves.reserve((size + leaf_capacity - 1) / leaf_capacity);
+  for (uint32_t offset = 0; offset < size; offset += leaf_capacity)
+    leaves.push_back(_make_leaf(chars + offset, std::min<uint32_t>(leaf_capacity, size - offset)));
+  return _from_leaves(std::move(leaves));
+  }
+
+compact_line compact_line::_from_leaves(std::vector<leaf*>&& leaves)
+  {
+  compact_line out;
+  uint32_t size = 0;
+  bool latin1 = true;
+  for (auto l : leaves)
+    {
+    size += l->size;
+    latin1 &= l->width == 1;
+    }
+  if (size <= inline_capacity && latin1)
+    {
+    uint32_t i = 0;
+    for (auto l : leaves)
+      {
+      for (uint32_t j = 0; j < l->size; ++j)
+        out._chars[i++] = l->data()[j];
+      ::_release(l);
+      }
+    out._size = size;
+    return out;
+    }
+  node* n = new node;
+  n->ref_count.store(1, std::memory_order_relaxed);
+  n->display.store(nullptr, std::memory_order_relaxed);
+  n->offsets.reserve(leaves.size());
+  uint32_t offset = 0;
+  for (auto l : leaves)
+    {
+    n->offsets.push_back(offset);
+    offset += l->size;
+    }
+  n->leaves = std::move(leaves);
+  out._node = n;
+  out._size = size;
+  return out;
+  }
+
+void compact_line::_release()
+  {
+  if (_node && _node->ref_count.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+    for (auto l : _node->leaves)
+      ::_release(l);
+    delete _node->display.load(std::memory_order_acquire);
+    delete _node;
+    }
+  _node = nullptr;
+  _size = 0;
+  }
+
+wchar_t compact_line::_at(uint32_t i) const
+  {
+  uint32_t idx = _find_leaf(_node, i);
+  return _node->leaves[idx]->at(i - _node->offsets[idx]);
+  }
+
+void compact_line::copy(wchar_t* out, uint32_t from, uint32_t to) const
+  {
+  if (from >= to)
+    return;
+  if (!_node)
+    {
+    for (uint32_t i = from; i < to; ++i)
+      *out++ = (wchar_t)_chars[i];
+    return;
+    }
+  uint32_t idx = _find_leaf(_node, from);
+  while (from < to)
+    {
+    const leaf* l = _node->leaves[idx];
+    uint32_t begin = _node->offsets[idx];
+    uint32_t last = std::min<uint32_t>(to - begin, l->size);
+    _copy_from_leaf(out, l, from - begin, last);
+    out += last - (from - begin);
+    from = begin + last;
+    ++idx;
+    }
+  }
+
+compact_line compact_line::slice(uint32_t from, uint32_t to) const
+  {
+  if (to > _size)
+    to = _size;
+  if (from >= to)
+    return compact_line();
+  if (from == 0 && to == _size)
+    return *this;
+  uint32_t size = to - from;
+  if (size <= leaf_capacity || !_node)
+    {
+    wchar_t buffer[leaf_capacity];
+    copy(buffer, from, to);
+    return from_chars(buffer, size);
+    }
+  std::vector<leaf*> leaves;
+  uint32_t idx = _find_leaf(_node, from);
+  while (from < to)
+    {
+    leaf* l = _node->leaves[idx];
+    uint32_t begin = _node->offsets[idx];
+    uint32_t first = from - begin;
+    uint32_t last = std::min<uint32_t>(to - begin, l->size);
+    if (first == 0 && last == l->size)
+      {
+      _retain(l);
+      leaves.push_back(l);
+      }
+    else
+      {
+      wchar_t buffer[leaf_capacity];
+      _copy_from_leaf(buffer, l, first, last);
+      leaves.push_back(_make_leaf(buffer, last - first));
+      }
+    from = begin + last;
+    ++idx;
+    }
+  return _from_leaves(std::move(leaves));
+  }
+
+compact_line compact_line::operator + (const compact_line& other) const
+  {
+  if (other.empty())
+    return *this;
+  if (empty())
+    return other;
+  uint32_t size = _size + other._size;
+  if (size <= leaf_capacity)
+    {
+    wchar_t buffer[leaf_capacity];
+    copy(buffer, 0, _size);
+    other.copy(buffer + _size, 0, other._size);
+    return from_chars(buffer, size);
+    }
+  std::vector<leaf*> leaves;
+  _append_leaves(leaves, *this, _node);
+  size_t junction = leaves.size();
+  _append_leaves(leaves, other, other._node);
+  leaf* left = leaves[junction - 1];
+  leaf* right = leaves[junction];
+  if (left->size + right->size <= leaf_capacity) // merge small leaves at the seam to avoid fragmentation
+    {
+    wchar_t buffer[leaf_capacity];
+    _copy_from_leaf(buffer, left, 0, left->size);
+    _copy_from_leaf(buffer + left->size, right, 0, right->size);
+    leaf* merged = _make_leaf(buffer, left->size + right->size);
+    ::_release(left);
+    ::_release(right);
+    leaves[junction - 1] = merged;
+    leaves.erase(leaves.begin() + junction);
+    }
+  return _from_leaves(std::move(leaves));
+  }
+
+compact_line compact_line::push_back(wchar_t ch) const
+  {
+  return *this + from_chars(&ch, 1);
+  }
+
+compact_line compact_line::pop_back() const
+  {
+  assert(_size > 0);
+  return take(_size - 1);
+  }
+
+compact_line compact_line::set(uint32_t i, wchar_t ch) const
+  {
+  return take(i) + from_chars(&ch, 1) + drop(i + 1);
+  }
+
+compact_line compact_line::insert(uint32_t i, wchar_t ch) const
+  {
+  return take(i) + from_chars(&ch, 1) + drop(i);
+  }
+
+compact_line compact_line::insert(uint32_t i, const compact_line& ln) const
+  {
+  return take(i) + ln + drop(i);
+  }
+
+compact_line compact_line::erase(uint32_t i) const
+  {
+  return erase(i, i + 1);
+  }
+
+compact_line compact_line::erase(uint32_t from, uint32_t to) const
+  {
+  if (from >= to)
+    return *this;
+  return take(from) + drop(to);
+  }
+
+compact_line compact_line::take(uint32_t n) const
+  {
+  return slice(0, n);
+  }
+
+compact_line compact_line::drop(uint32_t n) const
+  {
+  return slice(n, _size);
+  }
+
+const std::vector<uint64_t>& compact_line::_display_widths(std::vector<uint64_t>& scratch, uint32_t tab_space, bool show_all_characters) const
+  {
+  display_index* index = _node->display.load(std::memory_order_acquire);
+  if (index && index->tab_space == tab_space && index->show_all_characters == show_all_characters)
+    return index->widths;
+  scratch.clear();
+  scratch.reserve(_node->leaves.size() + 1);
+  uint64_t x = 0;
+  for (auto l : _node->leaves)
+    {
+    scratch.push_back(x);
+    x = _advance(_get_leaf_display(l, tab_space, show_all_characters), x, tab_space);
+    }
+  scratch.push_back(x);
+  if (!index) // keep the first tab setting that is asked for, other settings are computed from the leaf summaries each time
+    {
+    display_index* built = new display_index;
+    built->tab_space = tab_space;
+    built->show_all_characters = show_all_characters;
+    built->widths = scratch;
+    if (!_node->display.compare_exchange_strong(index, built, std::memory_order_acq_rel))
+      delete built;
+    }
+  return scratch;
+  }
+
+uint64_t compact_line::display_width(uint32_t n, uint32_t tab_space, bool show_all_characters) const
+  {
+  if (n > _size)
+    n = _size;
+  uint64_t x = 0;
+  if (!_node)
+    {
+    for (uint32_t i = 0; i < n; ++i)
+      x += _character_width(_chars[i], x, tab_space, show_all_characters);
+    return x;
+    }
+  std::vector<uint64_t> scratch;
+  const std::vector<uint64_t>& widths = _display_widths(scratch, tab_space, show_all_characters);
+  if (n == _size)
+    return widths.back();
+  uint32_t idx = _find_leaf(_node, n);
+  const leaf* l = _node->leaves[idx];
+  x = widths[idx];
+  for (uint32_t i = 0, last = n - _node->offsets[idx]; i < last; ++i)
+    x += _character_width(l->at(i), x, tab_space, show_all_characters);
+  return x;
+  }
+
+uint32_t compact_line::characters_in_display_width(uint64_t width, uint32_t tab_space, bool show_all_characters) const
+  {
+  uint64_t x = 0;
+  uint32_t n = 0;
+  if (!_node)
+    {
+    while (x < width && n < _size)
+      x += _character_width(_chars[n++], x, tab_space, show_all_characters);
+    return n;
+    }
+  if (width == 0)
+    return 0;
+  std::vector<uint64_t> scratch;
+  const std::vector<uint64_t>& widths = _display_widths(scratch, tab_space, show_all_characters);
+  if (widths.back() < width)
+    return _size;
+  uint32_t idx = (uint32_t)(std::lower_bound(widths.begin(), widths.end(), width) - widths.begin() - 1); // the leaf in which width is reached
+  const leaf* l = _node->leaves[idx];
+  x = widths[idx];
+  while (x < width)
+    x += _character_width(l->at(n++), x, tab_space, show_all_characters);
+  return _node->offsets[idx] + n;
+  }
+
+uint64_t compact_line::memory_used() const
+  {
+  uint64_t bytes = sizeof(compact_line);
+  if (_node)
+    {
+    bytes += sizeof(node) + _node->leaves.capacity() * sizeof(leaf*) + _node->offsets.capacity() * sizeof(uint32_t);
+    if (const display_index* index = _node->display.load(std::memory_order_acquire))
+      bytes += sizeof(display_index) + index->widths.capacity() * sizeof(uint64_t);
+    for (auto l : _node->leaves)
+      bytes += sizeof(leaf) + (uint64_t)l->size * l->width;
+    }
+  return bytes;
+  }
@@ -0,0 +1,337 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <iterator>
+#include <vector>
+#include <stdint.h>
+
+/*
+Immutable line of characters in packed form, used as line type when JED_COMPACT_LINES is defined.
+Short latin-1 lines are stored inline. Longer lines are split in shared leaves of at most leaf_capacity
+characters. Each leaf stores 1, 2 or 4 bytes per character depending on the largest character it
+contains, so indexing inside a leaf stays O(1).
+The interface mirrors the part of immutable::vector<wchar_t> that jed uses.
+*/
+class compact_line
+  {
+  public:
+    enum
+      {
+      inline_capacity = 12,
+      leaf_capacity = 1024
+      };
+
+    struct leaf
+      {
+      std::atomic<uint32_t> ref_count;
+      uint32_t size;
+      uint32_t width;
+      std::atomic<uint64_t> display; // packed display summary for one tab setting, 0 if not computed yet
+
+      const uint8_t* data() const
+        {
+        return reinterpret_cast<const uint8_t*>(this + 1);
+        }
+
+      uint8_t* data()
+        {
+        return reinterpret_cast<uint8_t*>(this + 1);
+        }
+
+      wchar_t at(uint32_t i) const
+        {
+        switch (width)
+          {
+          case 1: return (wchar_t)data()[i];
+          case 2: return (wchar_t)reinterpret_cast<const uint16_t*>(data())[i];
+          default: return (wchar_t)reinterpret_cast<const uint32_t*>(data())[i];
+          }
+        }
+      };
+
+    struct display_index
+      {
+      uint32_t tab_space;
+      bool show_all_characters;
+      std::vector<uint64_t> widths; // widths[i] is the display width of the characters in front of leaves[i], the last entry is the width of the line
+      };
+
+    struct node
+      {
+      std::atomic<uint32_t> ref_count;
+      std::vector<leaf*> leaves;
+      std::vector<uint32_t> offsets; // offsets[i] is the index of the first character of leaves[i]
+      std::atomic<display_index*> display; // built on first use, for the tab setting of that use
+      };
+
+    class const_iterator
+      {
+      public:
+        typedef std::random_access_iterator_tag iterator_category;
+        typedef wchar_t value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const wchar_t* pointer;
+        typedef wchar_t reference;
+
+        const_iterator() : _node(nullptr), _leaf(nullptr), _index(0), _leaf_begin(0), _leaf_end(0), _leaf_index(0) {}
+
+        const_iterator(const compact_line& ln, uint32_t index) : _node(ln._node), _leaf(nullptr), _index(index), _leaf_begin(0), _leaf_end(0), _leaf_index(0)
+          {
+          if (_node)
+            _locate();
+          else
+            {
+            for (uint32_t i = 0; i < ln._size; ++i)
+              _chars[i] = ln._chars[i];
+            }
+          }
+
+        wchar_t operator * () const
+          {
+          if (!_node)
+            return (wchar_t)_chars[_index];
+          return _leaf->at(_index - _leaf_begin);
+          }
+
+        wchar_t operator [] (difference_type n) const
+          {
+          return *(*this + n);
+          }
+
+        const_iterator& operator ++ ()
+          {
+          ++_index;
+          if (_node && _index >= _leaf_end)
+            _locate();
+          return *this;
+          }
+
+        const_iterator operator ++ (int)
+          {
+          const_iterator out(*this);
+          ++(*this);
+          return out;
+          }
+
+        const_iterator& operator -- ()
+          {
+          --_index;
+          if (_node && _index < _leaf_begin)
+            _locate();
+          return *this;
+          }
+
+        const_iterator operator -- (int)
+          {
+          const_iterator out(*this);
+          --(*this);
+          return out;
+          }
+
+        const_iterator& operator += (difference_type n)
+          {
+          _index = (uint32_t)((difference_type)_index + n);
+          if (_node && (_index < _leaf_begin || _index >= _leaf_end))
+            _locate();
+          return *this;
+          }
+
+        const_iterator& operator -= (difference_type n)
+          {
+          return *this += -n;
+          }
+
+        const_iterator operator + (difference_type n) const
+          {
+          const_iterator out(*this);
+          out += n;
+          return out;
+          }
+
+        const_iterator operator - (difference_type n) const
+          {
+          const_iterator out(*this);
+          out -= n;
+          return out;
+          }
+
+        difference_type operator - (const const_iterator& other) const
+          {
+          return (difference_type)_index - (difference_type)other._index;
+          }
+
+        bool operator == (const const_iterator& other) const { return _index == other._index; }
+        bool operator != (const const_iterator& other) const { return _index != other._index; }
+        bool operator < (const const_iterator& other) const { return _index < other._index; }
+        bool operator <= (const const_iterator& other) const { return _index <= other._index; }
+        bool operator > (const const_iterator& other) const { return _index > other._index; }
+        bool operator >= (const const_iterator& other) const { return _index >= other._index; }
+
+      private:
+        void _locate();
+
+      private:
+        const node* _node;
+        const leaf* _leaf;
+        uint32_t _index, _leaf_begin, _leaf_end, _leaf_index;
+        uint8_t _chars[inline_capacity];
+      };
+
+    typedef const_iterator iterator;
+    typedef wchar_t value_type;
+
+    class transient_line
+      {
+      public:
+        typedef wchar_t value_type;
+
+        transient_line() {}
+        explicit transient_line(const compact_line& ln);
+
+        void push_back(wchar_t ch) { _chars.push_back(ch); }
+        void pop_back() { _chars.pop_back(); }
+        void set(uint32_t i, wchar_t ch) { _chars[i] = ch; }
+        wchar_t operator [] (uint32_t i) const { return _chars[i]; }
+        wchar_t back() const { return _chars.back(); }
+        uint32_t size() const { return (uint32_t)_chars.size(); }
+        bool empty() const { return _chars.empty(); }
+
+        compact_line persistent() const;
+
+      private:
+        std::vector<wchar_t> _chars;
+      };
+
+    compact_line() : _node(nullptr), _size(0) {}
+
+    compact_line(const compact_line& other) : _node(other._node), _size(other._size)
+      {
+      if (_node)
+        _node->ref_count.fetch_add(1, std::memory_order_relaxed);
+      else
+        _copy_inline(other);
+      }
+
+    compact_line(compact_line&& other) noexcept : _node(other._node), _size(other._size)
+      {
+      if (!_node)
+        _copy_inline(other);
+      other._node = nullptr;
+      other._size = 0;
+      }
+
+    ~compact_line()
+      {
+      _release();
+      }
+
+    compact_line& operator = (const compact_line& other)
+      {
+      if (this != &other)
+        {
+        compact_line tmp(other);
+        swap(tmp);
+        }
+      return *this;
+      }
+
+    compact_line& operator = (compact_line&& other) noexcept
+      {
+      if (this != &other)
+        {
+        _release();
+        _node = other._node;
+        _size = other._size;
+        if (!_node)
+          _copy_inline(other);
+        other._node = nullptr;
+        other._size = 0;
+        }
+      return *this;
+      }
+
+    void swap(compact_line& other) noexcept
+      {
+      compact_line tmp(std::move(other));
+      other = std::move(*this);
+      *this = std::move(tmp);
+      }
+
+    static compact_line from_chars(const wchar_t* chars, uint32_t size);
+
+    uint32_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+
+    wchar_t operator [] (uint32_t i) const
+      {
+      if (!_node)
+        return (wchar_t)_chars[i];
+      if (_node->leaves.size() == 1)
+        return _node->leaves[0]->at(i);
+      return _at(i);
+      }
+
+    wchar_t back() const { return (*this)[_size - 1]; }
+
+    const_iterator begin() const { return const_iterator(*this, 0); }
+    const_iterator end() const { return const_iterator(*this, _size); }
+    const_iterator cbegin() const { return begin(); }
+    const_iterator cend() const { return end(); }
+
+    compact_line push_back(wchar_t ch) const;
+    compact_line pop_back() const;
+    compact_line set(uint32_t i, wchar_t ch) const;
+    compact_line insert(uint32_t i, wchar_t ch) const;
+    compact_line insert(uint32_t i, const compact_line& ln) const;
+    compact_line erase(uint32_t i) const;
+    compact_line erase(uint32_t from, uint32_t to) const;
+    compact_line take(uint32_t n) const;
+    compact_line drop(uint32_t n) const;
+    compact_line slice(uint32_t from, uint32_t to) const;
+    compact_line operator + (const compact_line& other) const;
+
+    transient_line transient() const { return transient_line(*this); }
+
+    /*
+    Copies the characters in [from, to) to out.
+    */
+    void copy(wchar_t* out, uint32_t from, uint32_t to) const;
+
+    /*
+    Display width of the first n characters. A tab advances to the next multiple of tab_space, '\n' and '\r'
+    take two cells if show_all_characters is set, every other character takes one cell.
+    Each leaf caches how it moves the display position, and the node caches the width in front of each
+    leaf, so that only the characters of one leaf are visited. After an edit only the new leaves are
+    scanned again.
+    */
+    uint64_t display_width(uint32_t n, uint32_t tab_space, bool show_all_characters) const;
+
+    /*
+    Smallest n for which display_width(n, ...) >= width, or size() if there is none.
+    */
+    uint32_t characters_in_display_width(uint64_t width, uint32_t tab_space, bool show_all_characters) const;
+
+    /*
+    Number of bytes used by this line, not counting sharing between lines.
+    */
+    uint64_t memory_used() const;
+
+  private:
+    wchar_t _at(uint32_t i) const;
+    void _release();
+    const std::vector<uint64_t>& _display_widths(std::vector<uint64_t>& scratch, uint32_t tab_space, bool show_all_characters) const;
+    void _copy_inline(const compact_line& other)
+      {
+      for (uint32_t i = 0; i < _size; ++i)
+        _chars[i] = other._chars[i];
+      }
+
+    static compact_line _from_leaves(std::vector<leaf*>&& leaves);
+
+  private:
+    friend class const_iterator;
+    node* _node; // nullptr for inline lines
+    uint32_t _size;
+    uint8_t _chars[inline_capacity];
+  };
@@ -4,16 +4,26 @@
 #include "keyboard.h"
 #include "mouse.h"
 #include "pdcex.h"
+#include "profiling.h"
+#include "search.h"
 #include "syntax_highlight.h"
 #include "utils.h"
 
 #include <jtk/file_utils.h>
 #include <jtk/pipe.h>
 
+#include <atomic>
+#include <chrono>
 #include <map>
 #include <functional>
+#include <mutex>
 #include <sstream>
 #include <cctype>
+#include <thread>
+
+#ifndef _WIN32
+#include <signal.h>
+#endif
 
 #include <SDL.h>
 #include <SDL_syswm.h>
@@ -32,16 +42,296 @@ extern "C"
 namespace
   {
   int font_width, font_height;
+  Uint32 wake_up_event_type = (Uint32)-1; // registered in the engine constructor
+
+  /*
+  Wakes up process_input, which waits for SDL events. Can be called from any thread.
+  */
+  void wake_up_main_loop()
+    {
+    if (wake_up_event_type == (Uint32)-1)
+      return;
+    SDL_Event event;
+    SDL_zero(event);
+    event.type = wake_up_event_type;
+    SDL_PushEvent(&event);
+    }
+
+  /*
+  Returns the length of the part of txt that does not end in an incomplete utf8 sequence.
+  */
+  size_t _complete_utf8_size(const std::string& txt)
+    {
+    size_t lead = txt.size();
+    while (lead > 0 && txt.size() - lead < 4 && ((unsigned char)txt[lead - 1] & 0xc0) == 0x80)
+      --lead;
+    if (lead == 0)
+      return txt.size();
+    const unsigned char ch = (unsigned char)txt[lead - 1];
+    const size_t length = ch < 0xc0 ? 1 : ch < 0xe0 ? 2 : ch < 0xf0 ? 3 : 4;
+    return txt.size() - (lead - 1) < length ? lead - 1 : txt.size();
+    }
   }
 
+struct pipe_reader
+  {
+#ifdef _WIN32
+  typedef void* process_type;
+#else
+  typedef std::array<int, 3> process_type;
+#endif
+
+  /*
+  Starts a thread that writes input to the process, and a thread that, if read_output is true, reads its output until
+  the process closes the pipe or stop is called. If owns_process is true, the pipe is closed when both are done,
+  or the process is killed if it was stopped. Otherwise the caller destroys the pipe after stop.
+  The main loop is woken up when new output arrives and when the threads are done.
+  */
+  pipe_reader(process_type process, std::string input, bool read_output, bool owns_process) : process(process), process_open(owns_process), stopped(false), finished(false), bytes(0)
+    {
+    if (!input.empty()) // on its own thread, as a child that fills the pipe with output before it read all of its input would block the reading
+      {
+      writer = std::thread([this, input]()
+        {
+        jtk::send_to_pipe(_handle(this->process), input.c_str());
+        bytes += input.size();
+        });
+      }
+    thread = std::thread([this, read_output, owns_process]()
+      {
+      int fast_empty_reads = 0;
+      std::string incomplete; // utf8 sequence that was split over two reads
+      while (read_output && !stopped)
+        {
+        auto tic = std::chrono::steady_clock::now();
+        std::string text = jtk::read_from_pipe(_handle(this->process), 50);
+        if (text.empty())
+          {
+          if (std::chrono::steady_clock::now() - tic < std::chrono::milliseconds(25)) // nothing to wait for: the child closed the pipe
+            {
+            if (++fast_empty_reads == 3)
+              break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+          else
+            fast_empty_reads = 0;
+          continue;
+          }
+        fast_empty_reads = 0;
+        bytes += text.size();
+        text.insert(0, incomplete);
+        incomplete = text.substr(_complete_utf8_size(text));
+        text.resize(text.size() - incomplete.size());
+        if (text.empty())
+          continue;
+        bool was_empty;
+          {
+          std::scoped_lock lock(mut);
+          was_empty = output.empty();
+          output.append(text);
+          }
+        if (was_empty) // otherwise the main loop was woken up already and did not take the output yet
+          wake_up_main_loop();
+        }
+      if (!incomplete.empty()) // invalid utf8 at the end of the output, decoded as it is
+        {
+        std::scoped_lock lock(mut);
+        output.append(incomplete);
+        }
+#ifdef _WIN32
+      if (owns_process && stopped) // the process can only be killed through its pipe, which also ends a write that is blocked
+        _close_process();
+#endif
+      if (writer.joinable())
+        writer.join();
+      if (owns_process)
+        _close_process();
+      finished = true;
+      wake_up_main_loop();
+      });
+    }
+
+  ~pipe_reader()
+    {
+    stop();
+    }
+
+  /*
+  Stops the threads and waits for them. An owned process is killed first, so that a child that does not read its
+  input, or does not close its output, cannot keep the threads waiting.
+  */
+  void stop()
+    {
+    stopped = true;
+#ifndef _WIN32
+      {
+      std::scoped_lock lock(process_mut);
+      if (process_open)
+        kill((pid_t)process[2], SIGKILL);
+      }
+#endif
+    if (thread.joinable())
+      thread.join();
+    }
+
+  std::string take_output()
+    {
+    std::scoped_lock lock(mut);
+    std::string text;
+    text.swap(output);
+    return text;
+    }
+
+  void _close_process()
+    {
+    std::scoped_lock lock(process_mut);
+    if (!process_open)
+      return;
+    if (stopped)
+      jtk::destroy_pipe(_handle(process), 9);
+    else
+      jtk::close_pipe(_handle(process));
+    process_open = false;
+    }
+
+#ifdef _WIN32
+  static void* _handle(process_type& process) { return process; }
+#else
+  static int* _handle(process_type& process) { return process.data(); }
+#endif
+
+  process_type process;
+  std::mutex mut, process_mut;
+  std::string output;
+  bool process_open; // guarded by process_mut
+  std::atomic<bool> stopped, finished;
+  std::atomic<uint64_t> bytes; // written plus read
+  std::thread writer, thread;
+  };
+
+/*
+The reference counts of text are not atomic, so the snapshot is copied and released on the main thread, and the
+search thread only reads it. A search that was superseded by a new one is kept in app_state::superseded_searches
+until it finishes, so that the main loop never waits for it.
+*/
+struct find_all_job
+  {
+  find_all_job(const text& snapshot, const search_pattern& p) : content(snapshot), pattern(p), finished(false) {}
+
+  ~find_all_job()
+    {
+    if (thread.joinable())
+      thread.join();
+    }
+
+  const text content;
+  const search_pattern pattern;
+  std::shared_ptr<const std::vector<search_match>> matches; // only read after finished is set
+  std::atomic<bool> finished;
+  std::thread thread;
+  };
+
 env_settings convert(const settings& s)
   {
   env_settings out;
   out.tab_space = s.tab_space;
   out.show_all_characters = s.show_all_characters;
+  out.undo_memory_limit = (uint64_t)s.undo_memory_limit * 1024 * 1024;
   return out;
   }
 
+line string_to_line(const std::string& txt)
+  {
+  line out;
+  auto trans = out.transient();
+  for (auto ch : txt)
+    trans.push_back(ch);
+  return trans.persistent();
+  }
+
+/*
+Returns the pattern for the find and replace operations, which is a regular expression if regex search is on.
+Returns std::nullopt if the regular expression is not valid.
+*/
+std::optional<search_pattern> make_find_pattern(std::string& error_message, text txt, const settings& s)
+  {
+  if (!s.regex_search)
+    return make_search_pattern(txt);
+  std::wstring wtxt = to_wstring(txt);
+  if (!wtxt.empty() && wtxt.back() == L'\n')
+    wtxt.pop_back();
+  bool success;
+  search_pattern pattern = make_regex_search_pattern(success, error_message, wtxt);
+  if (!success)
+    {
+    error_message = "[Regex error: " + error_message + "]";
+    return std::nullopt;
+    }
+  return pattern;
+  }
+
+app_state find_in_buffer(app_state state, text txt, const settings& s)
+  {
+  std::string error_message;
+  auto pattern = make_find_pattern(error_message, txt, s);
+  if (!pattern)
+    state.message = string_to_line(error_message);
+  else
+    state.buffer = find_text(state.buffer, *pattern);
+  return state;
+  }
+
+bool match_index_matches_buffer(const app_state& state)
+  {
+  const match_index& index = state.find_all;
+  return index.matches && index.buffer_name == state.buffer.name && index.revision == state.buffer.revision && index.nr_of_rows == (int64_t)state.buffer.content.size();
+  }
+
+bool match_index_matches_find(const app_state& state, const settings& s)
+  {
+  return match_index_matches_buffer(state) && state.find_all.find_text == s.last_find && state.find_all.regex == s.regex_search;
+  }
+
+bool find_all_is_running(const app_state& state)
+  {
+  return state.find_all.job != nullptr;
+  }
+
+bool find_all_is_finished(const app_state& state)
+  {
+  return state.find_all.job && state.find_all.job->finished;
+  }
+
+/*
+Drops the index. A search that is still running is kept until it finishes, see find_all_job.
+*/
+app_state clear_find_all(app_state state)
+  {
+  if (find_all_is_running(state) && !find_all_is_finished(state))
+    state.superseded_searches.push_back(state.find_all.job);
+  state.find_all = match_index();
+  return state;
+  }
+
+/*
+Releases the superseded searches that finished, on the main thread.
+*/
+app_state check_superseded_searches(app_state state)
+  {
+  state.superseded_searches.erase(std::remove_if(state.superseded_searches.begin(), state.superseded_searches.end(), [](const std::shared_ptr<find_all_job>& job) { return job->finished.load(); }), state.superseded_searches.end());
+  return state;
+  }
+
+/*
+Returns the index of the match that is selected in the buffer, or -1.
+*/
+int64_t selected_match(const app_state& state)
+  {
+  if (!state.buffer.start_selection)
+    return -1;
+  return find_match(*state.find_all.matches, *state.buffer.start_selection, state.buffer.pos);
+  }
+
 const syntax_highlighter& get_syntax_highlighter()
   {
   static syntax_highlighter s;
@@ -93,6 +383,10 @@ const keyword_data& get_keywords(const std::string& name)
 
 app_state clear_operation_buffer(app_state state);
 app_state check_pipes(bool& modifications, app_state state, const settings& s);
+std::wstring job_status(const app_state& state);
+std::wstring load_status(const app_state& state);
+app_state check_loads(bool& modifications, app_state state, const settings& s);
+std::optional<app_state> close_buffer(app_state state, const settings& s);
 std::optional<app_state> execute(app_state state, const std::wstring& command, settings& s);
 std::optional<app_state> command_kill(app_state state, settings& s);
 app_state start_pipe(app_state state, const std::string& inputfile, const std::vector<std::string>& parameters, settings& s);
@@ -158,7 +452,7 @@ bool is_modified(const app_state& state)
     if (state.buffer.name[0] == '=')
       return false;
     }
-  return ((state.buffer.modification_mask & 1) == 1);
+  return is_modified(state.buffer);
   }
 
 inline int number_of_digits(int64_t v) 
@@ -296,7 +590,23 @@ void write_left(std::wstring& out, const std::wstring& in)
   }
 
 
-void draw_title_bar(app_state state)
+std::wstring match_index_status(const app_state& state, const settings& s)
+  {
+  if (find_all_is_running(state) && state.find_all.buffer_name == state.buffer.name)
+    return L" Finding... ";
+  if (!match_index_matches_find(state, s))
+    return std::wstring();
+  const int64_t nr_of_matches = (int64_t)state.find_all.matches->size();
+  std::wstringstream str;
+  int64_t index = selected_match(state);
+  if (index >= 0)
+    str << L" Match " << index + 1 << L"/" << nr_of_matches << L" ";
+  else
+    str << L" " << nr_of_matches << (nr_of_matches == 1 ? L" match " : L" matches ");
+  return str.str();
+  }
+
+void draw_title_bar(app_state state, const settings& s)
   {
   int rows, cols;
   getmaxyx(stdscr, rows, cols);
@@ -311,8 +621,19 @@ void draw_title_bar(app_state state)
   filename.append((state.buffer.name.empty() ? std::wstring(L"<noname>") : jtk::convert_string_to_wstring(state.buffer.name)));
   write_center(title_bar, filename);
 
+  std::wstring right;
   if (is_modified(state))
-    write_right(title_bar, L" Modified ");
+    right = L" Modified ";
+  if (!state.hidden_buffers.empty())
+    right += L" +" + std::to_wstring(state.hidden_buffers.size()) + (state.hidden_buffers.size() == 1 ? L" file " : L" files ");
+  write_right(title_bar, right);
+
+  std::wstring left = match_index_status(state, s) + job_status(state) + load_status(state);
+#ifdef JED_PROFILING
+  if (profile_hud_visible())
+    left += jtk::convert_string_to_wstring(" " + profile_statistics() + " ");
+#endif
+  write_left(title_bar, left);
 
   for (int i = 0; i < cols; ++i)
     {
@@ -343,15 +664,179 @@ int64_t wrapped_line_rows(line ln, int maxcol, int maxrow, const env_settings& s
     return 1;
   }
 
+namespace
+  {
+  void _build_fenwick_tree(wrap_index& wi)
+    {
+    const int64_t n = (int64_t)wi.screen_rows.size();
+    wi.tree.assign(n + 1, 0);
+    for (int64_t i = 1; i <= n; ++i)
+      {
+      wi.tree[i] += wi.screen_rows[i - 1];
+      const int64_t parent = i + (i & -i);
+      if (parent <= n)
+        wi.tree[parent] += wi.tree[i];
+      }
+    }
+
+  void _add_to_fenwick_tree(wrap_index& wi, int64_t row, int64_t delta)
+    {
+    for (int64_t i = row + 1; i < (int64_t)wi.tree.size(); i += i & -i)
+      wi.tree[i] += delta;
+    }
+  }
+
+/*
+Brings state.wrap up to date with the buffer and the size of the editor window. Only the rows that were
+damaged since the last frame are measured again, unless the window, the buffer or the tab settings changed.
+*/
+app_state sync_wrap_index(app_state state, const settings& s)
+  {
+  int rows, cols;
+  get_editor_window_size(rows, cols, state.scroll_row, s);
+  auto senv = convert(s);
+  if (!state.wrap)
+    {
+    state.wrap = std::make_shared<wrap_index>();
+    state.wrap->damage_id = 0;
+    }
+  wrap_index& wi = *state.wrap;
+  const file_buffer& fb = state.buffer;
+  const int64_t nr_of_rows = (int64_t)fb.content.size();
+  const bool same_window = wi.maxcol == cols && wi.maxrow == rows && wi.tab_space == senv.tab_space && wi.show_all_characters == senv.show_all_characters;
+  if (!same_window || fb.damage_id == 0 || wi.damage_id != fb.damage_id)
+    {
+    wi.maxcol = cols;
+    wi.maxrow = rows;
+    wi.tab_space = senv.tab_space;
+    wi.show_all_characters = senv.show_all_characters;
+    wi.damage_id = fb.damage_id;
+    wi.screen_rows.resize(nr_of_rows);
+    for (int64_t r = 0; r < nr_of_rows; ++r)
+      wi.screen_rows[r] = (int32_t)wrapped_line_rows(fb.content[r], cols, rows, senv);
+    _build_fenwick_tree(wi);
+    return state;
+    }
+  const int64_t old_nr_of_rows = (int64_t)wi.screen_rows.size();
+  const int64_t first = std::min<int64_t>(fb.damage_first_row, std::min<int64_t>(old_nr_of_rows, nr_of_rows));
+  int64_t old_end = old_nr_of_rows - fb.damage_tail_rows;
+  int64_t new_end = nr_of_rows - fb.damage_tail_rows;
+  if (old_end < first)
+    old_end = first;
+  if (new_end < first)
+    new_end = first;
+  if (old_end - first == new_end - first)
+    {
+    for (int64_t r = first; r < new_end; ++r)
+      {
+      const int32_t screen_rows = (int32_t)wrapped_line_rows(fb.content[r], cols, rows, senv);
+      _add_to_fenwick_tree(wi, r, screen_rows - wi.screen_rows[r]);
+      wi.screen_rows[r] = screen_rows;
+      }
+    }
+  else
+    {
+    std::vector<int32_t> changed;
+    changed.reserve(new_end - first);
+    for (int64_t r = first; r < new_end; ++r)
+      changed.push_back((int32_t)wrapped_line_rows(fb.content[r], cols, rows, senv));
+    wi.screen_rows.erase(wi.screen_rows.begin() + first, wi.screen_rows.begin() + old_end);
+    wi.screen_rows.insert(wi.screen_rows.begin() + first, changed.begin(), changed.end());
+    _build_fenwick_tree(wi);
+    }
+  return state;
+  }
+
+int64_t screen_rows_before(const wrap_index& wi, int64_t row)
+  {
+  if (row > (int64_t)wi.screen_rows.size())
+    row = (int64_t)wi.screen_rows.size();
+  int64_t sum = 0;
+  for (int64_t i = row; i > 0; i -= i & -i)
+    sum += wi.tree[i];
+  return sum;
+  }
+
+/*
+Returns the first row that starts at or after screen row screen_row, or the number of rows if there is none.
+*/
+int64_t first_row_from_screen_row(const wrap_index& wi, int64_t screen_row)
+  {
+  const int64_t n = (int64_t)wi.screen_rows.size();
+  int64_t step = 1;
+  while (step * 2 <= n)
+    step *= 2;
+  int64_t row = 0; // the rows before row start before screen_row
+  int64_t sum = 0;
+  for (; step > 0; step /= 2)
+    {
+    if (row + step <= n && sum + wi.tree[row + step] < screen_row)
+      {
+      row += step;
+      sum += wi.tree[row];
+      }
+    }
+  return (row < n && sum < screen_row) ? row + 1 : row;
+  }
+
+/*
+Returns the last row that starts at or before screen row screen_row.
+*/
+int64_t row_at_screen_row(const wrap_index& wi, int64_t screen_row)
+  {
+  const int64_t row = first_row_from_screen_row(wi, screen_row + 1) - 1;
+  return row < 0 ? 0 : row;
+  }
+
+/*
+Keeps state.brackets in sync with the buffer. A missing index is only built if build is true, and an index of
+another buffer is dropped unless build is true, so that showing a large file does not pay for a full build.
+*/
+app_state update_brackets(app_state state, bool build)
+  {
+  if (!state.brackets)
+    {
+    if (!build)
+      return state;
+    state.brackets = std::make_shared<bracket_index>();
+    state.brackets->damage_id = 0;
+    }
+  else if (!build && state.brackets->damage_id != state.buffer.damage_id)
+    {
+    state.brackets.reset();
+    return state;
+    }
+  sync_bracket_index(*state.brackets, state.buffer);
+  return state;
+  }
+
+/*
+Keeps state.text_types in sync with the buffer, so that draw_buffer only lexes the rows that it did not draw before.
+*/
+app_state update_text_types(app_state state)
+  {
+  if (!state.text_types)
+    {
+    state.text_types = std::make_shared<text_type_index>();
+    state.text_types->damage_id = 0;
+    }
+  sync_text_type_index(*state.text_types, state.buffer);
+  return state;
+  }
+
 /*
 Returns an x offset (let's call it multiline_offset_x) such that
   int x = (int)current.col + multiline_offset_x + wide_characters_offset;
 equals the x position in the screen of where the next character should come.
 This makes it possible to further fill the line with spaces after calling "draw_line".
 */
-int draw_line(int& wide_characters_offset, file_buffer fb, position& current, position cursor, position buffer_pos, position underline, chtype base_color, int& r, int yoffset, int xoffset, int maxcol, int maxrow, std::optional<position> start_selection, bool rectangular, bool active, screen_ex_type set_type, const keyword_data& kd, bool wrap, const settings& s, const env_settings& senv)
+int draw_line(int& wide_characters_offset, file_buffer fb, position& current, position cursor, position buffer_pos, position underline, chtype base_color, int& r, int yoffset, int xoffset, int maxcol, int maxrow, std::optional<position> start_selection, bool rectangular, bool active, screen_ex_type set_type, const keyword_data& kd, text_type_index* text_types, bool wrap, const settings& s, const env_settings& senv)
   {
-  auto tt = get_text_type(fb, current.row);
+  JED_PROFILE_SCOPE("draw_line");
+  std::vector<std::pair<int64_t, text_type>> row_types;
+  if (!text_types)
+    row_types = get_text_type(fb, current.row);
+  const auto& tt = text_types ? get_text_type(*text_types, fb, current.row) : row_types;
 
   line ln = fb.content[current.row];
   int multiline_tag = (int)multiline_tag_editor;
@@ -454,9 +939,9 @@ int draw_line(int& wide_characters_offset, file_buffer fb, position& current, po
     }
 
   int drawn = 0;
-  auto current_tt = tt.back();
+  size_t tt_remaining = tt.size(); // tt is sorted from back to front, tt[0 .. tt_remaining) are still to come
+  auto current_tt = tt[--tt_remaining];
   assert(current_tt.first == 0);
-  tt.pop_back();
 
   int next_word_read_length_remaining = 0;
   bool keyword_type_1 = false;
@@ -469,27 +954,16 @@ int draw_line(int& wide_characters_offset, file_buffer fb, position& current, po
     if (!wrap && drawn >= maxcol)
       break;
 
-    while (!tt.empty() && tt.back().first <= current.col)
-      {
-      current_tt = tt.back();
-      tt.pop_back();
-      }
+    while (tt_remaining > 0 && tt[tt_remaining - 1].first <= current.col)
+      current_tt = tt[--tt_remaining];
 
-    if (!(kd.keywords_1.empty() && kd.keywords_2.empty()) && current_tt.second == tt_normal && next_word_read_length_remaining == 0)
+    if (!kd.trie.nodes.empty() && current_tt.second == tt_normal && next_word_read_length_remaining == 0)
       {
-      keyword_type_1 = false;
-      keyword_type_2 = false;
-      std::wstring next_word = read_next_word(it, it_end);
-      next_word_read_length_remaining = next_word.length();
-      auto it = std::lower_bound(kd.keywords_1.begin(), kd.keywords_1.end(), next_word);
-      if (it != kd.keywords_1.end() && *it == next_word)
-        keyword_type_1 = true;
-      else
-        {
-        it = std::lower_bound(kd.keywords_2.begin(), kd.keywords_2.end(), next_word);
-        if (it != kd.keywords_2.end() && *it == next_word)
-          keyword_type_2 = true;
-        }
+      int64_t word_length;
+      uint8_t keyword_class = classify_word(word_length, it, it_end, kd.trie);
+      next_word_read_length_remaining = (int)word_length;
+      keyword_type_1 = keyword_class == 1;
+      keyword_type_2 = keyword_class == 2;
       }
 
     switch (current_tt.second)
@@ -573,14 +1047,14 @@ int draw_line(int& wide_characters_offset, file_buffer fb, position& current, po
   return xoffset;
   }
 
-std::string get_operation_text(e_operation op)
+std::string get_operation_text(e_operation op, const settings& s)
   {
   switch (op)
     {
-    case op_find: return std::string("Find: ");    
-    case op_incremental_search: return std::string("Incremental search: ");
+    case op_find: return std::string(s.regex_search ? "Find regex: " : "Find: ");
+    case op_incremental_search: return std::string(s.regex_search ? "Incremental regex search: " : "Incremental search: ");
     case op_replace: return std::string("Replace: ");
-    case op_replace_find: return std::string("Find:  ");
+    case op_replace_find: return std::string(s.regex_search ? "Find regex:  " : "Find:  ");
     case op_goto: return std::string("Go to line: ");
     case op_open: return std::string("Open file: ");
     case op_save: return std::string("Save file: ");
@@ -668,8 +1142,108 @@ void draw_help_text(app_state state)
   }
 
 
-void draw_command_buffer(file_buffer fb, int64_t scroll_row, const settings& s, bool active, const env_settings& senv)
+namespace
+  {
+  /*
+  What was drawn on a screen row of the editor or the command window in the previous frame.
+  */
+  struct row_state
+    {
+    int64_t row; // -1 for the rows below the end of the text, -2 for the continuation rows of a wrapped row
+    int64_t cursor_col, start_selection_col, underline_col; // -1 if not on this row
+    bool selected; // between the rows of the cursor and the start of the selection
+    int height; // number of screen rows, more than 1 for a wrapped row
+    };
+
+  bool operator == (const row_state& left, const row_state& right)
+    {
+    return left.row == right.row && left.cursor_col == right.cursor_col && left.start_selection_col == right.start_selection_col
+      && left.underline_col == right.underline_col && left.selected == right.selected;
+    }
+
+  /*
+  A row is only drawn again if its row_state changed, if it is damaged in the buffer (see clear_damage),
+  or if anything in the layout changed, in which case the complete window is drawn.
+  */
+  struct window_state
+    {
+    window_state() : damage_id(0), nr_of_rows(0) {}
+    uint64_t damage_id; // damage_id of the buffer after it was drawn
+    int64_t nr_of_rows;
+    std::string name;
+    std::vector<int64_t> layout;
+    std::vector<row_state> rows; // indexed by the screen row in the window
+    };
+
+  window_state editor_window, command_window;
+
+  row_state _make_row_state(const file_buffer& fb, int64_t row, position cursor, position underline, bool active)
+    {
+    row_state rs;
+    rs.row = row;
+    rs.cursor_col = (cursor.row == row) ? cursor.col : -1;
+    rs.underline_col = (underline.row == row) ? underline.col : -1;
+    rs.start_selection_col = -1;
+    rs.selected = false;
+    rs.height = 1;
+    if (active && fb.start_selection && row >= 0)
+      {
+      if (fb.start_selection->row == row)
+        rs.start_selection_col = fb.start_selection->col;
+      rs.selected = (fb.start_selection->row <= row && row <= cursor.row) || (cursor.row <= row && row <= fb.start_selection->row);
+      }
+    return rs;
+    }
+
+  bool _row_damaged(const file_buffer& fb, int64_t row, int64_t previous_nr_of_rows)
+    {
+    const int64_t size = (int64_t)fb.content.size();
+    if (size != previous_nr_of_rows)
+      return row < 0 || row >= fb.damage_first_row;
+    if (row < 0 || row >= size) // the rows below the text only depend on the last position
+      row = size - 1;
+    return row >= fb.damage_first_row && row < size - fb.damage_tail_rows;
+    }
+
+  bool _needs_full_redraw(const window_state& previous, const file_buffer& fb, const std::vector<int64_t>& layout)
+    {
+    return fb.damage_id == 0 || previous.damage_id != fb.damage_id || previous.name != fb.name || previous.layout != layout
+      || fb.rectangular_selection || fb.content.empty();
+    }
+
+  /*
+  Clears nr_of_rows screen rows starting at y, except for the scroll bar.
+  */
+  void _clear_rows(int y, int nr_of_rows)
+    {
+    int rows, cols;
+    getmaxyx(stdscr, rows, cols);
+    if (nr_of_rows > rows - y)
+      nr_of_rows = rows - y;
+    for (int r = y; r < y + nr_of_rows; ++r)
+      {
+      move(r, 2);
+      clrtoeol();
+      }
+    invalidate_range(2, y, cols - 2, nr_of_rows);
+    }
+
+  file_buffer _finish_window(window_state& window, file_buffer fb, std::vector<int64_t> layout, std::vector<row_state> rows)
+    {
+    fb = clear_damage(fb);
+    window.damage_id = fb.damage_id;
+    window.nr_of_rows = (int64_t)fb.content.size();
+    window.name = fb.name;
+    window.layout.swap(layout);
+    window.rows.swap(rows);
+    return fb;
+    }
+  }
+
+
+file_buffer draw_command_buffer(file_buffer fb, int64_t scroll_row, const settings& s, bool active, const env_settings& senv)
   {
+  JED_PROFILE_SCOPE("draw_command_buffer");
   int offset_x = 0;
   int offset_y = 0;
 
@@ -689,15 +1263,32 @@ void draw_command_buffer(file_buffer fb, int64_t scroll_row, const settings& s,
   bool has_nontrivial_selection = (fb.start_selection != std::nullopt) && (fb.start_selection != fb.pos);
 
   position underline(-1, -1);
-  if (active && !has_nontrivial_selection)
+  if (active && !has_nontrivial_selection && valid_position(fb, cursor) && is_bracket(fb.content[cursor.row][cursor.col]))
     {
-    underline = find_corresponding_token(fb, cursor, current.row, current.row + maxrow - 1);
+    bracket_index brackets; // the command buffer is small, so its index is built on the spot
+    brackets.damage_id = 0;
+    sync_bracket_index(brackets, fb);
+    underline = find_corresponding_token(brackets, fb, cursor);
     }
 
+  int rows, cols;
+  getmaxyx(stdscr, rows, cols);
+  std::vector<int64_t> layout = { rows, cols, offset_x, offset_y, active, fb.start_selection != std::nullopt, senv.tab_space, senv.show_all_characters };
+  const window_state& previous = command_window;
+  const bool full = _needs_full_redraw(previous, fb, layout);
+  std::vector<row_state> drawn_rows;
+  drawn_rows.reserve(maxrow);
+
   attrset(COMMAND_COLOR);
 
   for (int r = 0; r < maxrow; ++r)
     {
+    drawn_rows.push_back(_make_row_state(fb, current.row < fb.content.size() ? current.row : -1, cursor, underline, active));
+    if (!full && r < previous.rows.size() && previous.rows[r] == drawn_rows.back() && !_row_damaged(fb, drawn_rows.back().row, previous.nr_of_rows))
+      {
+      ++current.row;
+      continue;
+      }
     current.col = 0;
     for (int x = 0; x < offset_x; ++x)
       {
@@ -731,7 +1322,7 @@ void draw_command_buffer(file_buffer fb, int64_t scroll_row, const settings& s,
     keyword_data kd;
 
     int wide_characters_offset = 0;
-    int multiline_offset_x = draw_line(wide_characters_offset, fb, current, cursor, fb.pos, underline, COMMAND_COLOR, r, offset_y, offset_x, maxcol, maxrow, fb.start_selection, fb.rectangular_selection, active, SET_TEXT_COMMAND, kd, false, s, senv);
+    int multiline_offset_x = draw_line(wide_characters_offset, fb, current, cursor, fb.pos, underline, COMMAND_COLOR, r, offset_y, offset_x, maxcol, maxrow, fb.start_selection, fb.rectangular_selection, active, SET_TEXT_COMMAND, kd, nullptr, false, s, senv);
 
     int x = (int)current.col + multiline_offset_x + wide_characters_offset;
     if (!has_nontrivial_selection && (current == cursor))
@@ -756,10 +1347,12 @@ void draw_command_buffer(file_buffer fb, int64_t scroll_row, const settings& s,
 
     ++current.row;
     }
+  return _finish_window(command_window, fb, layout, drawn_rows);
   }
 
-void draw_buffer(file_buffer fb, int64_t scroll_row, screen_ex_type set_type, const settings& s, bool active, const env_settings& senv)
+file_buffer draw_buffer(file_buffer fb, int64_t scroll_row, const bracket_index* brackets, text_type_index* text_types, screen_ex_type set_type, const settings& s, bool active, const env_settings& senv)
   {
+  JED_PROFILE_SCOPE("draw_buffer");
   int offset_x = 0;
   int offset_y = 0;
 
@@ -779,19 +1372,48 @@ void draw_buffer(file_buffer fb, int64_t scroll_row, screen_ex_type set_type, co
   bool has_nontrivial_selection = (fb.start_selection != std::nullopt) && (fb.start_selection != fb.pos);
 
   position underline(-1, -1);
-  if (active && !has_nontrivial_selection)
-    {
-    underline = find_corresponding_token(fb, cursor, current.row, current.row + maxrow - 1);
-    }
+  if (active && !has_nontrivial_selection && brackets)
+    underline = find_corresponding_token(*brackets, fb, cursor);
 
   const keyword_data& kd = get_keywords(fb.name);
 
+  int rows, cols;
+  getmaxyx(stdscr, rows, cols);
+  std::vector<int64_t> layout = { rows, cols, offset_x, offset_y, active, fb.start_selection != std::nullopt, senv.tab_space, senv.show_all_characters, s.wrap, s.show_line_numbers };
+  const window_state& previous = editor_window;
+  bool redraw_below = _needs_full_redraw(previous, fb, layout); // a changed wrapped row can move all rows below it
+  if (redraw_below)
+    _clear_rows(offset_y, maxrow);
+  std::vector<row_state> drawn_rows;
+  drawn_rows.reserve(maxrow);
+
   attrset(DEFAULT_COLOR);
 
-  int r = 0;
-  for (; r < maxrow; ++r)
+  const auto last_pos = get_last_position(fb);
+
+  for (int r = 0; r < maxrow; ++r)
     {
-    if (s.show_line_numbers)
+    row_state rs = _make_row_state(fb, current.row <= fb.content.size() ? current.row : -1, cursor, underline, active);
+    if (!redraw_below)
+      {
+      if (r < previous.rows.size() && previous.rows[r] == rs && !_row_damaged(fb, rs.row, previous.nr_of_rows))
+        {
+        for (int h = 0; h < previous.rows[r].height && r + h < maxrow; ++h)
+          drawn_rows.push_back(previous.rows[r + h]);
+        r += previous.rows[r].height - 1;
+        ++current.row;
+        continue;
+        }
+      if (s.wrap)
+        {
+        _clear_rows((int)r + offset_y, maxrow - r);
+        redraw_below = true;
+        }
+      else
+        _clear_rows((int)r + offset_y, 1);
+      }
+    const int first_r = r;
+    if (s.show_line_numbers && current.row <= fb.content.size())
       {
       attrset(A_NORMAL | COLOR_PAIR(linenumbers_color));
       const int64_t line_nr = current.row + 1;
@@ -814,19 +1436,22 @@ void draw_buffer(file_buffer fb, int64_t scroll_row, screen_ex_type set_type, co
     current.col = 0;
     if (current.row >= fb.content.size())
       {
-      if (fb.content.empty() && active) // file is empty, draw cursor
+      if (fb.content.empty() && active && current.row == 0) // file is empty, draw cursor
         {
         move((int)r + offset_y, (int)current.col + offset_x);
         attron(A_REVERSE);
-        add_ex(position(0, 0), set_type);
         addch(' ');
         attroff(A_REVERSE);
         }
-      break;
+      move((int)r + offset_y, offset_x);
+      add_ex(last_pos, set_type);
+      drawn_rows.push_back(rs);
+      ++current.row;
+      continue;
       }
 
     int wide_characters_offset = 0;
-    int multiline_offset_x = draw_line(wide_characters_offset, fb, current, cursor, fb.pos, underline, DEFAULT_COLOR, r, offset_y, offset_x, maxcol, maxrow, fb.start_selection, fb.rectangular_selection, active, set_type, kd, s.wrap, s, senv);
+    int multiline_offset_x = draw_line(wide_characters_offset, fb, current, cursor, fb.pos, underline, DEFAULT_COLOR, r, offset_y, offset_x, maxcol, maxrow, fb.start_selection, fb.rectangular_selection, active, set_type, kd, text_types, s.wrap, s, senv);
 
     int x = (int)current.col + multiline_offset_x + wide_characters_offset;
     if (!has_nontrivial_selection && (current == cursor))
@@ -850,15 +1475,17 @@ void draw_buffer(file_buffer fb, int64_t scroll_row, screen_ex_type set_type, co
       ++x;
       }
 
-    ++current.row;
-    }
+    if (r >= maxrow)
+      r = maxrow - 1;
+    rs.height = r - first_r + 1;
+    drawn_rows.push_back(rs);
+    rs.row = -2;
+    while (drawn_rows.size() < r + 1)
+      drawn_rows.push_back(rs);
 
-  auto last_pos = get_last_position(fb);
-  for (; r < maxrow; ++r)
-    {
-    move((int)r + offset_y, offset_x);
-    add_ex(last_pos, set_type);
+    ++current.row;
     }
+  return _finish_window(editor_window, fb, layout, drawn_rows);
   }
 
 void draw_scroll_bars(app_state state, const settings& s)
@@ -875,10 +1502,19 @@ void draw_scroll_bars(app_state state, const settings& s)
   int scroll1 = 0;
   int scroll2 = maxrow - 1;
 
-  if (!state.buffer.content.empty())
+  const wrap_index* wi = s.wrap ? state.wrap.get() : nullptr; // synced by draw, the scroll bar then counts screen rows
+  int64_t total = (int64_t)state.buffer.content.size();
+  int64_t top = state.scroll_row;
+  if (wi)
+    {
+    total = screen_rows_before(*wi, total);
+    top = screen_rows_before(*wi, top);
+    }
+
+  if (total > 0)
     {
-    scroll1 = (int)((double)state.scroll_row / (double)state.buffer.content.size()*maxrow);
-    scroll2 = (int)((double)(state.scroll_row + maxrow) / (double)state.buffer.content.size()*maxrow);
+    scroll1 = (int)((double)top / (double)total*maxrow);
+    scroll2 = (int)((double)(top + maxrow) / (double)total*maxrow);
     }
   if (scroll1 >= maxrow)
     scroll1 = maxrow - 1;
@@ -900,7 +1536,9 @@ void draw_scroll_bars(app_state state, const settings& s)
     int rowpos = 0;
     if (!state.buffer.content.empty())
       {
-      rowpos = (int)((double)r*(double)state.buffer.content.size() / (double)maxrow);
+      rowpos = (int)((double)r*(double)total / (double)maxrow);
+      if (wi)
+        rowpos = (int)row_at_screen_row(*wi, rowpos);
       if (rowpos >= state.buffer.content.size())
         rowpos = state.buffer.content.size() - 1;
       }
@@ -920,20 +1558,43 @@ void draw_scroll_bars(app_state state, const settings& s)
 
   }
 
+/*
+The editor and the command window only draw the rows that changed since the previous frame, the other
+rows of the screen are cleared and drawn every time.
+*/
 app_state draw(app_state state, const settings& s)
   {
-  erase();
-
-  invalidate_ex();
+  int rows, cols;
+  getmaxyx(stdscr, rows, cols);
+  for (int r : { 0, rows - 3, rows - 2, rows - 1 })
+    {
+    move(r, 0);
+    clrtoeol();
+    invalidate_range(0, r, cols, 1);
+    }
 
-  draw_title_bar(state);
+  draw_title_bar(state, s);
 
   auto senv = convert(s);
 
+  state.buffer = validate_lexer_status(state.buffer, state.scroll_row + rows); // at least the visible rows
 
-  draw_buffer(state.buffer, state.scroll_row, SET_TEXT_EDITOR, s, (state.operation != op_command_editing) || has_nontrivial_selection(state.buffer, senv), senv);
+  if (s.wrap)
+    state = sync_wrap_index(state, s); // before draw_buffer clears the damage
+
+  const position cursor = get_actual_position(state.buffer);
+  state = update_brackets(state, valid_position(state.buffer, cursor) && is_bracket(state.buffer.content[cursor.row][cursor.col]));
 
-  draw_command_buffer(state.command_buffer, state.command_scroll_row, s, (state.operation == op_command_editing) || has_nontrivial_selection(state.command_buffer, senv), senv);
+  state = update_text_types(state);
+
+  state.buffer = draw_buffer(state.buffer, state.scroll_row, state.brackets.get(), state.text_types.get(), SET_TEXT_EDITOR, s, (state.operation != op_command_editing) || has_nontrivial_selection(state.buffer, senv), senv);
+  if (s.wrap)
+    state.wrap->damage_id = state.buffer.damage_id;
+  if (state.brackets)
+    state.brackets->damage_id = state.buffer.damage_id;
+  state.text_types->damage_id = state.buffer.damage_id;
+
+  state.command_buffer = draw_command_buffer(state.command_buffer, state.command_scroll_row, s, (state.operation == op_command_editing) || has_nontrivial_selection(state.command_buffer, senv), senv);
 
   draw_scroll_bars(state, s);
 
@@ -945,7 +1606,7 @@ app_state draw(app_state state, const settings& s)
     position current;
     current.col = 0;
     current.row = 0;
-    std::string txt = get_operation_text(state.operation);
+    std::string txt = get_operation_text(state.operation, s);
     move((int)rows - 3, 0);
     attrset(DEFAULT_COLOR);
     attron(A_BOLD);
@@ -961,7 +1622,7 @@ app_state draw(app_state state, const settings& s)
     int multiline_offset_x = txt.length();
     keyword_data kd;
     if (!state.operation_buffer.content.empty())
-      multiline_offset_x = draw_line(wide_characters_offset, state.operation_buffer, current, cursor, state.operation_buffer.pos, position(-1, -1), DEFAULT_COLOR | A_BOLD, rows, - 3, multiline_offset_x, cols_available, 1, state.operation_buffer.start_selection, state.operation_buffer.rectangular_selection, true, SET_TEXT_OPERATION, kd, false, s, senv);
+      multiline_offset_x = draw_line(wide_characters_offset, state.operation_buffer, current, cursor, state.operation_buffer.pos, position(-1, -1), DEFAULT_COLOR | A_BOLD, rows, - 3, multiline_offset_x, cols_available, 1, state.operation_buffer.start_selection, state.operation_buffer.rectangular_selection, true, SET_TEXT_OPERATION, kd, nullptr, false, s, senv);
     int x = (int)current.col + multiline_offset_x + wide_characters_offset;
     if ((current == cursor))
       {
@@ -1006,7 +1667,10 @@ app_state draw(app_state state, const settings& s)
   draw_help_text(state);
 
   curs_set(0);
+  {
+  JED_PROFILE_SCOPE("refresh");
   refresh();
+  }
 
   return state;
   }
@@ -1021,35 +1685,14 @@ app_state check_scroll_position(app_state state, const settings& s)
     {
     if (s.wrap)
       {
-      auto senv = convert(s);
-      int64_t actual_rows = 0;
-      int r = 0;
-      for (; r < rows; ++r)
+      state = sync_wrap_index(state, s);
+      const wrap_index& wi = *state.wrap;
+      const int64_t bottom = screen_rows_before(wi, state.buffer.pos.row + 1); // the screen row below the cursor row
+      if (bottom - screen_rows_before(wi, state.scroll_row) > rows)
         {
-        if (state.scroll_row + r >= state.buffer.content.size())
-          break;
-        actual_rows += wrapped_line_rows(state.buffer.content[state.scroll_row + r], cols, rows, senv);
-        if (actual_rows >= rows)
-          break;
-        }
-      int64_t my_row = 0;
-      if (state.buffer.pos.row < state.buffer.content.size())
-        my_row = wrapped_line_rows(state.buffer.content[state.buffer.pos.row], cols, rows, senv);
-      if (state.scroll_row + r < state.buffer.pos.row + my_row - 1)
-        {
-        state.scroll_row = state.buffer.pos.row;
-        r = 0;
-        actual_rows = my_row;
-        for (; r < rows; ++r)
-          {
-          if (state.scroll_row == 0)
-            break;
-          actual_rows += wrapped_line_rows(state.buffer.content[state.scroll_row - 1], cols, rows, senv);
-          if (actual_rows <= rows)
-            --state.scroll_row;
-          else
-            break;
-          }
+        state.scroll_row = first_row_from_screen_row(wi, bottom - rows);
+        if (state.scroll_row > state.buffer.pos.row)
+          state.scroll_row = state.buffer.pos.row;
         }
       }
     else if (state.scroll_row + rows <= state.buffer.pos.row)
@@ -1248,11 +1891,21 @@ app_state move_page_up_editor(app_state state, const settings& s)
   int rows, cols;
   get_editor_window_size(rows, cols, state.scroll_row, s);
 
-  state.scroll_row -= rows - 1;
+  int64_t page = rows - 1;
+  if (s.wrap) // the rows that fill rows - 1 screen rows above the window
+    {
+    state = sync_wrap_index(state, s);
+    const wrap_index& wi = *state.wrap;
+    page = state.scroll_row - first_row_from_screen_row(wi, screen_rows_before(wi, state.scroll_row) - (rows - 1));
+    if (page < 1)
+      page = 1;
+    }
+
+  state.scroll_row -= page;
   if (state.scroll_row < 0)
     state.scroll_row = 0;
 
-  state.buffer = move_page_up(state.buffer, rows - 1, convert(s));
+  state.buffer = move_page_up(state.buffer, page, convert(s));
 
   return check_scroll_position(state, s);
   }
@@ -1299,12 +1952,27 @@ app_state move_page_down_editor(app_state state, const settings& s)
   state = cancel_selection(state);
   int rows, cols;
   get_editor_window_size(rows, cols, state.scroll_row, s);
-  state.scroll_row += rows - 1;
-  if (state.scroll_row + rows >= state.buffer.content.size())
-    state.scroll_row = (int64_t)state.buffer.content.size() - rows + 1;
+  int64_t page = rows - 1;
+  if (s.wrap) // the rows that fill rows - 1 screen rows from the top of the window
+    {
+    state = sync_wrap_index(state, s);
+    const wrap_index& wi = *state.wrap;
+    page = first_row_from_screen_row(wi, screen_rows_before(wi, state.scroll_row) + rows - 1) - state.scroll_row;
+    if (page < 1)
+      page = 1;
+    state.scroll_row += page;
+    if (state.scroll_row >= (int64_t)state.buffer.content.size())
+      state.scroll_row = (int64_t)state.buffer.content.size() - 1;
+    }
+  else
+    {
+    state.scroll_row += page;
+    if (state.scroll_row + rows >= state.buffer.content.size())
+      state.scroll_row = (int64_t)state.buffer.content.size() - rows + 1;
+    }
   if (state.scroll_row < 0)
     state.scroll_row = 0;
-  state.buffer = move_page_down(state.buffer, rows - 1, convert(s));
+  state.buffer = move_page_down(state.buffer, page, convert(s));
   return check_scroll_position(state, s);
   }
 
@@ -1430,7 +2098,7 @@ app_state text_input_operation(app_state state, const char* txt, settings& s)
       state.buffer.pos = *state.buffer.start_selection;
       }
     state.buffer.start_selection = std::nullopt;
-    state.buffer = find_text(state.buffer, state.operation_buffer.content);
+    state = find_in_buffer(state, state.operation_buffer.content, s);
     s.last_find = to_string(state.operation_buffer.content);
     state = check_scroll_position(state, s);    
     }
@@ -1617,15 +2285,6 @@ app_state ret_command(app_state state, settings& s)
   return text_input(state, indentation.c_str(), s);
   }
 
-line string_to_line(const std::string& txt)
-  {
-  line out;
-  auto trans = out.transient();
-  for (auto ch : txt)
-    trans.push_back(ch);
-  return trans.persistent();
-  }
-
 std::string clean_filename(std::string name)
   {
   /*
@@ -1644,6 +2303,35 @@ std::string clean_filename(std::string name)
   return name;
   }
 
+/*
+Stops reading buffer_name in the background, e.g. because the buffer is read again or closed.
+*/
+app_state cancel_load(app_state state, const std::string& buffer_name)
+  {
+  state.loads.erase(std::remove_if(state.loads.begin(), state.loads.end(), [&](const file_load& ld) { return ld.buffer_name == buffer_name; }), state.loads.end());
+  return state;
+  }
+
+bool is_loading(const app_state& state)
+  {
+  return std::any_of(state.loads.begin(), state.loads.end(), [&](const file_load& ld) { return ld.buffer_name == state.buffer.name; });
+  }
+
+/*
+Reads filename. Of a large file only the first rows are read, so that it can be shown at once. The other rows
+are read in the background and appended by check_loads.
+*/
+file_buffer read_file(app_state& state, const std::string& filename)
+  {
+  const uint64_t first_bytes = 1 << 20;
+  std::shared_ptr<file_loader> loader;
+  file_buffer fb = read_from_file_progressively(loader, filename, first_bytes, wake_up_main_loop);
+  state = cancel_load(state, fb.name);
+  if (loader)
+    state.loads.push_back(file_load{ loader, fb.name });
+  return fb;
+  }
+
 app_state open_file(app_state state, const settings& s)
   {
   state.operation = op_editing;
@@ -1669,7 +2357,8 @@ app_state open_file(app_state state, const settings& s)
     }
   else
     {
-    state.buffer = read_from_file(filename);
+    state = cancel_load(state, state.buffer.name);
+    state.buffer = read_file(state, filename);
     if (filename.empty() || filename.back() != '"')
       {
       filename.push_back('"');
@@ -1686,6 +2375,12 @@ app_state open_file(app_state state, const settings& s)
 app_state save_file(app_state state)
   {
   state.operation = op_editing;
+  if (is_loading(state))
+    {
+    state.operation_stack.clear();
+    state.message = string_to_line("Error saving file that is still loading");
+    return state;
+    }
   std::wstring wfilename;
   if (!state.operation_buffer.content.empty())
     wfilename = std::wstring(state.operation_buffer.content[0].begin(), state.operation_buffer.content[0].end());
@@ -1746,7 +2441,8 @@ app_state make_new_buffer(app_state state, settings& s)
 
 app_state get(app_state state)
   {
-  state.buffer = read_from_file(state.buffer.name);
+  state = clear_find_all(state);
+  state.buffer = read_file(state, state.buffer.name);
   state.buffer = set_multiline_comments(state.buffer);
   state.buffer = init_lexer_status(state.buffer);
   state.operation = op_editing;
@@ -1760,7 +2456,7 @@ app_state find(app_state state, settings& s)
   if (!state.operation_buffer.content.empty())
     search_string = std::wstring(state.operation_buffer.content[0].begin(), state.operation_buffer.content[0].end());
   s.last_find = jtk::convert_wstring_to_string(search_string);
-  state.buffer = find_text(state.buffer, search_string);
+  state = find_in_buffer(state, to_text(search_string), s);
   state.operation = op_editing;
   return check_scroll_position(state, s);
   }
@@ -1771,13 +2467,19 @@ app_state replace(app_state state, settings& s)
   state.message = string_to_line("[Replace]");
   state.operation = op_editing;
   std::wstring replace_string;
-  state.buffer = find_text(state.buffer, s.last_find);
-  state.buffer = erase_right(state.buffer, senv, true);
   if (!state.operation_buffer.content.empty())
     replace_string = std::wstring(state.operation_buffer.content[0].begin(), state.operation_buffer.content[0].end());
   s.last_replace = jtk::convert_wstring_to_string(replace_string);
-  if (state.buffer.pos != get_last_position(state.buffer))
-    state.buffer = insert(state.buffer, replace_string, senv, false);
+  std::string error_message;
+  auto pattern = make_find_pattern(error_message, to_text(s.last_find), s);
+  if (!pattern)
+    {
+    state.message = string_to_line(error_message);
+    return state;
+    }
+  state.buffer = find_text(state.buffer, *pattern);
+  if (state.buffer.start_selection)
+    state.buffer = replace_all(state.buffer, *pattern, replace_string, *state.buffer.start_selection, state.buffer.pos, senv);
   return check_scroll_position(state, s);
   }
 
@@ -1789,21 +2491,14 @@ app_state replace_all(app_state state, settings& s)
   if (!state.operation_buffer.content.empty())
     replace_string = std::wstring(state.operation_buffer.content[0].begin(), state.operation_buffer.content[0].end());
   s.last_replace = jtk::convert_wstring_to_string(replace_string);
-  std::wstring find_string = jtk::convert_string_to_wstring(s.last_find);
-  state.buffer.pos = position(0, 0); // go to start
-  state.buffer.start_selection = std::nullopt;
-  state.buffer.rectangular_selection = false;
-  state.buffer = find_text(state.buffer, find_string);
-  if (state.buffer.pos == get_last_position(state.buffer))
-    return state;
-  state.buffer = push_undo(state.buffer);
-  auto senv = convert(s);
-  while (state.buffer.pos != get_last_position(state.buffer))
+  std::string error_message;
+  auto pattern = make_find_pattern(error_message, to_text(s.last_find), s);
+  if (!pattern)
     {
-    state.buffer = erase_right(state.buffer, senv, false);
-    state.buffer = insert(state.buffer, replace_string, senv, false);
-    state.buffer = find_text(state.buffer, find_string);
+    state.message = string_to_line(error_message);
+    return state;
     }
+  state.buffer = replace_all(state.buffer, *pattern, replace_string, position(0, 0), get_last_position(state.buffer), convert(s));
   return check_scroll_position(state, s);
   }
 
@@ -1825,46 +2520,241 @@ app_state replace_selection(app_state state, settings& s)
   if (end_pos < start_pos)
     std::swap(start_pos, end_pos);
 
-  state.buffer.pos = start_pos;
-  state.buffer = find_text(state.buffer, find_string);
-  if (state.buffer.pos == get_last_position(state.buffer))
+  std::string error_message;
+  auto pattern = make_find_pattern(error_message, to_text(find_string), s);
+  if (!pattern)
+    {
+    state.message = string_to_line(error_message);
     return state;
-  state.buffer = push_undo(state.buffer);
-  auto senv = convert(s);
+    }
+  state.buffer = replace_all(state.buffer, *pattern, replace_string, start_pos, end_pos, convert(s));
+  return check_scroll_position(state, s);
+  }
+
+app_state replace_find(app_state state, settings& s)
+  {
+  std::wstring search_string;
+  if (!state.operation_buffer.content.empty())
+    search_string = std::wstring(state.operation_buffer.content[0].begin(), state.operation_buffer.content[0].end());
+  s.last_find = jtk::convert_wstring_to_string(search_string);
+  return state;
+  }
+
+app_state make_replace_buffer(app_state state, const settings& s)
+  {
+  state = clear_operation_buffer(state);
+  state.operation = op_replace;
+  state.operation_buffer = insert(state.operation_buffer, s.last_replace, convert(s), false);
+  state.operation_buffer.start_selection = position(0, 0);
+  state.operation_buffer = move_end(state.operation_buffer, convert(s));
+  return check_scroll_position(state, s);
+  }
+
+namespace
+  {
+  std::vector<search_match> _find_all_nonempty_matches(const text& content, const search_pattern& pattern)
+    {
+    auto matches = find_all_matches(content, pattern);
+    matches.erase(std::remove_if(matches.begin(), matches.end(), [](const search_match& m) { return m.last < m.first; }), matches.end());
+    return matches;
+    }
+  }
+
+/*
+Makes the index of all matches of s.last_find in the buffer. If background is true, the search runs on
+another thread, and finish_find_all picks up the result.
+*/
+app_state make_match_index(app_state state, bool background, const settings& s)
+  {
+  std::string error_message;
+  auto pattern = make_find_pattern(error_message, to_text(s.last_find), s);
+  if (!pattern)
+    {
+    state.message = string_to_line(error_message);
+    return state;
+    }
+  state = clear_find_all(state);
+  state.find_all.find_text = s.last_find;
+  state.find_all.regex = s.regex_search;
+  state.find_all.buffer_name = state.buffer.name;
+  state.find_all.revision = state.buffer.revision;
+  state.find_all.nr_of_rows = (int64_t)state.buffer.content.size();
+  if (background)
+    {
+    auto job = std::make_shared<find_all_job>(state.buffer.content, *pattern);
+    find_all_job* j = job.get(); // the job outlives its thread, see ~find_all_job
+    job->thread = std::thread([j]()
+      {
+      j->matches = std::make_shared<const std::vector<search_match>>(_find_all_nonempty_matches(j->content, j->pattern));
+      j->finished = true; // publish the matches before waking up the main loop
+      wake_up_main_loop();
+      });
+    state.find_all.job = job;
+    }
+  else
+    state.find_all.matches = std::make_shared<const std::vector<search_match>>(_find_all_nonempty_matches(state.buffer.content, *pattern));
+  return state;
+  }
+
+/*
+Appends the matches of the index to the command buffer as lines :row:col text, which can be
+right clicked to go to the match.
+*/
+app_state write_match_listing(app_state state, const settings& s)
+  {
+  const size_t max_listed_matches = 1000;
+  const size_t max_listed_characters = 80;
+  const auto& matches = *state.find_all.matches;
+  std::wstringstream str;
+  position last = get_last_position(state.command_buffer);
+  if (last.col > 0)
+    str << L"\n";
+  str << L"Find all " << jtk::convert_string_to_wstring(state.find_all.find_text) << L": " << matches.size() << (matches.size() == 1 ? L" match\n" : L" matches\n");
+  for (size_t i = 0; i < matches.size() && i < max_listed_matches; ++i)
+    {
+    const search_match& m = matches[i];
+    str << L":" << m.first.row + 1 << L":" << m.first.col + 1 << L" ";
+    const line& ln = state.buffer.content[(uint32_t)m.first.row];
+    for (size_t j = 0; j < ln.size() && j < max_listed_characters; ++j)
+      {
+      wchar_t ch = ln[(uint32_t)j];
+      if (ch == L'\n' || ch == L'\r')
+        break;
+      str << (ch == L'\t' ? L' ' : ch);
+      }
+    str << L"\n";
+    }
+  if (matches.size() > max_listed_matches)
+    str << L"... " << matches.size() - max_listed_matches << L" more\n";
+  state.command_buffer = clear_selection(state.command_buffer);
+  state.command_buffer.pos = last;
+  state.command_buffer = insert(state.command_buffer, str.str(), convert(s));
+  state.command_buffer.pos = position(last.col > 0 ? last.row + 1 : last.row, 0);
+  return check_command_scroll_position(state, s);
+  }
+
+app_state finish_find_all(app_state state, const settings& s)
+  {
+  state.find_all.matches = state.find_all.job->matches;
+  state.find_all.job.reset();
+  if (!match_index_matches_buffer(state))
+    {
+    state.message = string_to_line("[Find all: the text changed during the search]");
+    return state;
+    }
+  std::stringstream str;
+  str << "[Find all: " << state.find_all.matches->size() << (state.find_all.matches->size() == 1 ? " match]" : " matches]");
+  state.message = string_to_line(str.str());
+  return write_match_listing(state, s);
+  }
+
+app_state select_match(app_state state, int64_t index, const settings& s)
+  {
+  const search_match& m = (*state.find_all.matches)[index];
+  state.buffer.rectangular_selection = false;
+  state.buffer.start_selection = m.first;
+  state.buffer.pos = m.last;
+  return check_scroll_position(state, s);
+  }
 
-  while (state.buffer.pos <= end_pos)
-    {
-    state.buffer = erase_right(state.buffer, senv, false);
-    state.buffer = insert(state.buffer, replace_string, senv, false);
-    state.buffer = find_text(state.buffer, find_string);
+app_state find_next(app_state state, settings& s)
+  {
+  state.message = string_to_line("[Find next]");
+  state.operation = op_editing;
+  if (match_index_matches_find(state, s))
+    {
+    const auto& matches = *state.find_all.matches;
+    if (matches.empty())
+      return state;
+    int64_t index = selected_match(state);
+    if (index >= 0)
+      index = (index + 1) % (int64_t)matches.size();
+    else
+      {
+      position pos = get_actual_position(state.buffer);
+      if (state.buffer.start_selection && *state.buffer.start_selection > pos)
+        pos = *state.buffer.start_selection;
+      index = next_match(matches, pos);
+      if (index < 0)
+        index = 0;
+      }
+    return select_match(state, index, s);
     }
+  state = find_in_buffer(state, to_text(s.last_find), s);
   return check_scroll_position(state, s);
   }
 
-app_state replace_find(app_state state, settings& s)
+/*
+Searching backwards goes via the match index, which is made first if it does not match the buffer.
+*/
+app_state find_previous(app_state state, settings& s)
   {
-  std::wstring search_string;
-  if (!state.operation_buffer.content.empty())
-    search_string = std::wstring(state.operation_buffer.content[0].begin(), state.operation_buffer.content[0].end());
-  s.last_find = jtk::convert_wstring_to_string(search_string);
-  return state;
+  state.message = string_to_line("[Find previous]");
+  state.operation = op_editing;
+  if (!match_index_matches_find(state, s))
+    {
+    state = make_match_index(state, false, s);
+    if (!match_index_matches_find(state, s))
+      return state;
+    }
+  const auto& matches = *state.find_all.matches;
+  if (matches.empty())
+    return state;
+  int64_t index = selected_match(state);
+  if (index >= 0)
+    index = (index + (int64_t)matches.size() - 1) % (int64_t)matches.size();
+  else
+    {
+    position pos = get_actual_position(state.buffer);
+    if (state.buffer.start_selection && *state.buffer.start_selection < pos)
+      pos = *state.buffer.start_selection;
+    index = previous_match(matches, pos);
+    if (index < 0)
+      index = (int64_t)matches.size() - 1;
+    }
+  return select_match(state, index, s);
   }
 
-app_state make_replace_buffer(app_state state, const settings& s)
-  {
-  state = clear_operation_buffer(state);
-  state.operation = op_replace;
-  state.operation_buffer = insert(state.operation_buffer, s.last_replace, convert(s), false);
-  state.operation_buffer.start_selection = position(0, 0);
-  state.operation_buffer = move_end(state.operation_buffer, convert(s));
-  return check_scroll_position(state, s);
+/*
+Returns the position of an address :row or :row:col, as written by the Find all listing. Rows and
+columns start at 1.
+*/
+std::optional<position> get_address(const std::wstring& command)
+  {
+  int64_t values[2] = { 0, 1 };
+  int nr_of_values = 0;
+  size_t i = 0;
+  while (nr_of_values < 2 && i < command.size() && command[i] == L':')
+    {
+    size_t first_digit = ++i;
+    int64_t value = 0;
+    while (i < command.size() && command[i] >= L'0' && command[i] <= L'9')
+      value = value * 10 + (command[i++] - L'0');
+    if (i == first_digit)
+      return std::nullopt;
+    values[nr_of_values++] = value;
+    }
+  if (nr_of_values == 0 || i != command.size() || values[0] < 1 || values[1] < 1)
+    return std::nullopt;
+  return position(values[0] - 1, values[1] - 1);
   }
 
-app_state find_next(app_state state, settings& s)
+app_state goto_address(app_state state, position pos, const settings& s)
   {
-  state.message = string_to_line("[Find next]");
   state.operation = op_editing;
-  state.buffer = find_text(state.buffer, s.last_find);
+  if (state.buffer.content.empty())
+    return state;
+  if (match_index_matches_buffer(state))
+    {
+    int64_t index = next_match(*state.find_all.matches, pos);
+    if (index >= 0 && (*state.find_all.matches)[index].first == pos)
+      return select_match(state, index, s);
+    }
+  if (pos.row >= (int64_t)state.buffer.content.size())
+    pos.row = (int64_t)state.buffer.content.size() - 1;
+  state.buffer = clear_selection(state.buffer);
+  state.buffer.pos = pos;
+  state.buffer.pos = get_actual_position(state.buffer);
   return check_scroll_position(state, s);
   }
 
@@ -1931,7 +2821,7 @@ std::optional<app_state> ret_operation(app_state state, settings& s)
       case op_replace: state = replace(state, s); break;
       case op_new: state = make_new_buffer(state, s); break;
       case op_get: state = get(state); break;
-      case op_exit: return std::nullopt;
+      case op_exit: return close_buffer(state, s);
       default: break;
       }
     if (state.operation_stack.empty())
@@ -1962,8 +2852,7 @@ app_state clear_operation_buffer(app_state state)
   {
   state.operation_buffer.content = text();
   state.operation_buffer.lex = lexer_status();
-  state.operation_buffer.history = immutable::vector<snapshot, false>();
-  state.operation_buffer.undo_redo_index = 0;
+  state.operation_buffer = clear_undo_history(state.operation_buffer);
   state.operation_buffer.start_selection = std::nullopt;
   state.operation_buffer.rectangular_selection = false;
   state.operation_buffer.pos.row = 0;
@@ -2038,7 +2927,7 @@ std::optional<app_state> command_exit(app_state state, settings& s)
     return make_save_buffer(state, s);
     }
   else
-    return std::nullopt;
+    return close_buffer(state, s);
   }
 
 std::optional<app_state> command_cancel(app_state state, settings& s)
@@ -2215,33 +3104,14 @@ std::optional<app_state> move_editor_window_up_down(app_state state, int steps,
     state.scroll_row = 0;
   if (s.wrap)
     {
-    auto senv = convert(s);
-    int64_t actual_rows = 0;
-    int r = 0;
-    for (; r < rows; ++r)
-      {
-      if (state.scroll_row + r >= state.buffer.content.size())
-        break;
-      actual_rows += wrapped_line_rows(state.buffer.content[state.scroll_row + r], cols, rows, senv);
-      if (actual_rows >= rows)
-        break;
-      }
-    if (state.scroll_row + r > lastrow)
+    state = sync_wrap_index(state, s);
+    const wrap_index& wi = *state.wrap;
+    const int64_t total = screen_rows_before(wi, lastrow + 1);
+    if (total - screen_rows_before(wi, state.scroll_row) < rows) // the last row is above the bottom of the window
       {
-      int64_t my_row = wrapped_line_rows(state.buffer.content[lastrow], cols, rows, senv);
-      state.scroll_row = lastrow;
-      r = 0;
-      actual_rows = my_row;
-      for (; r < rows; ++r)
-        {
-        if (state.scroll_row == 0)
-          break;
-        actual_rows += wrapped_line_rows(state.buffer.content[state.scroll_row - 1], cols, rows, senv);
-        if (actual_rows <= rows)
-          --state.scroll_row;
-        else
-          break;
-        }
+      state.scroll_row = first_row_from_screen_row(wi, total - rows);
+      if (state.scroll_row > lastrow)
+        state.scroll_row = lastrow;
       }
     }
   else
@@ -2334,6 +3204,11 @@ std::optional<app_state> command_put(app_state state, settings& s)
     state.message = string_to_line(error_message);
     return state;
     }
+  if (is_loading(state))
+    {
+    state.message = string_to_line("Error saving file that is still loading");
+    return state;
+    }
   bool success = false;
   state.buffer = save_to_file(success, state.buffer, state.buffer.name);
   if (success)
@@ -2352,6 +3227,14 @@ std::optional<app_state> command_put(app_state state, settings& s)
 
 std::optional<app_state> command_kill(app_state state, settings& s)
   {
+  for (auto& job : state.jobs)
+    job.reader->stop();
+  state.jobs.clear();
+  if (state.reader)
+    {
+    state.reader->stop();
+    state.reader.reset();
+    }
 #ifdef _WIN32
   if (state.wt == wt_piped)
     {
@@ -2595,12 +3478,70 @@ std::optional<app_state> command_line_numbers(app_state state, settings& s)
   return state;
   }
   
+std::optional<app_state> command_match(app_state state, settings& s)
+  {
+  if (state.buffer.content.empty())
+    return state;
+  state.operation = op_editing;
+  state.buffer = validate_lexer_status(state.buffer, (int64_t)state.buffer.content.size()); // comments and strings further down may not be lexed yet
+  state = update_brackets(state, true);
+  const position pos = find_corresponding_token(*state.brackets, state.buffer, get_actual_position(state.buffer));
+  if (pos.row < 0)
+    {
+    state.message = string_to_line("[No corresponding bracket]");
+    return state;
+    }
+  state.buffer = clear_selection(state.buffer);
+  state.buffer.pos = pos;
+  state.buffer.xpos = get_x_position(state.buffer, convert(s));
+  return check_scroll_position(state, s);
+  }
+
+#ifdef JED_PROFILING
+std::optional<app_state> command_stats(app_state state, settings& s)
+  {
+  const bool visible = toggle_profile_hud();
+  const std::string filename = get_file_in_executable_path("jed_trace.json");
+  if (!write_profile_trace(filename))
+    state.message = string_to_line("[Could not write " + filename + "]");
+  else
+    state.message = string_to_line(std::string(visible ? "[Stats on" : "[Stats off") + ", trace written to " + filename + "]");
+  return state;
+  }
+#endif
+
 std::optional<app_state> command_wrap(app_state state, settings& s)
   {
   s.wrap = !s.wrap;
   return state;
   }
 
+std::optional<app_state> command_regex(app_state state, settings& s)
+  {
+  s.regex_search = !s.regex_search;
+  state.message = string_to_line(s.regex_search ? "[Regex search on]" : "[Regex search off]");
+  return state;
+  }
+
+std::optional<app_state> command_find_all(app_state state, settings& s)
+  {
+  if (s.last_find.empty())
+    {
+    state.message = string_to_line("[Find all: nothing to find]");
+    return state;
+    }
+  state.message = string_to_line("[Find all]");
+  return make_match_index(state, true, s);
+  }
+
+std::optional<app_state> command_find_all_text(app_state state, std::wstring& find_string, settings& s)
+  {
+  find_string = clean_command(find_string);
+  remove_quotes(find_string);
+  s.last_find = jtk::convert_wstring_to_string(find_string);
+  return command_find_all(state, s);
+  }
+
 std::optional<app_state> command_tab(app_state state, std::wstring& sz, settings& s)
   {
   int save_tab_space = s.tab_space;
@@ -2634,6 +3575,79 @@ std::optional<app_state> command_piped_win(app_state state, std::wstring& parame
   return execute(state, jtk::convert_string_to_wstring(exepath), s);
   }
 
+std::string workspace_name(std::string filename)
+  {
+  remove_quotes(filename);
+  std::replace(filename.begin(), filename.end(), '\\', '/');
+  if (!filename.empty() && filename.back() != '/' && jtk::is_directory(filename))
+    filename.push_back('/');
+  return filename;
+  }
+
+app_state show_hidden_buffer(app_state state, const hidden_buffer& hb, const settings& s)
+  {
+  state.buffer = hb.buffer;
+  state.scroll_row = hb.scroll_row;
+  state.operation = op_editing;
+  state.operation_stack.clear();
+  return check_scroll_position(state, s);
+  }
+
+/*
+Shows filename in this window. The current buffer is kept in the workspace, and shown again when filename
+is closed. A file that is already open in the workspace is not read again.
+*/
+app_state open_in_workspace(app_state state, const std::string& filename, const settings& s)
+  {
+  std::string name = workspace_name(filename);
+  if (name == state.buffer.name)
+    return state;
+  hidden_buffer hb;
+  auto it = std::find_if(state.hidden_buffers.begin(), state.hidden_buffers.end(), [&](const hidden_buffer& h) { return h.buffer.name == name; });
+  if (it != state.hidden_buffers.end())
+    {
+    hb = *it;
+    state.hidden_buffers.erase(it);
+    }
+  else
+    {
+    hb.buffer = read_file(state, name);
+    hb.buffer = set_multiline_comments(hb.buffer);
+    hb.buffer = init_lexer_status(hb.buffer);
+    hb.scroll_row = 0;
+    }
+  if (!state.buffer.name.empty() || is_modified(state.buffer)) // an untouched new buffer is not kept
+    state.hidden_buffers.insert(state.hidden_buffers.begin(), hidden_buffer{ state.buffer, state.scroll_row });
+  return show_hidden_buffer(state, hb, s);
+  }
+
+/*
+Closes the current buffer and shows the next one of the workspace. Returns std::nullopt if there is none,
+so that jed stops.
+*/
+std::optional<app_state> close_buffer(app_state state, const settings& s)
+  {
+  if (state.hidden_buffers.empty())
+    return std::nullopt;
+  state = cancel_load(state, state.buffer.name);
+  hidden_buffer hb = state.hidden_buffers.front();
+  state.hidden_buffers.erase(state.hidden_buffers.begin());
+  return show_hidden_buffer(state, hb, s);
+  }
+
+std::optional<app_state> command_next_buffer(app_state state, settings& s)
+  {
+  if (state.hidden_buffers.empty())
+    {
+    state.message = string_to_line("No other files are open");
+    return state;
+    }
+  hidden_buffer hb = state.hidden_buffers.front();
+  state.hidden_buffers.erase(state.hidden_buffers.begin());
+  state.hidden_buffers.push_back(hidden_buffer{ state.buffer, state.scroll_row });
+  return show_hidden_buffer(state, hb, s);
+  }
+
 const auto executable_commands = std::map<std::wstring, std::function<std::optional<app_state>(app_state, settings&)>>
   {
   {L"AcmeTheme", command_acme_theme},  
@@ -2645,6 +3659,7 @@ const auto executable_commands = std::map<std::wstring, std::function<std::optio
   {L"DarkTheme", command_dark_theme},
   {L"Exit", command_exit},
   {L"Find", command_find},
+  {L"FindAll", command_find_all},
   {L"Get", command_get},
   {L"Goto", command_goto},
   {L"Help", command_help},
@@ -2652,17 +3667,23 @@ const auto executable_commands = std::map<std::wstring, std::function<std::optio
   {L"Kill", command_kill},
   {L"LightTheme", command_light_theme},
   {L"LineNumbers", command_line_numbers},
+  {L"Match", command_match},
   {L"MatrixTheme", command_matrix_theme},
   {L"New", command_new},
+  {L"Next", command_next_buffer},
   {L"No", command_no},
   {L"Open", command_open},
   {L"Paste", command_paste_from_snarf_buffer},
   {L"Put", command_put},
   {L"Redo", command_redo},
+  {L"Regex", command_regex},
   {L"Replace", command_replace},
   {L"Save", command_save_as},
   {L"Select", command_select},
   {L"Sel/all", command_select_all},
+#ifdef JED_PROFILING
+  {L"Stats", command_stats},
+#endif
   {L"TabSpaces", command_tab_spaces},
   {L"Undo", command_undo},
   {L"Wrap", command_wrap},
@@ -2671,6 +3692,7 @@ const auto executable_commands = std::map<std::wstring, std::function<std::optio
 
 const auto executable_commands_with_parameters = std::map<std::wstring, std::function<std::optional<app_state>(app_state, std::wstring&, settings&)>>
   {
+  {L"FindAll", command_find_all_text},
   {L"Tab", command_tab},
   {L"Win", command_piped_win}
   };
@@ -2743,25 +3765,179 @@ app_state execute_external(app_state state, const std::string& file_path, const
   return state;
   }
 
+/*
+Starts a job for the process that was created for file_path. The output replaces the selection, or is inserted at
+the cursor.
+*/
+app_state start_job(app_state state, pipe_reader::process_type process, const std::string& file_path, std::string input, bool read_output, const settings& s)
+  {
+  state.buffer = push_undo(state.buffer); // the output does not join the undo step of the last typing
+  if (read_output && has_nontrivial_selection(state.buffer, convert(s)))
+    state.buffer = erase(state.buffer, convert(s));
+  pipe_job job;
+  job.reader = std::make_shared<pipe_reader>(process, std::move(input), read_output, true);
+  job.command = jtk::get_filename(file_path);
+  job.buffer_name = state.buffer.name;
+  job.insert_pos = get_actual_position(state.buffer);
+  job.revision = state.buffer.revision;
+  state.jobs.push_back(job);
+  return state;
+  }
+
+/*
+Inserts text at the insert position of job, keeping the cursor and the selection where they are in the text.
+Edits of the user since the previous output move the insert position along. Output that follows the previous
+output without edits in between joins its undo step, so a command is undone at once unless the user edited
+while it ran.
+*/
+file_buffer insert_job_output(pipe_job& job, file_buffer fb, const std::string& text, const env_settings& senv)
+  {
+  const bool continues_output = fb.revision == job.revision;
+  if (!continues_output)
+    {
+    auto mapped = map_position(fb, job.insert_pos, job.revision);
+    if (mapped)
+      job.insert_pos = *mapped;
+    }
+  position& pos = job.insert_pos;
+  if (fb.content.empty())
+    pos = position(0, 0);
+  else if (pos.row >= (int64_t)fb.content.size() || pos.col > (int64_t)fb.content[pos.row].size())
+    pos = get_last_position(fb);
+  const position first = pos;
+  position user_pos = fb.pos;
+  std::optional<position> user_start_selection = fb.start_selection;
+  fb.pos = first;
+  fb.start_selection = std::nullopt;
+  if (!continues_output)
+    fb = push_undo(fb);
+  fb = insert(fb, text, senv, false);
+  pos = fb.pos;
+  job.revision = fb.revision;
+  auto shift = [&](position p)
+    {
+    if (p < first)
+      return p;
+    if (p.row == first.row)
+      p.col += pos.col - first.col;
+    p.row += pos.row - first.row;
+    return p;
+    };
+  fb.pos = shift(user_pos);
+  if (user_start_selection)
+    fb.start_selection = shift(*user_start_selection);
+  return fb;
+  }
+
+app_state check_jobs(bool& modifications, app_state state, const settings& s)
+  {
+  modifications = false;
+  if (state.jobs.empty())
+    return state;
+  std::vector<pipe_job> running;
+  for (auto job : state.jobs)
+    {
+    const bool finished = job.reader->finished; // before taking the output, so that no output is missed
+    std::string text = job.reader->take_output();
+    if (!text.empty() && job.buffer_name == state.buffer.name)
+      {
+      state.buffer = insert_job_output(job, state.buffer, text, convert(s));
+      modifications = true;
+      }
+    else if (!text.empty())
+      {
+      for (auto& hb : state.hidden_buffers)
+        {
+        if (hb.buffer.name == job.buffer_name)
+          {
+          hb.buffer = insert_job_output(job, hb.buffer, text, convert(s));
+          break;
+          }
+        }
+      }
+    if (finished)
+      {
+      state.message = string_to_line("[" + job.command + " done]");
+      modifications = true;
+      }
+    else
+      running.push_back(job);
+    }
+  state.jobs.swap(running);
+  return state;
+  }
+
+app_state check_loads(bool& modifications, app_state state, const settings& s)
+  {
+  modifications = false;
+  if (state.loads.empty())
+    return state;
+  std::vector<file_load> running;
+  for (auto ld : state.loads)
+    {
+    bool finished = true;
+    if (ld.buffer_name == state.buffer.name)
+      {
+      const uint64_t revision = state.buffer.revision;
+      state.buffer = append_loaded_rows(finished, state.buffer, *ld.loader);
+      modifications = modifications || revision != state.buffer.revision || finished;
+      }
+    else
+      {
+      for (auto& hb : state.hidden_buffers)
+        {
+        if (hb.buffer.name == ld.buffer_name)
+          {
+          hb.buffer = append_loaded_rows(finished, hb.buffer, *ld.loader);
+          break;
+          }
+        }
+      }
+    if (!finished)
+      running.push_back(ld);
+    }
+  state.loads.swap(running);
+  return state;
+  }
+
+std::wstring load_status(const app_state& state)
+  {
+  for (const auto& ld : state.loads)
+    {
+    if (ld.buffer_name == state.buffer.name)
+      return L" Loading " + std::to_wstring((int)(loaded_fraction(*ld.loader) * 100.0)) + L"% ";
+    }
+  return std::wstring();
+  }
+
+std::wstring job_status(const app_state& state)
+  {
+  if (state.jobs.empty())
+    return std::wstring();
+  uint64_t bytes = 0;
+  for (const auto& job : state.jobs)
+    bytes += job.reader->bytes;
+  std::wstringstream str;
+  if (state.jobs.size() == 1)
+    str << L" " << jtk::convert_string_to_wstring(state.jobs.front().command) << L": ";
+  else
+    str << L" " << state.jobs.size() << L" jobs: ";
+  str << bytes << L" bytes ";
+  return str.str();
+  }
+
 app_state execute_external_input(app_state state, const std::string& file_path, const std::vector<std::string>& parameters, const settings& s)
   {
   jtk::active_folder af(jtk::get_folder(state.buffer.name).c_str());
 
   char** argv = alloc_arguments(file_path, parameters);
+  pipe_reader::process_type process;
 #ifdef _WIN32
-  void* process = nullptr;
+  process = nullptr;
   int err = jtk::create_pipe(file_path.c_str(), argv, nullptr, &process);
-  free_arguments(argv);
-  if (err != 0)
-    {
-    std::string error_message = "Could not create child process";
-    state.message = string_to_line(error_message);
-    return state;
-    }
-  std::string text = jtk::read_from_pipe(process, 100);
 #else
-  int pipefd[3];
-  int err = jtk::create_pipe(file_path.c_str(), argv, nullptr, pipefd);
+  int err = jtk::create_pipe(file_path.c_str(), argv, nullptr, process.data());
+#endif
   free_arguments(argv);
   if (err != 0)
     {
@@ -2769,17 +3945,7 @@ app_state execute_external_input(app_state state, const std::string& file_path,
     state.message = string_to_line(error_message);
     return state;
     }
-  std::string text = jtk::read_from_pipe(pipefd, 100);
-#endif
-
-  state.buffer = insert(state.buffer, text, convert(s));
-
-#ifdef _WIN32        
-  jtk::close_pipe(process);
-#else
-  jtk::close_pipe(pipefd);
-#endif
-  return state;
+  return start_job(state, process, file_path, std::string(), true, s);
   }
 
 app_state execute_external_output(app_state state, const std::string& file_path, const std::vector<std::string>& parameters, const settings& s)
@@ -2793,26 +3959,13 @@ app_state execute_external_output(app_state state, const std::string& file_path,
   jtk::active_folder af(jtk::get_folder(state.buffer.name).c_str());
 
   char** argv = alloc_arguments(file_path, parameters);
+  pipe_reader::process_type process;
 #ifdef _WIN32
-  void* process = nullptr;
+  process = nullptr;
   int err = jtk::create_pipe(file_path.c_str(), argv, nullptr, &process);
-  free_arguments(argv);
-  if (err != 0)
-    {
-    std::string error_message = "Could not create child process";
-    state.message = string_to_line(error_message);
-    return state;
-    }
-  int res = jtk::send_to_pipe(process, output.c_str());
-  if (res != NO_ERROR)
-    {
-    state.message = string_to_line(std::string("Error writing to external process"));
-    return state;
-    }
-  jtk::close_pipe(process);
 #else
-  int pipefd[3];
-  int err = jtk::create_pipe(file_path.c_str(), argv, nullptr, pipefd);
+  int err = jtk::create_pipe(file_path.c_str(), argv, nullptr, process.data());
+#endif
   free_arguments(argv);
   if (err != 0)
     {
@@ -2820,11 +3973,7 @@ app_state execute_external_output(app_state state, const std::string& file_path,
     state.message = string_to_line(error_message);
     return state;
     }
-  jtk::send_to_pipe(pipefd, output.c_str());
-  jtk::close_pipe(pipefd);
-#endif
-
-  return state;
+  return start_job(state, process, file_path, output, false, s);
   }
 
 
@@ -2839,26 +3988,13 @@ app_state execute_external_input_output(app_state state, const std::string& file
   jtk::active_folder af(jtk::get_folder(state.buffer.name).c_str());
 
   char** argv = alloc_arguments(file_path, parameters);
+  pipe_reader::process_type process;
 #ifdef _WIN32
-  void* process = nullptr;
+  process = nullptr;
   int err = jtk::create_pipe(file_path.c_str(), argv, nullptr, &process);
-  free_arguments(argv);
-  if (err != 0)
-    {
-    std::string error_message = "Could not create child process";
-    state.message = string_to_line(error_message);
-    return state;
-    }
-  int res = jtk::send_to_pipe(process, output.c_str());
-  if (res != NO_ERROR)
-    {
-    state.message = string_to_line(std::string("Error writing to external process"));
-    return state;
-    }
-  std::string text = jtk::read_from_pipe(process, 100);
 #else
-  int pipefd[3];
-  int err = jtk::create_pipe(file_path.c_str(), argv, nullptr, pipefd);
+  int err = jtk::create_pipe(file_path.c_str(), argv, nullptr, process.data());
+#endif
   free_arguments(argv);
   if (err != 0)
     {
@@ -2866,18 +4002,7 @@ app_state execute_external_input_output(app_state state, const std::string& file
     state.message = string_to_line(error_message);
     return state;
     }
-  jtk::send_to_pipe(pipefd, output.c_str());
-  std::string text = jtk::read_from_pipe(pipefd, 100);
-#endif
-
-  state.buffer = insert(state.buffer, text, convert(s));
-
-#ifdef _WIN32        
-  jtk::close_pipe(process);
-#else
-  jtk::close_pipe(pipefd);
-#endif
-  return state;
+  return start_job(state, process, file_path, output, true, s);
   }
 
 std::optional<app_state> execute(app_state state, const std::wstring& command, settings& s)
@@ -2948,6 +4073,8 @@ std::optional<app_state> execute(app_state state, const std::wstring& command, s
 
 std::optional<app_state> load_file(app_state state, const std::string& filename, settings& s)
   {
+  if (!s.open_files_in_new_window && state.wt == wt_normal)
+    return open_in_workspace(state, filename, s);
   write_settings(s, get_file_in_executable_path("jed_settings.json").c_str());
   std::string exepath = jtk::get_executable_path();
   exepath.insert(exepath.begin(), '"');
@@ -3053,14 +4180,14 @@ std::optional<app_state> find_text(app_state state, const std::wstring& command,
   if (state.operation == op_editing)
     {
     s.last_find = jtk::convert_wstring_to_string(command);
-    state.buffer = find_text(state.buffer, command);
+    state = find_in_buffer(state, to_text(command), s);
     return check_scroll_position(state, s);
     }
   if (state.operation == op_command_editing)
     {
     s.last_find = jtk::convert_wstring_to_string(command);
     state.operation = op_editing;
-    state.buffer = find_text(state.buffer, command);
+    state = find_in_buffer(state, to_text(command), s);
     return check_scroll_position(state, s);
     }
   return state;
@@ -3070,6 +4197,8 @@ std::optional<app_state> load(app_state state, const std::wstring& command, sett
   {
   if (command.empty())
     return state;
+  if (auto address = get_address(command))
+    return goto_address(state, *address, s);
   std::string folder = jtk::get_folder(state.buffer.name);
   if (folder.empty())
     folder = jtk::get_folder(jtk::get_executable_path());
@@ -3523,7 +4652,9 @@ app_state start_pipe(app_state state, const std::string& inputfile, const std::v
   std::string text = jtk::read_from_pipe(state.process.data(), 100);
 #endif
 
-  state.buffer = insert(state.buffer, text, convert(s));
+  state.reader = std::make_shared<pipe_reader>(state.process, std::string(), true, false);
+
+  state.buffer = append_output(state.buffer, text, s.piped_scrollback_rows);
   if (!state.buffer.content.empty())
     {
     auto last_line = state.buffer.content.back();
@@ -3544,31 +4675,77 @@ app_state start_pipe(app_state state, const std::string& inputfile, int argc, ch
 app_state check_pipes(bool& modifications, app_state state, const settings& s)
   {
   modifications = false;
-  if (state.wt != wt_piped)
+  if (state.wt != wt_piped || !state.reader)
     return state;
-#ifdef _WIN32
-  std::string text = jtk::read_from_pipe(state.process, 10);
-#else
-  std::string text = jtk::read_from_pipe(state.process.data(), 10);
-#endif
+  std::string text = state.reader->take_output();
   if (text.empty())
     return state;
   modifications = true;
-  state.buffer.pos = get_last_position(state.buffer);
-  state.buffer = insert(state.buffer, text, convert(s));
+  state.buffer = append_output(state.buffer, text, s.piped_scrollback_rows);
   auto last_line = state.buffer.content.back();
   state.piped_prompt = std::wstring(last_line.begin(), last_line.end());
   return check_scroll_position(state, s);
   }
 
+#ifdef JED_PROFILING
+namespace
+  {
+  const char* _event_name(uint32_t type)
+    {
+    if (type == wake_up_event_type)
+      return "wake up";
+    switch (type)
+      {
+      case SDL_WINDOWEVENT: return "SDL_WINDOWEVENT";
+      case SDL_TEXTINPUT: return "SDL_TEXTINPUT";
+      case SDL_KEYDOWN: return "SDL_KEYDOWN";
+      case SDL_KEYUP: return "SDL_KEYUP";
+      case SDL_MOUSEMOTION: return "SDL_MOUSEMOTION";
+      case SDL_MOUSEBUTTONDOWN: return "SDL_MOUSEBUTTONDOWN";
+      case SDL_MOUSEBUTTONUP: return "SDL_MOUSEBUTTONUP";
+      case SDL_MOUSEWHEEL: return "SDL_MOUSEWHEEL";
+      case SDL_QUIT: return "SDL_QUIT";
+      default: return "other event";
+      }
+    }
+  }
+#endif
+
 std::optional<app_state> process_input(app_state state, settings& s)
   {
   SDL_Event event;
-  auto tic = std::chrono::steady_clock::now();
   for (;;)
     {
+    if (lexer_status_is_pending(state.buffer)) // relex the rows after a large edit in idle time, the visible rows are up to date already
+      {
+      SDL_PumpEvents();
+      if (!SDL_HasEvents(SDL_FIRSTEVENT, SDL_LASTEVENT))
+        {
+        JED_PROFILE_SCOPE("idle relex");
+        state.buffer = validate_lexer_status(state.buffer, state.buffer.lex_pending_row + 65536);
+        continue;
+        }
+      }
+    else
+      SDL_WaitEventTimeout(nullptr, 500); // the event stays in the queue
+    JED_PROFILE_SCOPE("process_input"); // starts after the wait, so that only the handling of the events is timed
     while (SDL_PollEvent(&event))
       {
+      JED_PROFILE_INPUT();
+      JED_PROFILE_SCOPE(_event_name(event.type));
+      if (event.type == wake_up_event_type) // output of a child process, rows of a file that is loading, or a finished background search
+        {
+        bool pipe_modifications, job_modifications, load_modifications;
+        state = check_pipes(pipe_modifications, state, s);
+        state = check_jobs(job_modifications, state, s);
+        state = check_loads(load_modifications, state, s);
+        state = check_superseded_searches(state);
+        if (find_all_is_finished(state)) // the search publishes its matches before it wakes up the main loop
+          return finish_find_all(state, s);
+        if (pipe_modifications || job_modifications || load_modifications)
+          return state;
+        continue;
+        }
       keyb.handle_event(event);
       switch (event.type)
         {
@@ -3718,6 +4895,8 @@ std::optional<app_state> process_input(app_state state, settings& s)
               s.last_find = to_string(get_selection(fb, convert(s)));
               }
             }
+          if (shift_pressed())
+            return find_previous(state, s);
           return find_next(state, s);
           }
           case SDLK_F5:
@@ -3958,26 +5137,22 @@ std::optional<app_state> process_input(app_state state, settings& s)
         }
         case SDL_QUIT:
         {
+        state.hidden_buffers.erase(std::remove_if(state.hidden_buffers.begin(), state.hidden_buffers.end(), [](const hidden_buffer& hb) { return !is_modified(hb.buffer); }), state.hidden_buffers.end()); // only modified files keep the window open
         return command_exit(state, s);
         }
         } // switch (event.type)
       }
-    std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(5.0));
-    auto toc = std::chrono::steady_clock::now();
-    auto time_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(toc - tic).count();
-    if (state.wt == wt_piped && time_elapsed > 1000)
-      {
-      bool modifications;
-      state = check_pipes(modifications, state, s);
-      tic = std::chrono::steady_clock::now();
-      if (modifications)
-        return state;
-      }
+    if (find_all_is_finished(state))
+      return finish_find_all(state, s);
     }
   }
 
 engine::engine(int argc, char** argv, const settings& input_settings) : s(input_settings)
   {
+  wake_up_event_type = SDL_RegisterEvents(1);
+#ifndef _WIN32
+  signal(SIGPIPE, SIG_IGN); // writing the selection to a child that exited or was killed fails instead of ending jed
+#endif
   pdc_font_size = s.font_size;
 #ifdef _WIN32
   TTF_CloseFont(pdc_ttffont);
@@ -4070,7 +5245,7 @@ engine::engine(int argc, char** argv, const settings& input_settings) : s(input_
         j = argc;
         }
       else
-        state.buffer = read_from_file(inputfile);
+        state.buffer = read_file(state, inputfile);
       }
     }
   if (state.buffer.name.empty())
@@ -4125,13 +5300,20 @@ void engine::run()
 
   while (auto new_state = process_input(state, s))
     {
+    JED_PROFILE_FRAME_BEGIN();
     state = *new_state;
     state = draw(state, s);
 
+    {
+    JED_PROFILE_SCOPE("SDL_UpdateWindowSurface");
     SDL_UpdateWindowSurface(pdc_window);
     }
+    JED_PROFILE_FRAME_END();
+    }
 
   state = *command_kill(state, s);
+  state = clear_find_all(state);
+  state.superseded_searches.clear(); // waits for the searches that still run, while SDL can still take their wake up events
 
   s.w = state.w / font_width;
   s.h = state.h / font_height;
@@ -1,8 +1,10 @@
 #pragma once
 
 #include "buffer.h"
+#include "search.h"
 #include "settings.h"
 #include <array>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -30,6 +32,75 @@ enum e_window_type
   wt_piped
   };
 
+/*
+Snapshot of the text and result of a Find all search on a background thread, see make_match_index.
+*/
+struct find_all_job;
+
+/*
+Index of all matches of find_text in one revision of the buffer, made by the Find all command.
+The search runs in the background on a snapshot of the content.
+*/
+struct match_index
+  {
+  std::shared_ptr<find_all_job> job; // set while the search is running
+  std::shared_ptr<const std::vector<search_match>> matches; // sorted, empty matches left out
+  std::string find_text;
+  bool regex;
+  std::string buffer_name;
+  uint64_t revision;
+  int64_t nr_of_rows;
+  };
+
+/*
+Reads the output of a piped child process on a separate thread, see start_pipe.
+*/
+struct pipe_reader;
+
+/*
+External command started with <, > or | from the command window, see execute. The selection is written to
+the process and its output is inserted in the buffer in chunks as it arrives, see check_jobs.
+*/
+struct pipe_job
+  {
+  std::shared_ptr<pipe_reader> reader;
+  std::string command;
+  std::string buffer_name; // the output only goes to this buffer
+  position insert_pos; // where the next output is inserted
+  uint64_t revision; // of the buffer after the last output was inserted, insert_pos is a position in this revision
+  };
+
+/*
+Number of screen rows of each row of the buffer in wrap mode, with a Fenwick tree over these numbers, so that
+rows and screen rows are mapped onto each other in O(log n). See sync_wrap_index.
+*/
+struct wrap_index
+  {
+  std::vector<int32_t> screen_rows; // screen rows of each row
+  std::vector<int64_t> tree; // Fenwick tree over screen_rows
+  uint64_t damage_id; // the index is up to date but for the damage of the buffer since this clear_damage
+  int maxcol, maxrow, tab_space;
+  bool show_all_characters;
+  };
+
+/*
+File that is still being read in the background, see read_file. The rows are appended by check_loads.
+*/
+struct file_load
+  {
+  std::shared_ptr<file_loader> loader;
+  std::string buffer_name; // the rows only go to this buffer
+  };
+
+/*
+An open file of the workspace that is not shown at the moment, see load_file.
+*/
+struct hidden_buffer
+  {
+  file_buffer buffer;
+  int64_t scroll_row;
+  };
+
 struct app_state
   {
   file_buffer buffer;
@@ -41,11 +112,20 @@ struct app_state
   e_operation operation;  
   std::vector<e_operation> operation_stack;
   std::wstring piped_prompt;
+  match_index find_all;
+  std::vector<std::shared_ptr<find_all_job>> superseded_searches; // running searches whose result is not needed anymore
 #ifdef _WIN32
   void* process;
 #else
   std::array<int, 3> process;
 #endif  
+  std::shared_ptr<pipe_reader> reader; // set while wt == wt_piped
+  std::vector<pipe_job> jobs;
+  std::vector<file_load> loads;
+  std::shared_ptr<wrap_index> wrap; // only kept up to date in wrap mode
+  std::shared_ptr<bracket_index> brackets; // built the first time the cursor is on a bracket, see update_brackets
+  std::shared_ptr<text_type_index> text_types; // of the rows that were drawn, see update_text_types
+  std::vector<hidden_buffer> hidden_buffers; // the other files of the workspace, the one to show next first
   int w, h;
   e_window_type wt;
   };
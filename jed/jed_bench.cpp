@@ -0,0 +1,782 @@
+/*
+Headless benchmarks of the buffer engine, without SDL or pdcurses. The corpora are generated in the working
+folder and removed afterwards. The results are written as JSON, to stdout or to the file given with --out,
+so that runs of different versions can be compared.
+
+  jed_bench [--quick] [--large] [--out results.json]
+
+--quick makes the corpora a hundred times smaller, and the Python corpus ten times, so that it is still lexed
+in parallel chunks. --large uses a 2 GB log file and 1 GB of pipe output.
+Progress is written to stderr. jed_bench --open file is the child process of the open_new_process benchmark.
+*/
+
+#define JTK_FILE_UTILS_IMPLEMENTATION
+#include "jtk/file_utils.h"
+
+#include "buffer.h"
+#include "search.h"
+#include "settings.h"
+#include "syntax_highlight.h"
+#include "utils.h"
+
+#include <json.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+  {
+  std::atomic<int64_t> heap_bytes(0); // bytes that are allocated through operator new and not freed yet
+  }
+
+/*
+Counts the heap memory of the buffers, so that the memory use of both line layouts can be compared between
+a build with and a build without JED_COMPACT_LINES.
+*/
+void* operator new(std::size_t size)
+  {
+  void* memory = std::malloc(size + sizeof(std::max_align_t));
+  if (!memory)
+    throw std::bad_alloc();
+  *(std::size_t*)memory = size;
+  heap_bytes += (int64_t)size;
+  return (char*)memory + sizeof(std::max_align_t);
+  }
+
+void operator delete(void* p) noexcept
+  {
+  if (!p)
+    return;
+  char* memory = (char*)p - sizeof(std::max_align_t);
+  heap_bytes -= (int64_t)*(std::size_t*)memory;
+  std::free(memory);
+  }
+
+void operator delete(void* p, std::size_t) noexcept
+  {
+  operator delete(p);
+  }
+
+namespace
+  {
+  struct bench_sizes
+    {
+    int64_t cpp_rows;
+    int64_t python_rows;
+    int64_t json_rows, json_row_bytes;
+    int64_t log_rows;
+    uint64_t pipe_bytes;
+    int64_t edits;
+    int64_t keystrokes;
+    };
+
+  typedef std::chrono::steady_clock bench_clock;
+
+  double _seconds_since(bench_clock::time_point start)
+    {
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+    }
+
+  nlohmann::json& _report(nlohmann::json& results, const std::string& benchmark, const std::string& corpus, double seconds, int64_t operations)
+    {
+    nlohmann::json r;
+    r["benchmark"] = benchmark;
+    r["corpus"] = corpus;
+    r["seconds"] = seconds;
+    r["operations"] = operations;
+    r["microseconds_per_operation"] = operations > 0 ? seconds * 1e6 / (double)operations : 0.0;
+    results.push_back(r);
+    std::cerr << benchmark << " (" << corpus << "): " << seconds << " s" << std::endl;
+    return results.back();
+    }
+
+  uint64_t _file_size(const std::string& filename)
+    {
+    std::ifstream f(filename, std::ios::binary | std::ios::ate);
+    return f.is_open() ? (uint64_t)f.tellg() : 0;
+    }
+
+  /*
+  C++ code with comments, multiline comments, strings with brackets in them and tab indentation.
+  */
+  void _write_cpp_corpus(const std::string& filename, int64_t rows)
+    {
+    static const char* templates[] =
+      {
+      "/*\n",
+      " * Function %d computes a sum (see the notes below).\n",
+      " */\n",
+      "int function_%d(const std::vector<int>& values, int a)\n",
+      "\t{\n",
+      "\tstd::string s = \"text (with [brackets]) %d\";\n",
+      "\tint b = 0; // accumulator {%d}\n",
+      "\tfor (int i = 0; i < a && i < (int)values.size(); ++i)\n",
+      "\t\t{\n",
+      "\t\tb += values[i] * (i %% %d);\n",
+      "\t\t}\n",
+      "\treturn b;\n",
+      "\t}\n",
+      "\n"
+      };
+    const int64_t nr_of_templates = sizeof(templates) / sizeof(templates[0]);
+    std::ofstream f(filename, std::ios::binary);
+    char buffer[256];
+    for (int64_t r = 0; r < rows; ++r)
+      {
+      snprintf(buffer, sizeof(buffer), templates[r % nr_of_templates], (int)(r / nr_of_templates) + 1);
+      f << buffer;
+      }
+    }
+
+  /*
+  Minified JSON, every row is one long line. String values contain tabs.
+  */
+  void _write_json_corpus(const std::string& filename, int64_t rows, int64_t row_bytes)
+    {
+    std::ofstream f(filename, std::ios::binary);
+    char buffer[256];
+    for (int64_t r = 0; r < rows; ++r)
+      {
+      std::string ln = "{\"items\":[";
+      for (int64_t id = 0; (int64_t)ln.size() < row_bytes; ++id)
+        {
+        snprintf(buffer, sizeof(buffer), "%s{\"id\":%lld,\"name\":\"item\\t%lld\",\"note\":\"a\tb\",\"tags\":[\"x\",\"y\"],\"size\":{\"w\":%lld,\"h\":7}}", id ? "," : "", (long long)id, (long long)id, (long long)(id % 97));
+        ln.append(buffer);
+        }
+      ln.append("]}\n");
+      f << ln;
+      }
+    }
+
+  /*
+  Python code with docstrings, whose multiline strings begin and end with the same delimiter, on rows of their own.
+  */
+  void _write_python_corpus(const std::string& filename, int64_t rows)
+    {
+    static const char* templates[] =
+      {
+      "def function_%d(values, a):\n",
+      "    \"\"\"\n",
+      "    Function %d computes a sum (see the notes below).\n",
+      "\n",
+      "    values: the terms [%d]\n",
+      "    a: the number of terms, 'a' for short\n",
+      "    \"\"\"\n",
+      "    b = 0  # accumulator {%d}\n",
+      "    for i in range(min(a, len(values))):\n",
+      "        b += values[i] * (i %% %d)\n",
+      "    return b\n",
+      "\n"
+      };
+    const int64_t nr_of_templates = sizeof(templates) / sizeof(templates[0]);
+    std::ofstream f(filename, std::ios::binary);
+    char buffer[256];
+    for (int64_t r = 0; r < rows; ++r)
+      {
+      snprintf(buffer, sizeof(buffer), templates[r % nr_of_templates], (int)(r / nr_of_templates) + 1);
+      f << buffer;
+      }
+    }
+
+  void _write_log_corpus(const std::string& filename, int64_t rows)
+    {
+    static const char* levels[] = { "INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR" };
+    std::ofstream f(filename, std::ios::binary);
+    std::string chunk;
+    char buffer[256];
+    for (int64_t r = 0; r < rows; ++r)
+      {
+      snprintf(buffer, sizeof(buffer), "2026-01-01 %02d:%02d:%02d.%03d %s [worker-%d] request %lld handled in %d ms\n", (int)(r / 3600000) % 24, (int)(r / 60000) % 60, (int)(r / 1000) % 60, (int)(r % 1000), levels[r % 6], (int)(r % 8), (long long)r, (int)(r * 7919 % 500));
+      chunk.append(buffer);
+      if (chunk.size() > (1 << 20))
+        {
+        f << chunk;
+        chunk.clear();
+        }
+      }
+    f << chunk;
+    }
+
+  file_buffer _set_syntax(file_buffer fb, const syntax_highlighter& shl, const std::string& ext)
+    {
+    fb.syntax.should_highlight = shl.extension_or_filename_has_syntax_highlighter(ext);
+    if (fb.syntax.should_highlight)
+      {
+      comment_data cd = shl.get_syntax_highlighter(ext);
+      fb.syntax.multiline_begin = cd.multiline_begin;
+      fb.syntax.multiline_end = cd.multiline_end;
+      fb.syntax.multistring_begin = cd.multistring_begin;
+      fb.syntax.multistring_end = cd.multistring_end;
+      fb.syntax.single_line = cd.single_line;
+      fb.syntax.uses_quotes_for_chars = cd.uses_quotes_for_chars;
+      }
+    return fb;
+    }
+
+  file_buffer _bench_file_io(nlohmann::json& results, const std::string& corpus, const std::string& filename, const syntax_highlighter& shl, const std::string& ext)
+    {
+    const int64_t heap_before = heap_bytes;
+    auto start = bench_clock::now();
+    file_buffer fb = read_from_file(filename);
+    const double seconds = _seconds_since(start);
+    const int64_t heap = heap_bytes - heap_before;
+    nlohmann::json& r = _report(results, "read_from_file", corpus, seconds, 1);
+    r["rows"] = (int64_t)fb.content.size();
+    r["bytes"] = _file_size(filename);
+    r["heap_bytes"] = heap; // of the content and the lexer status
+
+    const std::string out = filename + ".saved";
+    bool success = false;
+    start = bench_clock::now();
+    save_to_file(success, fb, out);
+    _report(results, "save_to_file", corpus, _seconds_since(start), 1)["success"] = success;
+    std::remove(out.c_str());
+
+    fb = _set_syntax(fb, shl, ext);
+    start = bench_clock::now();
+    fb = init_lexer_status(fb);
+    nlohmann::json& lexed = _report(results, "init_lexer_status", corpus, _seconds_since(start), (int64_t)fb.content.size());
+    lexed["threads"] = std::thread::hardware_concurrency();
+
+    const int64_t rows = (int64_t)fb.content.size();
+    int64_t wrong_rows = 0; // rows whose status does not follow from the row before, 0 if the status equals that of the serial lexer
+    for (int64_t r = 1; r < rows; ++r)
+      wrong_rows += fb.lex[r] != get_end_of_line_lexer_status(fb, r - 1);
+    lexed["rows_inconsistent_with_serial_lexer"] = wrong_rows;
+    if (wrong_rows)
+      std::cerr << "init_lexer_status (" << corpus << "): the status of " << wrong_rows << " rows does not follow from the row before" << std::endl;
+
+    start = bench_clock::now();
+    size_t types = 0;
+    for (int64_t r = 0; r < rows; ++r)
+      types += get_text_type(fb, r).size();
+    _report(results, "get_text_type", corpus, _seconds_since(start), rows)["text_types"] = (int64_t)types;
+    return fb;
+    }
+
+  position _random_position(const file_buffer& fb, std::mt19937& rng)
+    {
+    position pos;
+    pos.row = (int64_t)(rng() % fb.content.size());
+    pos.col = (int64_t)(rng() % (fb.content[pos.row].size() + 1));
+    return get_actual_position(fb, pos);
+    }
+
+  void _bench_editing(nlohmann::json& results, const std::string& corpus, file_buffer fb, const std::string& word, int64_t edits, const env_settings& senv)
+    {
+    std::mt19937 rng(25);
+    auto start = bench_clock::now();
+    for (int64_t i = 0; i < edits; ++i)
+      {
+      fb.pos = _random_position(fb, rng);
+      fb = insert(fb, std::string("x"), senv);
+      }
+    _report(results, "insert", corpus, _seconds_since(start), edits);
+
+    start = bench_clock::now();
+    for (int64_t i = 0; i < edits; ++i)
+      {
+      fb.pos = _random_position(fb, rng);
+      fb = erase(fb, senv);
+      }
+    _report(results, "erase", corpus, _seconds_since(start), edits);
+
+    start = bench_clock::now();
+    for (int64_t i = 0; i < edits; ++i)
+      fb = undo(fb, senv);
+    _report(results, "undo", corpus, _seconds_since(start), edits);
+
+    start = bench_clock::now();
+    for (int64_t i = 0; i < edits; ++i)
+      fb = redo(fb, senv);
+    _report(results, "redo", corpus, _seconds_since(start), edits);
+
+    fb.pos = position(0, 0);
+    fb.start_selection = std::nullopt;
+    const search_pattern pattern = make_search_pattern(jtk::convert_string_to_wstring(word));
+    int64_t found = 0;
+    start = bench_clock::now();
+    for (; found < edits; ++found)
+      {
+      fb = find_text(fb, pattern);
+      if (fb.start_selection == std::nullopt)
+        break;
+      }
+    _report(results, "find_text", corpus, _seconds_since(start), found + 1)["matches"] = found;
+
+    start = bench_clock::now();
+    const auto matches = find_all_matches(fb.content, pattern);
+    _report(results, "find_all_matches", corpus, _seconds_since(start), 1)["matches"] = (int64_t)matches.size();
+    }
+
+  /*
+  Replaces every occurrence of find, a few hundred thousand in the C++ corpus, and undoes that in one step.
+  */
+  void _bench_replace_all(nlohmann::json& results, const std::string& corpus, file_buffer fb, const std::wstring& find, const std::wstring& replacement, const env_settings& senv)
+    {
+    const search_pattern pattern = make_search_pattern(find);
+    const int64_t rows = (int64_t)fb.content.size();
+    const int64_t occurrences = (int64_t)find_all_matches(fb.content, pattern).size();
+    auto start = bench_clock::now();
+    fb = replace_all(fb, pattern, replacement, position(0, 0), get_last_position(fb), senv);
+    _report(results, "replace_all", corpus, _seconds_since(start), occurrences)["occurrences"] = occurrences;
+
+    start = bench_clock::now();
+    fb = undo(fb, senv);
+    const double seconds = _seconds_since(start);
+    const bool undone = (int64_t)fb.content.size() == rows && (int64_t)find_all_matches(fb.content, pattern).size() == occurrences;
+    _report(results, "undo_replace_all", corpus, seconds, 1)["undone_in_one_step"] = undone;
+    if (!undone)
+      std::cerr << "undo_replace_all (" << corpus << "): one undo did not restore the text" << std::endl;
+    }
+
+  /*
+  Regular expression search over all rows, a million for the C++ corpus: a pattern that matches on few rows, so that
+  the DFA rejects nearly every row, and a pattern with capture groups that matches on many rows.
+  */
+  void _bench_regex(nlohmann::json& results, const std::string& corpus, file_buffer fb, int64_t searches)
+    {
+    for (const std::wstring& expression : { std::wstring(L"function_99[0-9]*\\("), std::wstring(L"(\\w+)\\[(\\w+)\\]") })
+      {
+      bool success;
+      std::string error_message;
+      const search_pattern pattern = make_regex_search_pattern(success, error_message, expression);
+      if (!success)
+        {
+        std::cerr << "regex " << error_message << std::endl;
+        continue;
+        }
+      auto start = bench_clock::now();
+      const auto matches = find_all_matches(fb.content, pattern);
+      nlohmann::json& r = _report(results, "regex_find_all_matches", corpus, _seconds_since(start), 1);
+      r["pattern"] = jtk::convert_wstring_to_string(expression);
+      r["matches"] = (int64_t)matches.size();
+
+      fb.pos = position(0, 0);
+      fb.start_selection = std::nullopt;
+      int64_t found = 0;
+      start = bench_clock::now();
+      for (; found < searches; ++found)
+        {
+        fb = find_text(fb, pattern);
+        if (fb.start_selection == std::nullopt)
+          break;
+        }
+      nlohmann::json& f = _report(results, "regex_find_text", corpus, _seconds_since(start), found + 1);
+      f["pattern"] = jtk::convert_wstring_to_string(expression);
+      f["matches"] = found;
+      }
+    }
+
+  /*
+  Keyword classification of every word of the corpus, as draw_line does for highlighted rows.
+  */
+  void _bench_keywords(nlohmann::json& results, const std::string& corpus, const file_buffer& fb, const syntax_highlighter& shl, const std::string& ext)
+    {
+    if (!shl.extension_or_filename_has_keywords(ext))
+      return;
+    const keyword_trie& trie = shl.get_keywords(ext).trie;
+    int64_t words = 0, keywords = 0;
+    auto start = bench_clock::now();
+    for (const auto& ln : fb.content)
+      {
+      auto it = ln.begin();
+      const auto it_end = ln.end();
+      while (it != it_end)
+        {
+        if (is_word_delimiter(*it))
+          {
+          ++it;
+          continue;
+          }
+        int64_t length;
+        keywords += classify_word(length, it, it_end, trie) != 0;
+        ++words;
+        std::advance(it, length);
+        }
+      }
+    nlohmann::json& r = _report(results, "classify_word", corpus, _seconds_since(start), words);
+    r["words"] = words;
+    r["keywords"] = keywords;
+    }
+
+  /*
+  Scrolls one row per frame through the first 50k rows. scroll_frame takes the text types of the visible rows from
+  a text_type_index, as draw_buffer does, scroll_frame_lexing_all_rows lexes every visible row in every frame.
+  Only the highlighting part of a frame is timed, the drawing itself needs a window.
+  */
+  void _bench_scrolling(nlohmann::json& results, const std::string& corpus, file_buffer fb, int64_t visible_rows)
+    {
+    const uint32_t rows = std::min<uint32_t>(fb.content.size(), 50000);
+    fb.content = fb.content.take(rows);
+    fb.lex = fb.lex.take(rows);
+    fb = clear_damage(fb);
+    const int64_t frames = std::max<int64_t>((int64_t)rows - visible_rows, 1);
+    text_type_index ti;
+    ti.damage_id = 0;
+    int64_t types = 0;
+    auto start = bench_clock::now();
+    for (int64_t frame = 0; frame < frames; ++frame)
+      {
+      sync_text_type_index(ti, fb);
+      for (int64_t r = frame; r < frame + visible_rows && r < (int64_t)rows; ++r)
+        types += (int64_t)get_text_type(ti, fb, r).size();
+      fb = clear_damage(fb);
+      ti.damage_id = fb.damage_id;
+      }
+    nlohmann::json& r = _report(results, "scroll_frame", corpus, _seconds_since(start), frames);
+    r["rows"] = rows;
+    r["visible_rows"] = visible_rows;
+    r["text_types"] = types;
+
+    types = 0;
+    start = bench_clock::now();
+    for (int64_t frame = 0; frame < frames; ++frame)
+      {
+      for (int64_t r = frame; r < frame + visible_rows && r < (int64_t)rows; ++r)
+        types += (int64_t)get_text_type(fb, r).size();
+      }
+    nlohmann::json& l = _report(results, "scroll_frame_lexing_all_rows", corpus, _seconds_since(start), frames);
+    l["rows"] = rows;
+    l["visible_rows"] = visible_rows;
+    l["text_types"] = types;
+    }
+
+  /*
+  Types words one character at a time at random positions, a million keystrokes for the full corpus. Every tenth
+  word is undone right away, which should remove the whole word: consecutive keystrokes are merged in one undo step.
+  The undo memory is reported next to that of a copy of the whole text for every undo step, as the undo history
+  used to keep.
+  */
+  void _bench_typing(nlohmann::json& results, const std::string& corpus, file_buffer fb, int64_t keystrokes, const env_settings& senv)
+    {
+    const std::string word = "keystrokes";
+    const int64_t words = keystrokes / (int64_t)word.size();
+    std::mt19937 rng(4);
+    int64_t undone = 0, checked = 0;
+    auto start = bench_clock::now();
+    for (int64_t i = 0; i < words; ++i)
+      {
+      fb.pos = _random_position(fb, rng);
+      const bool check = i % 10 == 0;
+      const int64_t rows = (int64_t)fb.content.size();
+      std::wstring before;
+      if (check)
+        before.assign(fb.content[fb.pos.row].begin(), fb.content[fb.pos.row].end());
+      for (char ch : word)
+        fb = insert(fb, std::string(1, ch), senv);
+      if (check)
+        {
+        fb = undo(fb, senv);
+        const line& undone_ln = fb.content[fb.pos.row];
+        if ((int64_t)fb.content.size() == rows && std::wstring(undone_ln.begin(), undone_ln.end()) == before)
+          ++undone;
+        ++checked;
+        }
+      }
+    nlohmann::json& r = _report(results, "type_words", corpus, _seconds_since(start), words * (int64_t)word.size());
+    r["words"] = words;
+    r["words_undone"] = checked;
+    r["words_undone_in_one_step"] = undone;
+    if (undone != checked)
+      std::cerr << "type_words (" << corpus << "): only " << undone << " of " << checked << " words were undone in one step" << std::endl;
+
+    uint64_t text_bytes = 0; // counted as the undo memory of a record counts its rows
+    start = bench_clock::now();
+    std::vector<std::wstring> copy;
+    copy.reserve(fb.content.size());
+    for (const auto& ln : fb.content)
+      {
+      copy.emplace_back(ln.begin(), ln.end());
+      text_bytes += sizeof(line) + ln.size() * sizeof(wchar_t);
+      }
+    const double copy_seconds = _seconds_since(start);
+    r["undo_steps"] = fb.undo_redo_index;
+    r["undo_memory"] = fb.undo_memory;
+    r["text_copy_bytes"] = text_bytes;
+    r["text_copy_seconds"] = copy_seconds;
+    r["text_copy_undo_memory"] = text_bytes * fb.undo_redo_index; // of the old scheme, for the same undo steps
+    }
+
+  /*
+  Opening a multiline comment at the top of a lexed file: the keystroke only relexes a bounded number of rows, the remainder is
+  relexed by validate_lexer_status in idle time.
+  */
+  void _bench_lazy_lexing(nlohmann::json& results, const std::string& corpus, file_buffer fb, const env_settings& senv)
+    {
+    fb.pos = position(0, 0);
+    auto start = bench_clock::now();
+    fb = insert(fb, std::string("/*"), senv);
+    _report(results, "keystroke_opening_comment", corpus, _seconds_since(start), 1)["pending"] = lexer_status_is_pending(fb);
+    start = bench_clock::now();
+    fb = validate_lexer_status(fb, (int64_t)fb.content.size());
+    _report(results, "validate_lexer_status", corpus, _seconds_since(start), (int64_t)fb.content.size());
+    }
+
+  void _bench_lexer_scaling(nlohmann::json& results, const std::string& corpus, const file_buffer& fb)
+    {
+    for (int64_t divisor : { 16, 4, 1 })
+      {
+      file_buffer part = fb;
+      part.content = fb.content.take((uint32_t)(fb.content.size() / divisor));
+      auto start = bench_clock::now();
+      part = init_lexer_status(part);
+      _report(results, "init_lexer_status_rows_" + std::to_string(part.content.size()), corpus, _seconds_since(start), (int64_t)part.content.size());
+      }
+    }
+
+  void _bench_brackets(nlohmann::json& results, const std::string& corpus, file_buffer fb, int64_t queries)
+    {
+    bracket_index bi;
+    bi.damage_id = 0;
+    auto start = bench_clock::now();
+    sync_bracket_index(bi, fb);
+    _report(results, "sync_bracket_index", corpus, _seconds_since(start), (int64_t)fb.content.size());
+
+    std::mt19937 rng(23);
+    std::vector<position> brackets;
+    while ((int64_t)brackets.size() < queries)
+      {
+      const int64_t row = (int64_t)(rng() % fb.content.size());
+      const line& ln = fb.content[row];
+      for (int64_t col = 0; col < (int64_t)ln.size(); ++col)
+        {
+        if (is_bracket(ln[col]))
+          {
+          brackets.emplace_back(row, col);
+          break;
+          }
+        }
+      }
+    int64_t found = 0;
+    start = bench_clock::now();
+    for (const auto& pos : brackets)
+      found += find_corresponding_token(bi, fb, pos).row >= 0;
+    _report(results, "find_corresponding_token", corpus, _seconds_since(start), (int64_t)brackets.size())["found"] = found;
+    }
+
+  /*
+  Up and down between long lines with tabs converts between columns and x positions.
+  */
+  void _bench_cursor_motion(nlohmann::json& results, const std::string& corpus, file_buffer fb, int64_t moves, const env_settings& senv)
+    {
+    fb.pos = position(0, (int64_t)fb.content[0].size() / 2);
+    fb.xpos = get_x_position(fb, senv);
+    auto start = bench_clock::now();
+    for (int64_t i = 0; i < moves; ++i)
+      fb = (i & 1) ? move_up(fb, senv) : move_down(fb, senv);
+    _report(results, "move_up_down", corpus, _seconds_since(start), moves);
+
+    start = bench_clock::now();
+    for (int64_t i = 0; i < moves; ++i)
+      fb = move_right(fb, senv);
+    _report(results, "move_right", corpus, _seconds_since(start), moves);
+    }
+
+  void _bench_pipe_output(nlohmann::json& results, uint64_t bytes)
+    {
+    std::string chunk;
+    for (int i = 0; chunk.size() < 65536; ++i)
+      chunk += "output line " + std::to_string(i) + " of a long running child process\n";
+    file_buffer fb = make_empty_buffer();
+    uint64_t appended = 0;
+    auto start = bench_clock::now();
+    for (; appended < bytes; appended += chunk.size())
+      fb = append_output(fb, chunk, 100000);
+    nlohmann::json& r = _report(results, "append_output", "pipe", _seconds_since(start), (int64_t)(appended / chunk.size()));
+    r["bytes"] = appended;
+    r["rows"] = (int64_t)fb.content.size();
+    }
+
+  void _bench_progressive_load(nlohmann::json& results, const std::string& corpus, const std::string& filename)
+    {
+    std::shared_ptr<file_loader> loader;
+    auto start = bench_clock::now();
+    file_buffer fb = read_from_file_progressively(loader, filename, 1 << 20, []() {});
+    _report(results, "progressive_load_first_rows", corpus, _seconds_since(start), 1)["rows"] = (int64_t)fb.content.size();
+    bool finished = !loader;
+    while (!finished)
+      {
+      fb = append_loaded_rows(finished, fb, *loader);
+      if (!finished)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    _report(results, "progressive_load_all_rows", corpus, _seconds_since(start), 1)["rows"] = (int64_t)fb.content.size();
+    }
+
+  /*
+  The work of opening a file in jed besides drawing it: detecting the syntax, reading and lexing.
+  */
+  file_buffer _open_file(const std::string& filename, const syntax_highlighter& shl)
+    {
+    file_buffer fb = read_from_file(filename);
+    fb = _set_syntax(fb, shl, jtk::get_extension(filename));
+    return init_lexer_status(fb);
+    }
+
+  /*
+  Opening a file in the workspace of a running jed, against starting a new process for it, which also reads the
+  settings and the syntax definitions. The new process does not initialize SDL, the window and the font, which
+  a new jed window does on top of this.
+  */
+  void _bench_open(nlohmann::json& results, const std::string& corpus, const std::string& filename, const syntax_highlighter& shl, int repeats)
+    {
+    auto start = bench_clock::now();
+    for (int i = 0; i < repeats; ++i)
+      _open_file(filename, shl);
+    _report(results, "open_in_workspace", corpus, _seconds_since(start), repeats);
+
+    const std::string command = "\"" + jtk::get_executable_path() + "\" --open \"" + filename + "\"";
+    int failures = 0;
+    start = bench_clock::now();
+    for (int i = 0; i < repeats; ++i)
+      failures += std::system(command.c_str()) != 0;
+    _report(results, "open_new_process", corpus, _seconds_since(start), repeats)["failures"] = failures;
+    if (failures)
+      std::cerr << "open_new_process (" << corpus << "): " << command << " failed " << failures << " times" << std::endl;
+    }
+
+  /*
+  Looking up a command that does not exist visits the buffer folder, the working folder, the executable folder
+  and every folder in PATH.
+  */
+  void _bench_path_lookup(nlohmann::json& results, int64_t lookups)
+    {
+    auto start = bench_clock::now();
+    get_file_path("jed_bench_missing_command", "");
+    _report(results, "get_file_path_first", "path", _seconds_since(start), 1);
+    start = bench_clock::now();
+    for (int64_t i = 0; i < lookups; ++i)
+      get_file_path("jed_bench_missing_command", "");
+    _report(results, "get_file_path", "path", _seconds_since(start), lookups);
+    }
+  }
+
+int main(int argc, char** argv)
+  {
+  if (argc == 3 && std::string(argv[1]) == "--open")
+    {
+    settings s = read_settings(get_file_in_executable_path("jed_settings.json").c_str());
+    update_settings(s, get_file_in_executable_path("jed_user_settings.json").c_str());
+    const syntax_highlighter shl;
+    return _open_file(argv[2], shl).content.empty() ? 1 : 0;
+    }
+
+  bool quick = false;
+  bool large = false;
+  std::string output;
+  for (int i = 1; i < argc; ++i)
+    {
+    const std::string arg(argv[i]);
+    if (arg == "--quick")
+      quick = true;
+    else if (arg == "--large")
+      large = true;
+    else if (arg == "--out" && i + 1 < argc)
+      output = argv[++i];
+    else
+      {
+      std::cerr << "usage: jed_bench [--quick] [--large] [--out results.json]\n";
+      return 1;
+      }
+    }
+
+  bench_sizes sizes;
+  sizes.cpp_rows = 1000000;
+  sizes.python_rows = 1000000;
+  sizes.json_rows = 3;
+  sizes.json_row_bytes = 5 << 20;
+  sizes.log_rows = large ? 33000000 : 10000000;
+  sizes.pipe_bytes = large ? (1ull << 30) : (256ull << 20);
+  sizes.edits = 10000;
+  sizes.keystrokes = 1000000;
+  if (quick)
+    {
+    sizes.cpp_rows /= 100;
+    sizes.python_rows /= 10; // still enough rows to lex in parallel chunks
+    sizes.json_row_bytes /= 100;
+    sizes.log_rows /= 100;
+    sizes.pipe_bytes /= 100;
+    sizes.edits /= 10;
+    sizes.keystrokes /= 100;
+    }
+
+  env_settings senv;
+  senv.tab_space = 8;
+  senv.show_all_characters = false;
+  senv.undo_memory_limit = 256ull << 20;
+
+  const syntax_highlighter shl;
+  if (!shl.extension_or_filename_has_syntax_highlighter("cpp"))
+    std::cerr << "jed_syntax.json was not found next to jed_bench, the corpora are lexed without syntax" << std::endl;
+  nlohmann::json results = nlohmann::json::array();
+
+  const std::string cpp_file = "jed_bench_corpus.cpp";
+  const std::string python_file = "jed_bench_corpus.py";
+  const std::string json_file = "jed_bench_corpus.json";
+  const std::string log_file = "jed_bench_corpus.log";
+  _write_cpp_corpus(cpp_file, sizes.cpp_rows);
+  _write_python_corpus(python_file, sizes.python_rows);
+  _write_json_corpus(json_file, sizes.json_rows, sizes.json_row_bytes);
+  _write_log_corpus(log_file, sizes.log_rows);
+
+  file_buffer cpp = _bench_file_io(results, "cpp", cpp_file, shl, "cpp");
+  _bench_editing(results, "cpp", cpp, "values", sizes.edits, senv);
+  _bench_typing(results, "cpp", cpp, sizes.keystrokes, senv);
+  _bench_replace_all(results, "cpp", cpp, L"values", L"numbers", senv);
+  _bench_regex(results, "cpp", cpp, sizes.edits);
+  _bench_keywords(results, "cpp", cpp, shl, "cpp");
+  _bench_scrolling(results, "cpp", cpp, 60);
+  _bench_lazy_lexing(results, "cpp", cpp, senv);
+  _bench_lexer_scaling(results, "cpp", cpp);
+  _bench_brackets(results, "cpp", cpp, sizes.edits);
+  _bench_open(results, "cpp", cpp_file, shl, 5);
+
+  _bench_file_io(results, "python", python_file, shl, "py");
+
+  file_buffer json = _bench_file_io(results, "json", json_file, shl, "json");
+  _bench_editing(results, "json", json, "tags", sizes.edits, senv);
+  _bench_cursor_motion(results, "json", json, sizes.edits, senv);
+  json = make_empty_buffer();
+
+  file_buffer log = _bench_file_io(results, "log", log_file, shl, "log");
+  _bench_editing(results, "log", log, "ERROR", sizes.edits, senv);
+  log = make_empty_buffer();
+  _bench_progressive_load(results, "log", log_file);
+
+  _bench_pipe_output(results, sizes.pipe_bytes);
+  _bench_path_lookup(results, sizes.edits);
+
+  std::remove(cpp_file.c_str());
+  std::remove(python_file.c_str());
+  std::remove(json_file.c_str());
+  std::remove(log_file.c_str());
+
+  nlohmann::json report;
+#ifdef JED_COMPACT_LINES
+  report["compact_lines"] = true;
+#else
+  report["compact_lines"] = false;
+#endif
+  report["quick"] = quick;
+  report["large"] = large;
+  report["threads"] = std::thread::hardware_concurrency();
+  report["results"] = results;
+  if (output.empty())
+    std::cout << report.dump(2) << std::endl;
+  else
+    {
+    std::ofstream f(output);
+    f << report.dump(2) << std::endl;
+    }
+  return 0;
+  }
@@ -2,6 +2,8 @@
 #include <SDL_syswm.h>
 #include <curses.h>
 
+#include <chrono>
+#include <cstring>
 #include <iostream>
 #include <stdlib.h>
 
@@ -15,6 +17,8 @@
 #include "jedicon.h"
 #include "utils.h"
 
+#include <json.hpp>
+
 extern "C"
   {
 #include <sdl2/pdcsdl.h>
@@ -24,7 +28,57 @@ extern "C"
 #include <windows.h>
 #endif
 
+namespace
+  {
 
+  /*
+  Fills the screen with colored source text, and times repaints of the whole screen with touchwin(stdscr) and
+  refresh(), once with the glyph atlas of the SDL2 backend and once with every glyph rendered by SDL_ttf.
+  */
+  nlohmann::json _bench_repaint(int repaints)
+    {
+    const wchar_t* source = L"for (int64_t r = 0; r < nr_of_rows; ++r) { auto it = lines.find(r); /* d\u00e9j\u00e0 vu \u03bb */ } ";
+    const int64_t source_length = (int64_t)wcslen(source);
+    for (short p = 1; p <= 6; ++p)
+      init_pair(p, p, COLOR_BLACK);
+    int64_t i = 0;
+    for (int y = 0; y < LINES; ++y)
+      {
+      for (int x = 0; x < COLS; ++x, ++i)
+        {
+        const wchar_t ch = source[i % source_length];
+        mvaddch(y, x, (chtype)ch | COLOR_PAIR((i / 7) % 6 + 1));
+        }
+      }
+    nlohmann::json results;
+    results["rows"] = LINES;
+    results["cols"] = COLS;
+    results["repaints"] = repaints;
+    for (int with_atlas = 1; with_atlas >= 0; --with_atlas)
+      {
+      pdc_glyph_atlas = with_atlas != 0;
+      touchwin(stdscr);
+      refresh(); // warm-up, fills the atlas when it is used
+      PDC_update_rects();
+      auto tic = std::chrono::steady_clock::now();
+      for (int r = 0; r < repaints; ++r)
+        {
+        touchwin(stdscr);
+        refresh();
+        PDC_update_rects(); // refresh leaves the last rows to the event loop
+        }
+      auto toc = std::chrono::steady_clock::now();
+      const double seconds = std::chrono::duration<double>(toc - tic).count();
+      nlohmann::json m;
+      m["seconds"] = seconds;
+      m["ms_per_repaint"] = repaints > 0 ? seconds * 1000.0 / repaints : 0.0;
+      results[with_atlas ? "atlas" : "no_atlas"] = m;
+      }
+    pdc_glyph_atlas = TRUE;
+    return results;
+    }
+
+  }
 
 int main(int argc, char** argv)
   {
@@ -59,6 +113,15 @@ int main(int argc, char** argv)
 
   PDC_set_title("jed");
 
+  if (argc >= 2 && strcmp(argv[1], "--bench-repaint") == 0)
+    {
+    const int repaints = argc >= 3 ? atoi(argv[2]) : 200;
+    nlohmann::json results = _bench_repaint(repaints);
+    endwin();
+    std::cout << results.dump(2) << std::endl;
+    return 0;
+    }
+
   settings s;
   s = read_settings(get_file_in_executable_path("jed_settings.json").c_str());
   update_settings(s, get_file_in_executable_path("jed_user_settings.json").c_str());
@@ -0,0 +1,158 @@
+#include "profiling.h"
+
+#ifdef JED_PROFILING
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+
+namespace
+  {
+  const size_t max_trace_events = 1 << 18; // older events are overwritten
+  const size_t rolling_frames = 256;
+
+  struct trace_event
+    {
+    const char* name;
+    int64_t start, duration; // in microseconds since the start of the profiling
+    };
+
+  struct rolling_values
+    {
+    std::vector<int64_t> values;
+    size_t next = 0;
+
+    void add(int64_t value)
+      {
+      if (values.size() < rolling_frames)
+        values.push_back(value);
+      else
+        values[next] = value;
+      next = (next + 1) % rolling_frames;
+      }
+    };
+
+  struct profile_data
+    {
+    std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+    std::vector<trace_event> events;
+    size_t next_event = 0;
+    rolling_values frame_times, latencies;
+    int64_t frame_start = -1;
+    int64_t input_time = -1; // first input that was not presented yet
+    bool hud = false;
+    };
+
+  profile_data& _data()
+    {
+    static profile_data data;
+    return data;
+    }
+
+  int64_t _now()
+    {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _data().origin).count();
+    }
+
+  void _record(const char* name, int64_t start, int64_t duration)
+    {
+    profile_data& data = _data();
+    if (data.events.size() < max_trace_events)
+      data.events.push_back({ name, start, duration });
+    else
+      data.events[data.next_event] = { name, start, duration };
+    data.next_event = (data.next_event + 1) % max_trace_events;
+    }
+
+  double _percentile_ms(std::vector<int64_t> values, double fraction)
+    {
+    if (values.empty())
+      return 0.0;
+    const size_t index = std::min<size_t>(values.size() - 1, (size_t)(fraction * values.size()));
+    std::nth_element(values.begin(), values.begin() + index, values.end());
+    return values[index] / 1000.0;
+    }
+  }
+
+profile_scope::profile_scope(const char* name) : _name(name), _start(_now())
+  {
+  }
+
+profile_scope::~profile_scope()
+  {
+  _record(_name, _start, _now() - _start);
+  }
+
+void profile_input()
+  {
+  profile_data& data = _data();
+  if (data.input_time < 0)
+    data.input_time = _now();
+  }
+
+void profile_frame_begin()
+  {
+  _data().frame_start = _now();
+  }
+
+void profile_frame_end()
+  {
+  profile_data& data = _data();
+  const int64_t now = _now();
+  if (data.frame_start >= 0)
+    {
+    _record("frame", data.frame_start, now - data.frame_start);
+    data.frame_times.add(now - data.frame_start);
+    }
+  if (data.input_time >= 0)
+    {
+    _record("input to present", data.input_time, now - data.input_time);
+    data.latencies.add(now - data.input_time);
+    }
+  data.frame_start = -1;
+  data.input_time = -1;
+  }
+
+std::string profile_statistics()
+  {
+  const profile_data& data = _data();
+  std::stringstream str;
+  str << std::fixed << std::setprecision(1);
+  str << "frame p50 " << _percentile_ms(data.frame_times.values, 0.5) << "ms p99 " << _percentile_ms(data.frame_times.values, 0.99) << "ms";
+  str << ", input to present p50 " << _percentile_ms(data.latencies.values, 0.5) << "ms p99 " << _percentile_ms(data.latencies.values, 0.99) << "ms";
+  return str.str();
+  }
+
+bool toggle_profile_hud()
+  {
+  _data().hud = !_data().hud;
+  return _data().hud;
+  }
+
+bool profile_hud_visible()
+  {
+  return _data().hud;
+  }
+
+bool write_profile_trace(const std::string& filename)
+  {
+  std::ofstream f(filename);
+  if (!f.is_open())
+    return false;
+  const profile_data& data = _data();
+  const size_t n = data.events.size();
+  const size_t first = n < max_trace_events ? 0 : data.next_event; // oldest event first
+  f << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+  for (size_t i = 0; i < n; ++i)
+    {
+    const trace_event& e = data.events[(first + i) % n];
+    f << "{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":" << e.start << ",\"dur\":" << e.duration << "}" << (i + 1 < n ? ",\n" : "\n");
+    }
+  f << "]}\n";
+  return f.good();
+  }
+
+#endif
@@ -0,0 +1,65 @@
+#pragma once
+
+/*
+Instrumentation of the main loop, enabled with the JED_PROFILING build option.
+JED_PROFILE_SCOPE(name) times the rest of the enclosing scope. JED_PROFILE_INPUT() marks that an input event was
+taken from the queue, JED_PROFILE_FRAME_BEGIN() and JED_PROFILE_FRAME_END() enclose drawing and presenting a frame.
+Without JED_PROFILING the macros expand to nothing.
+Timers are only meant for the main thread.
+*/
+
+#ifdef JED_PROFILING
+
+#include <string>
+#include <stdint.h>
+
+class profile_scope
+  {
+  public:
+    explicit profile_scope(const char* name);
+    ~profile_scope();
+
+  private:
+    const char* _name; // has to outlive the profiling data, use string literals
+    int64_t _start;
+  };
+
+void profile_input();
+
+void profile_frame_begin();
+
+void profile_frame_end();
+
+/*
+Rolling p50 and p99 of the frame time and of the latency from input to present, over the last frames.
+*/
+std::string profile_statistics();
+
+/*
+Toggles showing profile_statistics in the title bar. Returns whether it is shown now.
+*/
+bool toggle_profile_hud();
+
+bool profile_hud_visible();
+
+/*
+Writes the most recent timed scopes and frames as Chrome trace-event JSON, which can be opened in chrome://tracing
+or Perfetto.
+*/
+bool write_profile_trace(const std::string& filename);
+
+#define JED_PROFILE_CONCAT_(a, b) a##b
+#define JED_PROFILE_CONCAT(a, b) JED_PROFILE_CONCAT_(a, b)
+#define JED_PROFILE_SCOPE(name) profile_scope JED_PROFILE_CONCAT(_profile_scope_, __LINE__)(name)
+#define JED_PROFILE_INPUT() profile_input()
+#define JED_PROFILE_FRAME_BEGIN() profile_frame_begin()
+#define JED_PROFILE_FRAME_END() profile_frame_end()
+
+#else
+
+#define JED_PROFILE_SCOPE(name)
+#define JED_PROFILE_INPUT()
+#define JED_PROFILE_FRAME_BEGIN()
+#define JED_PROFILE_FRAME_END()
+
+#endif
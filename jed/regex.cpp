@@ -0,0 +1,973 @@
+#include "regex.h"
+
+#include <algorithm>
+#include <map>
+
+namespace
+  {
+  enum
+    {
+    max_instructions = 20000,
+    max_repeat = 1000,
+    max_dfa_states = 4096, // the DFA cache is flushed when it grows beyond this size
+    max_character = 0x10ffff
+    };
+
+  enum regex_opcode
+    {
+    rop_class, // consumes a character in classes[x]
+    rop_eol, // end of the row
+    rop_bol, // start of the row
+    rop_split, // continue at x, with lower priority at y
+    rop_jmp,
+    rop_save, // store the current column in capture slot x
+    rop_match
+    };
+
+  typedef std::vector<std::pair<uint32_t, uint32_t>> character_ranges;
+
+  struct regex_node
+    {
+    enum node_type
+      {
+      rn_empty,
+      rn_class,
+      rn_bol,
+      rn_eol,
+      rn_concat,
+      rn_alternate,
+      rn_repeat,
+      rn_group
+      };
+
+    node_type type = rn_empty;
+    character_ranges ranges;
+    std::vector<regex_node> children;
+    int min = 0, max = 0; // max < 0 means unbounded
+    bool greedy = true;
+    int group = -1; // capture group index, -1 for (?:...)
+    };
+  }
+
+struct regex_instruction
+  {
+  regex_opcode op;
+  uint32_t x, y;
+  };
+
+struct regex_program
+  {
+  std::vector<regex_instruction> code;
+  std::vector<character_ranges> classes;
+  std::vector<uint32_t> bounds; // characters in [bounds[i], bounds[i+1]) belong to equivalence class i + 1
+  uint32_t latin1_classes[256];
+  uint32_t nr_of_groups;
+  std::wstring prefix; // every match starts with these characters
+  };
+
+/*
+Lazily built DFA over the equivalence classes of the program. Class 0 is the end of the row.
+*/
+struct regex_dfa
+  {
+  std::vector<std::vector<uint32_t>> states; // sorted program counters
+  std::vector<uint8_t> is_match;
+  std::vector<int32_t> transitions; // states.size() * nr_of_classes entries, -1 if not computed yet
+  std::map<std::vector<uint32_t>, int32_t> ids;
+  int32_t start[2] = { -1, -1 }; // start state inside the row / at the start of the row
+  uint64_t flushes = 0;
+  };
+
+namespace
+  {
+  void _normalize(character_ranges& ranges)
+    {
+    std::sort(ranges.begin(), ranges.end());
+    character_ranges out;
+    for (const auto& r : ranges)
+      {
+      if (!out.empty() && r.first <= out.back().second + 1)
+        out.back().second = std::max(out.back().second, r.second);
+      else
+        out.push_back(r);
+      }
+    ranges.swap(out);
+    }
+
+  character_ranges _complement(character_ranges ranges)
+    {
+    _normalize(ranges);
+    character_ranges out;
+    uint32_t next = 0;
+    for (const auto& r : ranges)
+      {
+      if (r.first > next)
+        out.emplace_back(next, r.first - 1);
+      next = r.second + 1;
+      }
+    if (next <= max_character)
+      out.emplace_back(next, max_character);
+    return out;
+    }
+
+  bool _contains(const character_ranges& ranges, uint32_t ch)
+    {
+    auto it = std::upper_bound(ranges.begin(), ranges.end(), std::make_pair(ch, (uint32_t)max_character + 1));
+    return it != ranges.begin() && (it - 1)->second >= ch;
+    }
+
+  class regex_parser
+    {
+    public:
+      regex_parser(const std::wstring& pattern) : _pattern(pattern), _pos(0), _nr_of_groups(1) {}
+
+      bool parse(regex_node& root, std::string& error_message)
+        {
+        if (!_alternation(root))
+          {
+          error_message = _error;
+          return false;
+          }
+        if (_pos < _pattern.size())
+          {
+          error_message = "unmatched )";
+          return false;
+          }
+        return true;
+        }
+
+      int nr_of_groups() const
+        {
+        return _nr_of_groups;
+        }
+
+    private:
+      bool _fail(const char* message)
+        {
+        _error = message;
+        return false;
+        }
+
+      bool _at_end() const
+        {
+        return _pos >= _pattern.size();
+        }
+
+      bool _alternation(regex_node& out)
+        {
+        regex_node first;
+        if (!_concatenation(first))
+          return false;
+        if (_at_end() || _pattern[_pos] != L'|')
+          {
+          out = std::move(first);
+          return true;
+          }
+        out.type = regex_node::rn_alternate;
+        out.children.push_back(std::move(first));
+        while (!_at_end() && _pattern[_pos] == L'|')
+          {
+          ++_pos;
+          regex_node next;
+          if (!_concatenation(next))
+            return false;
+          out.children.push_back(std::move(next));
+          }
+        return true;
+        }
+
+      bool _concatenation(regex_node& out)
+        {
+        out.type = regex_node::rn_concat;
+        while (!_at_end() && _pattern[_pos] != L'|' && _pattern[_pos] != L')')
+          {
+          regex_node atom;
+          if (!_repetition(atom))
+            return false;
+          out.children.push_back(std::move(atom));
+          }
+        return true;
+        }
+
+      bool _read_number(int& value)
+        {
+        size_t start = _pos;
+        value = 0;
+        while (!_at_end() && _pattern[_pos] >= L'0' && _pattern[_pos] <= L'9' && value <= max_repeat)
+          value = value * 10 + (_pattern[_pos++] - L'0');
+        return _pos > start;
+        }
+
+      /*
+      Parses {n}, {n,} or {n,m}. Returns false and leaves _pos unchanged if the brace does not start a count.
+      */
+      bool _read_count(int& min, int& max)
+        {
+        size_t start = _pos;
+        ++_pos;
+        if (!_read_number(min))
+          {
+          _pos = start;
+          return false;
+          }
+        max = min;
+        if (!_at_end() && _pattern[_pos] == L',')
+          {
+          ++_pos;
+          if (!_read_number(max))
+            max = -1;
+          }
+        if (_at_end() || _pattern[_pos] != L'}')
+          {
+          _pos = start;
+          return false;
+          }
+        ++_pos;
+        return true;
+        }
+
+      bool _repetition(regex_node& out)
+        {
+        if (!_atom(out))
+          return false;
+        while (!_at_end())
+          {
+          int min, max;
+          wchar_t ch = _pattern[_pos];
+          if (ch == L'*')
+            {
+            min = 0;
+            max = -1;
+            ++_pos;
+            }
+          else if (ch == L'+')
+            {
+            min = 1;
+            max = -1;
+            ++_pos;
+            }
+          else if (ch == L'?')
+            {
+            min = 0;
+            max = 1;
+            ++_pos;
+            }
+          else if (ch == L'{')
+            {
+            if (!_read_count(min, max))
+              return true;
+            if (min > max_repeat || max > max_repeat || (max >= 0 && max < min))
+              return _fail("invalid repetition count");
+            }
+          else
+            return true;
+          if (out.type == regex_node::rn_bol || out.type == regex_node::rn_eol || out.type == regex_node::rn_empty)
+            return _fail("nothing to repeat");
+          regex_node rep;
+          rep.type = regex_node::rn_repeat;
+          rep.min = min;
+          rep.max = max;
+          if (!_at_end() && _pattern[_pos] == L'?')
+            {
+            rep.greedy = false;
+            ++_pos;
+            }
+          rep.children.push_back(std::move(out));
+          out = std::move(rep);
+          }
+        return true;
+        }
+
+      character_ranges _escape_class(wchar_t ch, bool& is_class)
+        {
+        is_class = true;
+        character_ranges r;
+        switch (ch)
+          {
+          case L'd': case L'D':
+            r.emplace_back(L'0', L'9');
+            break;
+          case L'w': case L'W':
+            r.emplace_back(L'0', L'9');
+            r.emplace_back(L'A', L'Z');
+            r.emplace_back(L'_', L'_');
+            r.emplace_back(L'a', L'z');
+            break;
+          case L's': case L'S':
+            r.emplace_back(L'\t', L'\r');
+            r.emplace_back(L' ', L' ');
+            break;
+          default:
+            is_class = false;
+            return r;
+          }
+        if (ch == L'D' || ch == L'W' || ch == L'S')
+          r = _complement(r);
+        return r;
+        }
+
+      wchar_t _escape_char(wchar_t ch)
+        {
+        switch (ch)
+          {
+          case L't': return L'\t';
+          case L'n': return L'\n';
+          case L'r': return L'\r';
+          case L'f': return L'\f';
+          case L'v': return L'\v';
+          default: return ch;
+          }
+        }
+
+      bool _bracket(regex_node& out)
+        {
+        ++_pos; // '['
+        bool negate = false;
+        if (!_at_end() && _pattern[_pos] == L'^')
+          {
+          negate = true;
+          ++_pos;
+          }
+        character_ranges ranges;
+        bool first = true;
+        while (true)
+          {
+          if (_at_end())
+            return _fail("missing ]");
+          wchar_t ch = _pattern[_pos];
+          if (ch == L']' && !first)
+            {
+            ++_pos;
+            break;
+            }
+          first = false;
+          ++_pos;
+          if (ch == L'\\')
+            {
+            if (_at_end())
+              return _fail("trailing \\");
+            bool is_class;
+            auto cls = _escape_class(_pattern[_pos], is_class);
+            if (is_class)
+              {
+              ++_pos;
+              ranges.insert(ranges.end(), cls.begin(), cls.end());
+              continue;
+              }
+            ch = _escape_char(_pattern[_pos++]);
+            }
+          uint32_t lo = (uint32_t)ch, hi = (uint32_t)ch;
+          if (_pos + 1 < _pattern.size() && _pattern[_pos] == L'-' && _pattern[_pos + 1] != L']')
+            {
+            ++_pos;
+            wchar_t last = _pattern[_pos++];
+            if (last == L'\\')
+              {
+              if (_at_end())
+                return _fail("trailing \\");
+              last = _escape_char(_pattern[_pos++]);
+              }
+            hi = (uint32_t)last;
+            if (hi < lo)
+              return _fail("invalid range in []");
+            }
+          ranges.emplace_back(lo, hi);
+          }
+        out.type = regex_node::rn_class;
+        out.ranges = negate ? _complement(ranges) : ranges;
+        _normalize(out.ranges);
+        return true;
+        }
+
+      bool _atom(regex_node& out)
+        {
+        wchar_t ch = _pattern[_pos];
+        switch (ch)
+          {
+          case L'(':
+          {
+          ++_pos;
+          int group = -1;
+          if (_pos + 1 < _pattern.size() && _pattern[_pos] == L'?' && _pattern[_pos + 1] == L':')
+            _pos += 2;
+          else
+            group = _nr_of_groups++;
+          regex_node body;
+          if (!_alternation(body))
+            return false;
+          if (_at_end() || _pattern[_pos] != L')')
+            return _fail("missing )");
+          ++_pos;
+          out.type = regex_node::rn_group;
+          out.group = group;
+          out.children.push_back(std::move(body));
+          return true;
+          }
+          case L'[':
+            return _bracket(out);
+          case L'*': case L'+': case L'?':
+            return _fail("nothing to repeat");
+          case L'.':
+            ++_pos;
+            out.type = regex_node::rn_class;
+            out.ranges = _complement(character_ranges(1, std::make_pair((uint32_t)L'\n', (uint32_t)L'\n')));
+            return true;
+          case L'^':
+            ++_pos;
+            out.type = regex_node::rn_bol;
+            return true;
+          case L'$':
+            ++_pos;
+            out.type = regex_node::rn_eol;
+            return true;
+          case L'\\':
+          {
+          ++_pos;
+          if (_at_end())
+            return _fail("trailing \\");
+          bool is_class;
+          auto cls = _escape_class(_pattern[_pos], is_class);
+          out.type = regex_node::rn_class;
+          if (is_class)
+            {
+            ++_pos;
+            out.ranges = cls;
+            _normalize(out.ranges);
+            }
+          else
+            {
+            uint32_t c = (uint32_t)_escape_char(_pattern[_pos++]);
+            out.ranges.emplace_back(c, c);
+            }
+          return true;
+          }
+          default:
+            ++_pos;
+            out.type = regex_node::rn_class;
+            out.ranges.emplace_back((uint32_t)ch, (uint32_t)ch);
+            return true;
+          }
+        }
+
+    private:
+      const std::wstring& _pattern;
+      size_t _pos;
+      int _nr_of_groups;
+      const char* _error = "";
+    };
+
+  class regex_compiler
+    {
+    public:
+      regex_compiler(regex_program& p) : _p(p) {}
+
+      bool emit(const regex_node& n)
+        {
+        if (_p.code.size() > max_instructions)
+          return false;
+        switch (n.type)
+          {
+          case regex_node::rn_empty:
+            return true;
+          case regex_node::rn_class:
+            _p.classes.push_back(n.ranges);
+            _add(rop_class, (uint32_t)_p.classes.size() - 1);
+            return true;
+          case regex_node::rn_bol:
+            _add(rop_bol);
+            return true;
+          case regex_node::rn_eol:
+            _add(rop_eol);
+            return true;
+          case regex_node::rn_concat:
+            for (const auto& c : n.children)
+              {
+              if (!emit(c))
+                return false;
+              }
+            return true;
+          case regex_node::rn_group:
+            if (n.group >= 0)
+              _add(rop_save, (uint32_t)n.group * 2);
+            if (!emit(n.children.front()))
+              return false;
+            if (n.group >= 0)
+              _add(rop_save, (uint32_t)n.group * 2 + 1);
+            return true;
+          case regex_node::rn_alternate:
+          {
+          std::vector<uint32_t> jumps;
+          for (size_t i = 0; i < n.children.size(); ++i)
+            {
+            const bool last = i + 1 == n.children.size();
+            uint32_t split = last ? 0 : _add(rop_split, _here() + 1);
+            if (!emit(n.children[i]))
+              return false;
+            if (!last)
+              {
+              jumps.push_back(_add(rop_jmp));
+              _p.code[split].y = _here();
+              }
+            }
+          for (auto j : jumps)
+            _p.code[j].x = _here();
+          return true;
+          }
+          case regex_node::rn_repeat:
+          {
+          const regex_node& body = n.children.front();
+          for (int i = 0; i < n.min; ++i)
+            {
+            if (!emit(body))
+              return false;
+            }
+          if (n.max < 0)
+            {
+            uint32_t split = _add(rop_split);
+            if (!emit(body))
+              return false;
+            _add(rop_jmp, split);
+            _set_split(split, split + 1, _here(), n.greedy);
+            }
+          else
+            {
+            std::vector<uint32_t> splits;
+            for (int i = n.min; i < n.max; ++i)
+              {
+              splits.push_back(_add(rop_split));
+              if (!emit(body))
+                return false;
+              }
+            for (auto s : splits)
+              _set_split(s, s + 1, _here(), n.greedy);
+            }
+          return true;
+          }
+          }
+        return true;
+        }
+
+    private:
+      uint32_t _here() const
+        {
+        return (uint32_t)_p.code.size();
+        }
+
+      uint32_t _add(regex_opcode op, uint32_t x = 0, uint32_t y = 0)
+        {
+        regex_instruction i;
+        i.op = op;
+        i.x = x;
+        i.y = y;
+        _p.code.push_back(i);
+        return (uint32_t)_p.code.size() - 1;
+        }
+
+      void _set_split(uint32_t split, uint32_t body, uint32_t exit, bool greedy)
+        {
+        _p.code[split].x = greedy ? body : exit;
+        _p.code[split].y = greedy ? exit : body;
+        }
+
+    private:
+      regex_program& _p;
+    };
+
+  std::wstring _literal_prefix(const regex_node& root)
+    {
+    std::wstring prefix;
+    const regex_node* n = &root;
+    while (n->type == regex_node::rn_group && n->children.front().type != regex_node::rn_alternate)
+      n = &n->children.front();
+    if (n->type == regex_node::rn_class)
+      {
+      if (n->ranges.size() == 1 && n->ranges[0].first == n->ranges[0].second)
+        prefix.push_back((wchar_t)n->ranges[0].first);
+      return prefix;
+      }
+    if (n->type != regex_node::rn_concat)
+      return prefix;
+    for (const auto& c : n->children)
+      {
+      if (c.type == regex_node::rn_bol && prefix.empty())
+        continue;
+      if (c.type != regex_node::rn_class || c.ranges.size() != 1 || c.ranges[0].first != c.ranges[0].second)
+        break;
+      prefix.push_back((wchar_t)c.ranges[0].first);
+      }
+    return prefix;
+    }
+
+  void _make_equivalence_classes(regex_program& p)
+    {
+    std::vector<uint32_t> bounds(1, 0);
+    for (const auto& cls : p.classes)
+      {
+      for (const auto& r : cls)
+        {
+        bounds.push_back(r.first);
+        if (r.second < max_character)
+          bounds.push_back(r.second + 1);
+        }
+      }
+    std::sort(bounds.begin(), bounds.end());
+    bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+    p.bounds.swap(bounds);
+    for (uint32_t ch = 0; ch < 256; ++ch)
+      p.latin1_classes[ch] = (uint32_t)(std::upper_bound(p.bounds.begin(), p.bounds.end(), ch) - p.bounds.begin());
+    }
+
+  inline uint32_t _equivalence_class(const regex_program& p, wchar_t ch)
+    {
+    uint32_t c = (uint32_t)ch;
+    if (c < 256)
+      return p.latin1_classes[c];
+    return (uint32_t)(std::upper_bound(p.bounds.begin(), p.bounds.end(), c) - p.bounds.begin());
+    }
+
+  inline uint32_t _nr_of_classes(const regex_program& p)
+    {
+    return (uint32_t)p.bounds.size() + 1;
+    }
+
+  /*
+  Adds the program counters that are reachable from pc without consuming a character to out.
+  */
+  void _closure(const regex_program& p, uint32_t pc, bool at_bol, std::vector<uint32_t>& out, std::vector<uint8_t>& seen)
+    {
+    std::vector<uint32_t> stack(1, pc);
+    while (!stack.empty())
+      {
+      pc = stack.back();
+      stack.pop_back();
+      if (seen[pc])
+        continue;
+      seen[pc] = 1;
+      const regex_instruction& i = p.code[pc];
+      switch (i.op)
+        {
+        case rop_jmp: stack.push_back(i.x); break;
+        case rop_split: stack.push_back(i.y); stack.push_back(i.x); break;
+        case rop_save: stack.push_back(pc + 1); break;
+        case rop_bol: if (at_bol) stack.push_back(pc + 1); break;
+        default: out.push_back(pc); break;
+        }
+      }
+    }
+
+  int32_t _add_state(const regex_program& p, regex_dfa& dfa, std::vector<uint32_t>&& pcs)
+    {
+    std::sort(pcs.begin(), pcs.end());
+    auto it = dfa.ids.find(pcs);
+    if (it != dfa.ids.end())
+      return it->second;
+    if (dfa.states.size() >= max_dfa_states)
+      {
+      dfa.states.clear();
+      dfa.is_match.clear();
+      dfa.transitions.clear();
+      dfa.ids.clear();
+      dfa.start[0] = dfa.start[1] = -1;
+      ++dfa.flushes;
+      }
+    int32_t id = (int32_t)dfa.states.size();
+    bool match = false;
+    for (auto pc : pcs)
+      match |= p.code[pc].op == rop_match;
+    dfa.ids[pcs] = id;
+    dfa.states.push_back(std::move(pcs));
+    dfa.is_match.push_back(match ? 1 : 0);
+    dfa.transitions.resize(dfa.transitions.size() + _nr_of_classes(p), -1);
+    return id;
+    }
+
+  int32_t _start_state(const regex_program& p, regex_dfa& dfa, bool at_bol)
+    {
+    int32_t& id = dfa.start[at_bol ? 1 : 0];
+    if (id < 0)
+      {
+      std::vector<uint32_t> pcs;
+      std::vector<uint8_t> seen(p.code.size(), 0);
+      _closure(p, 0, at_bol, pcs, seen);
+      int32_t s = _add_state(p, dfa, std::move(pcs));
+      dfa.start[at_bol ? 1 : 0] = s;
+      return s;
+      }
+    return id;
+    }
+
+  int32_t _next_state(const regex_program& p, regex_dfa& dfa, int32_t state, uint32_t cls)
+    {
+    const uint32_t n = _nr_of_classes(p);
+    int32_t next = dfa.transitions[(size_t)state * n + cls];
+    if (next >= 0)
+      return next;
+    std::vector<uint32_t> pcs;
+    std::vector<uint8_t> seen(p.code.size(), 0);
+    const uint32_t representative = cls ? p.bounds[cls - 1] : 0;
+    for (auto pc : dfa.states[state])
+      {
+      const regex_instruction& i = p.code[pc];
+      if ((i.op == rop_class && cls != 0 && _contains(p.classes[i.x], representative)) || (i.op == rop_eol && cls == 0))
+        _closure(p, pc + 1, false, pcs, seen);
+      }
+    if (cls != 0) // a match can start at the next column
+      _closure(p, 0, false, pcs, seen);
+    const uint64_t flushes = dfa.flushes;
+    next = _add_state(p, dfa, std::move(pcs));
+    if (flushes == dfa.flushes) // state is gone if the cache was flushed
+      dfa.transitions[(size_t)state * n + cls] = next;
+    return next;
+    }
+
+  /*
+  Returns true if there is a match in ln starting at or after from that does not cross end.
+  */
+  bool _dfa_search(const regex_program& p, regex_dfa& dfa, const line& ln, int64_t from, int64_t end)
+    {
+    int32_t state = _start_state(p, dfa, from == 0);
+    if (dfa.is_match[state])
+      return true;
+    auto it = ln.begin() + from;
+    for (int64_t col = from; col < end; ++col, ++it)
+      {
+      state = _next_state(p, dfa, state, _equivalence_class(p, *it));
+      if (dfa.is_match[state])
+        return true;
+      }
+    state = _next_state(p, dfa, state, 0);
+    return dfa.is_match[state] != 0;
+    }
+
+  struct pike_thread
+    {
+    uint32_t pc;
+    std::vector<int64_t> caps;
+    };
+
+  struct pike_list
+    {
+    std::vector<pike_thread> threads;
+    std::vector<uint32_t> mark;
+    uint32_t generation = 1;
+
+    void clear()
+      {
+      threads.clear();
+      ++generation;
+      }
+    };
+
+  void _add_thread(const regex_program& p, pike_list& l, uint32_t pc, std::vector<int64_t> caps, int64_t col, int64_t end)
+    {
+    std::vector<std::pair<uint32_t, std::vector<int64_t>>> stack;
+    stack.emplace_back(pc, std::move(caps));
+    while (!stack.empty())
+      {
+      pc = stack.back().first;
+      caps = std::move(stack.back().second);
+      stack.pop_back();
+      if (l.mark[pc] == l.generation)
+        continue;
+      l.mark[pc] = l.generation;
+      const regex_instruction& i = p.code[pc];
+      switch (i.op)
+        {
+        case rop_jmp:
+          stack.emplace_back(i.x, std::move(caps));
+          break;
+        case rop_split:
+          stack.emplace_back(i.y, caps);
+          stack.emplace_back(i.x, std::move(caps));
+          break;
+        case rop_save:
+          caps[i.x] = col;
+          stack.emplace_back(pc + 1, std::move(caps));
+          break;
+        case rop_bol:
+          if (col == 0)
+            stack.emplace_back(pc + 1, std::move(caps));
+          break;
+        case rop_eol:
+          if (col == end)
+            stack.emplace_back(pc + 1, std::move(caps));
+          break;
+        default:
+          l.threads.push_back(pike_thread{ pc, std::move(caps) });
+          break;
+        }
+      }
+    }
+
+  /*
+  NFA simulation that finds the leftmost match in ln starting at or after from, with the groups
+  following the priorities of alternation and of greedy and lazy quantifiers.
+  */
+  bool _pike_search(const regex_program& p, regex_match& m, const line& ln, int64_t from, int64_t end, bool allow_empty)
+    {
+    pike_list current, next;
+    current.mark.assign(p.code.size(), 0);
+    next.mark.assign(p.code.size(), 0);
+    const std::vector<int64_t> no_caps(p.nr_of_groups * 2, -1);
+    std::vector<int64_t> best;
+    auto it = ln.begin() + from;
+    for (int64_t col = from; col <= end; ++col)
+      {
+      if (best.empty())
+        _add_thread(p, current, 0, no_caps, col, end);
+      if (current.threads.empty())
+        break;
+      const uint32_t ch = col < end ? (uint32_t)*it : 0;
+      for (auto& t : current.threads)
+        {
+        const regex_instruction& i = p.code[t.pc];
+        if (i.op == rop_match)
+          {
+          if (allow_empty || t.caps[0] < col)
+            {
+            best = t.caps;
+            break; // threads with lower priority are cut off
+            }
+          }
+        else if (i.op == rop_class && col < end && _contains(p.classes[i.x], ch))
+          _add_thread(p, next, t.pc + 1, t.caps, col + 1, end);
+        }
+      std::swap(current, next);
+      next.clear();
+      if (col < end)
+        ++it;
+      }
+    if (best.empty())
+      return false;
+    m.groups.clear();
+    for (uint32_t g = 0; g < p.nr_of_groups; ++g)
+      {
+      if (best[g * 2] >= 0 && best[g * 2 + 1] >= 0)
+        m.groups.emplace_back(best[g * 2], best[g * 2 + 1]);
+      else
+        m.groups.emplace_back(-1, -1);
+      }
+    return true;
+    }
+
+  int64_t _find_prefix(const line& ln, int64_t from, int64_t end, const std::wstring& prefix)
+    {
+    const int64_t m = (int64_t)prefix.size();
+    const wchar_t first = prefix.front();
+    auto it = ln.begin() + from;
+    for (int64_t col = from; col + m <= end; ++col, ++it)
+      {
+      if (*it == first && std::equal(prefix.begin() + 1, prefix.end(), it + 1))
+        return col;
+      }
+    return -1;
+    }
+  }
+
+regex::regex()
+  {
+  }
+
+bool regex::empty() const
+  {
+  return !_program;
+  }
+
+uint32_t regex::number_of_groups() const
+  {
+  return _program ? _program->nr_of_groups : 0;
+  }
+
+regex regex::clone() const
+  {
+  regex out;
+  out._program = _program;
+  if (_program)
+    out._dfa = std::make_shared<regex_dfa>();
+  return out;
+  }
+
+bool regex::find(regex_match& m, const line& ln, int64_t from, bool allow_empty) const
+  {
+  if (!_program)
+    return false;
+  int64_t end = (int64_t)ln.size();
+  if (end > 0 && ln[(uint32_t)(end - 1)] == L'\n')
+    --end;
+  if (from < 0)
+    from = 0;
+  if (from > end)
+    return false;
+  if (!_program->prefix.empty())
+    {
+    from = _find_prefix(ln, from, end, _program->prefix);
+    if (from < 0)
+      return false;
+    }
+  if (!_dfa_search(*_program, *_dfa, ln, from, end))
+    return false;
+  return _pike_search(*_program, m, ln, from, end, allow_empty);
+  }
+
+regex compile_regex(bool& success, std::string& error_message, const std::wstring& pattern)
+  {
+  regex out;
+  success = false;
+  regex_node root;
+  regex_parser parser(pattern);
+  if (!parser.parse(root, error_message))
+    return out;
+  auto p = std::make_shared<regex_program>();
+  p->nr_of_groups = (uint32_t)parser.nr_of_groups();
+  regex_compiler compiler(*p);
+  regex_instruction save;
+  save.op = rop_save;
+  save.x = 0;
+  save.y = 0;
+  p->code.push_back(save);
+  if (!compiler.emit(root))
+    {
+    error_message = "expression too large";
+    return out;
+    }
+  save.x = 1;
+  p->code.push_back(save);
+  regex_instruction match;
+  match.op = rop_match;
+  match.x = match.y = 0;
+  p->code.push_back(match);
+  p->prefix = _literal_prefix(root);
+  _make_equivalence_classes(*p);
+  out._program = p;
+  out._dfa = std::make_shared<regex_dfa>();
+  success = true;
+  return out;
+  }
+
+std::wstring expand_replacement(const std::wstring& replacement, const regex_match& m, const line& ln)
+  {
+  std::wstring out;
+  for (size_t i = 0; i < replacement.size(); ++i)
+    {
+    wchar_t ch = replacement[i];
+    if (ch != L'\\' || i + 1 == replacement.size())
+      {
+      out.push_back(ch);
+      continue;
+      }
+    wchar_t next = replacement[++i];
+    if (next >= L'0' && next <= L'9')
+      {
+      size_t g = (size_t)(next - L'0');
+      if (g < m.groups.size() && m.groups[g].first >= 0)
+        out.insert(out.end(), ln.begin() + m.groups[g].first, ln.begin() + m.groups[g].second);
+      }
+    else if (next == L't')
+      out.push_back(L'\t');
+    else if (next == L'n')
+      out.push_back(L'\n');
+    else
+      out.push_back(next);
+    }
+  return out;
+  }
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "buffer.h"
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+struct regex_program;
+struct regex_dfa;
+
+/*
+groups[i] are the columns [begin, end) of capture group i in the searched row, or (-1, -1) if the group
+did not take part in the match. Group 0 is the complete match.
+*/
+struct regex_match
+  {
+  std::vector<std::pair<int64_t, int64_t>> groups;
+  };
+
+/*
+Regular expression for searching the rows of a text. Supported are literals, '.', character classes like
+[a-z] and [^0-9], the escapes \d \w \s \D \W \S \t, groups (...) and (?:...), alternation |, the
+quantifiers * + ? {n} {n,} {n,m} and their lazy variants, and the anchors ^ and $.
+A match never spans multiple rows.
+
+A search first runs a lazily built DFA over the row, which only tells whether the row contains a match.
+Only rows that do are searched again with an NFA simulation that finds the leftmost match and its groups.
+The DFA is cached in the regex and shared between copies, so use clone() to search in another thread.
+*/
+class regex
+  {
+  public:
+    regex();
+
+    bool empty() const;
+
+    uint32_t number_of_groups() const; // including group 0
+
+    /*
+    Looks for the leftmost match in ln that starts at or after column from.
+    */
+    bool find(regex_match& m, const line& ln, int64_t from, bool allow_empty) const;
+
+    regex clone() const;
+
+  private:
+    friend regex compile_regex(bool& success, std::string& error_message, const std::wstring& pattern);
+
+    std::shared_ptr<const regex_program> _program;
+    std::shared_ptr<regex_dfa> _dfa;
+  };
+
+regex compile_regex(bool& success, std::string& error_message, const std::wstring& pattern);
+
+/*
+Replaces \0 to \9 in replacement by the corresponding group of m in ln. \\, \t and \n give a backslash,
+a tab and a newline.
+*/
+std::wstring expand_replacement(const std::wstring& replacement, const regex_match& m, const line& ln);
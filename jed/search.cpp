@@ -0,0 +1,414 @@
+#include "search.h"
+
+#include <algorithm>
+#include <cwchar>
+#include <thread>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define JED_SSE2
+#endif
+
+namespace
+  {
+  enum
+    {
+    bmh_minimum_length = 8 // shorter patterns are found with the first/last character filter
+    };
+
+#ifdef JED_SSE2
+#if WCHAR_MAX > 0xffff
+  inline __m128i _set1(wchar_t ch)
+    {
+    return _mm_set1_epi32((int)ch);
+    }
+
+  inline __m128i _cmpeq(__m128i a, __m128i b)
+    {
+    return _mm_cmpeq_epi32(a, b);
+    }
+#else
+  inline __m128i _set1(wchar_t ch)
+    {
+    return _mm_set1_epi16((short)ch);
+    }
+
+  inline __m128i _cmpeq(__m128i a, __m128i b)
+    {
+    return _mm_cmpeq_epi16(a, b);
+    }
+#endif
+#endif
+
+  /*
+  Returns the first p in [first, last - tail_offset) with p[0] == head and p[tail_offset] == tail,
+  or last if there is none.
+  */
+  const wchar_t* _find_candidate(const wchar_t* first, const wchar_t* last, wchar_t head, wchar_t tail, ptrdiff_t tail_offset)
+    {
+    last -= tail_offset;
+#ifdef JED_SSE2
+    const ptrdiff_t lanes = 16 / sizeof(wchar_t);
+    const __m128i h = _set1(head);
+    const __m128i t = _set1(tail);
+    while (last - first >= lanes)
+      {
+      __m128i a = _mm_loadu_si128((const __m128i*)first);
+      __m128i b = _mm_loadu_si128((const __m128i*)(first + tail_offset));
+      int mask = _mm_movemask_epi8(_mm_and_si128(_cmpeq(a, h), _cmpeq(b, t)));
+      if (mask)
+        {
+        int offset = 0;
+        while ((mask & 1) == 0)
+          {
+          mask >>= 1;
+          ++offset;
+          }
+        return first + offset / sizeof(wchar_t);
+        }
+      first += lanes;
+      }
+#endif
+    for (; first < last; ++first)
+      {
+      if (*first == head && first[tail_offset] == tail)
+        return first;
+      }
+    return last + tail_offset;
+    }
+
+  /*
+  Returns the first occurrence of parts[0] in [first, last), or nullptr.
+  */
+  const wchar_t* _find_in_chars(const wchar_t* first, const wchar_t* last, const search_pattern& pattern)
+    {
+    const std::wstring& needle = pattern.parts.front();
+    const ptrdiff_t m = (ptrdiff_t)needle.size();
+    if (last - first < m)
+      return nullptr;
+    if (m < bmh_minimum_length)
+      {
+      while (last - first >= m)
+        {
+        first = _find_candidate(first, last, needle.front(), needle.back(), m - 1);
+        if (last - first < m)
+          return nullptr;
+        if (m <= 2 || std::equal(needle.begin() + 1, needle.end() - 1, first + 1))
+          return first;
+        ++first;
+        }
+      return nullptr;
+      }
+    const wchar_t back = needle.back();
+    const wchar_t* p = first;
+    while (last - p >= m)
+      {
+      wchar_t ch = p[m - 1];
+      if (ch == back && std::equal(needle.begin(), needle.end() - 1, p))
+        return p;
+      p += pattern.skip[(uint32_t)ch & 0xff];
+      }
+    return nullptr;
+    }
+
+  bool _equal_at(const line& ln, uint32_t col, const std::wstring& s)
+    {
+    if ((uint64_t)col + s.size() > ln.size())
+      return false;
+    return std::equal(s.begin(), s.end(), ln.begin() + col);
+    }
+
+  /*
+  Copies the characters of ln starting at col in a reusable buffer, so that the search can run over
+  contiguous memory instead of indexing the line character per character.
+  */
+  const std::vector<wchar_t>& _flatten(const line& ln, uint32_t col)
+    {
+    thread_local std::vector<wchar_t> buffer;
+    buffer.resize(ln.size() - col);
+    std::copy(ln.begin() + col, ln.end(), buffer.begin());
+    return buffer;
+    }
+
+  /*
+  The _find functions return the first match at or after pos that starts before row end_row.
+  */
+  std::optional<search_match> _find_single_line(const text& content, const search_pattern& pattern, position pos, int64_t end_row)
+    {
+    const uint32_t m = (uint32_t)pattern.parts.front().size();
+    for (int64_t row = pos.row; row < end_row; ++row)
+      {
+      const line& ln = content[(uint32_t)row];
+      uint32_t col = row == pos.row ? (uint32_t)pos.col : 0;
+      if (ln.size() < col + m)
+        continue;
+      const std::vector<wchar_t>& chars = _flatten(ln, col);
+      const wchar_t* found = _find_in_chars(chars.data(), chars.data() + chars.size(), pattern);
+      if (found)
+        {
+        search_match match;
+        match.first = position(row, col + (found - chars.data()));
+        match.last = position(row, match.first.col + m - 1);
+        return match;
+        }
+      }
+    return std::nullopt;
+    }
+
+  std::optional<search_match> _find_multi_line(const text& content, const search_pattern& pattern, position pos, int64_t end_row)
+    {
+    const auto& parts = pattern.parts;
+    const int64_t nr_of_rows = (int64_t)content.size();
+    const int64_t extra_rows = (int64_t)parts.size() - 1;
+    const bool ends_with_newline = parts.back().empty();
+    const int64_t rows_needed = ends_with_newline ? extra_rows : extra_rows + 1;
+    for (int64_t row = pos.row; row < end_row && row + rows_needed <= nr_of_rows; ++row)
+      {
+      const line& ln = content[(uint32_t)row];
+      const int64_t head_size = (int64_t)parts.front().size() + 1;
+      if ((int64_t)ln.size() < head_size || ln.back() != L'\n')
+        continue;
+      const uint32_t col = ln.size() - (uint32_t)head_size;
+      if (row == pos.row && col < pos.col)
+        continue;
+      if (!_equal_at(ln, col, parts.front()))
+        continue;
+      bool found = true;
+      for (int64_t i = 1; found && i < extra_rows; ++i)
+        {
+        const line& mid = content[(uint32_t)(row + i)];
+        found = mid.size() == parts[i].size() + 1 && mid.back() == L'\n' && _equal_at(mid, 0, parts[i]);
+        }
+      if (found && !ends_with_newline)
+        found = _equal_at(content[(uint32_t)(row + extra_rows)], 0, parts.back());
+      if (!found)
+        continue;
+      search_match match;
+      match.first = position(row, col);
+      if (ends_with_newline)
+        match.last = position(row + extra_rows - 1, (int64_t)content[(uint32_t)(row + extra_rows - 1)].size() - 1);
+      else
+        match.last = position(row + extra_rows, (int64_t)parts.back().size() - 1);
+      return match;
+      }
+    return std::nullopt;
+    }
+
+  std::optional<search_match> _find_regex(const text& content, const search_pattern& pattern, position pos, bool allow_empty, int64_t end_row)
+    {
+    regex_match m;
+    for (int64_t row = pos.row; row < end_row; ++row)
+      {
+      int64_t col = row == pos.row ? pos.col : 0;
+      if (pattern.re.find(m, content[(uint32_t)row], col, allow_empty))
+        {
+        search_match match;
+        match.first = position(row, m.groups[0].first);
+        match.last = position(row, m.groups[0].second - 1);
+        match.groups = std::move(m);
+        return match;
+        }
+      }
+    return std::nullopt;
+    }
+
+  std::optional<search_match> _find_next(const text& content, const search_pattern& pattern, position pos, bool allow_empty, int64_t end_row)
+    {
+    if (!pattern.re.empty())
+      return _find_regex(content, pattern, pos, allow_empty, end_row);
+    if (pattern.parts.size() == 1)
+      return _find_single_line(content, pattern, pos, end_row);
+    return _find_multi_line(content, pattern, pos, end_row);
+    }
+
+  position _after(const search_match& match)
+    {
+    position next(match.last.row, match.last.col + 1);
+    if (match.last < match.first)
+      ++next.col; // the next match starts at least one column further
+    return next;
+    }
+
+  /*
+  All non-overlapping matches that start in the rows [begin_row, end_row), as if the search started at (begin_row, 0).
+  */
+  std::vector<search_match> _find_all_in_rows(const text& content, const search_pattern& pattern, int64_t begin_row, int64_t end_row)
+    {
+    std::vector<search_match> out;
+    auto match = _find_next(content, pattern, position(begin_row, 0), true, end_row);
+    while (match)
+      {
+      out.push_back(*match);
+      match = _find_next(content, pattern, _after(*match), true, end_row);
+      }
+    return out;
+    }
+  }
+
+search_pattern make_search_pattern(text txt)
+  {
+  std::wstring needle;
+  position last = get_last_position(txt);
+  for (int64_t row = 0; row <= last.row && row < (int64_t)txt.size(); ++row)
+    {
+    const line& ln = txt[(uint32_t)row];
+    uint32_t size = row < last.row ? ln.size() : (uint32_t)last.col;
+    needle.insert(needle.end(), ln.begin(), ln.begin() + size);
+    }
+  if (needle.empty()) // txt is a single '\n'
+    {
+    for (const auto& ln : txt)
+      needle.insert(needle.end(), ln.begin(), ln.end());
+    }
+
+  search_pattern pattern;
+  size_t start = 0;
+  while (true)
+    {
+    size_t end = needle.find(L'\n', start);
+    if (end == std::wstring::npos)
+      {
+      pattern.parts.push_back(needle.substr(start));
+      break;
+      }
+    pattern.parts.push_back(needle.substr(start, end - start));
+    start = end + 1;
+    }
+
+  const std::wstring& first = pattern.parts.front();
+  const uint32_t m = (uint32_t)first.size();
+  for (auto& s : pattern.skip)
+    s = std::max<uint32_t>(m, 1);
+  for (uint32_t i = 0; i + 1 < m; ++i)
+    pattern.skip[(uint32_t)first[i] & 0xff] = m - 1 - i;
+  return pattern;
+  }
+
+search_pattern make_search_pattern(const std::wstring& wtxt)
+  {
+  return make_search_pattern(to_text(wtxt));
+  }
+
+search_pattern make_regex_search_pattern(bool& success, std::string& error_message, const std::wstring& pattern)
+  {
+  thread_local std::wstring last_pattern;
+  thread_local search_pattern last;
+  success = true;
+  if (pattern.empty())
+    return make_search_pattern(pattern);
+  if (last.re.empty() || pattern != last_pattern)
+    {
+    regex re = compile_regex(success, error_message, pattern);
+    if (!success)
+      return make_search_pattern(std::wstring());
+    last = make_search_pattern(std::wstring());
+    last.re = re;
+    last_pattern = pattern;
+    }
+  return last;
+  }
+
+bool empty(const search_pattern& pattern)
+  {
+  return pattern.re.empty() && pattern.parts.size() == 1 && pattern.parts.front().empty();
+  }
+
+std::optional<search_match> find_next_match(const text& content, const search_pattern& pattern, position pos, bool allow_empty)
+  {
+  if (empty(pattern) || content.empty())
+    return std::nullopt;
+  if (pos.row < 0 || pos.col < 0)
+    pos = position(0, 0);
+  return _find_next(content, pattern, pos, allow_empty, (int64_t)content.size());
+  }
+
+std::vector<search_match> find_all_matches(const text& content, const search_pattern& pattern, position from, position to)
+  {
+  std::vector<search_match> out;
+  auto match = find_next_match(content, pattern, from, true);
+  while (match)
+    {
+    const bool empty_match = match->last < match->first;
+    if (to < (empty_match ? match->first : match->last))
+      break;
+    out.push_back(*match);
+    match = find_next_match(content, pattern, _after(*match), true);
+    }
+  return out;
+  }
+
+std::vector<search_match> find_all_matches(const text& content, const search_pattern& pattern)
+  {
+  const int64_t minimum_rows_per_chunk = 4096;
+  const int64_t nr_of_rows = (int64_t)content.size();
+  if (empty(pattern) || nr_of_rows == 0)
+    return std::vector<search_match>();
+  int64_t nr_of_chunks = std::thread::hardware_concurrency();
+  if (nr_of_chunks == 0)
+    nr_of_chunks = 1;
+  if (nr_of_rows / minimum_rows_per_chunk < nr_of_chunks)
+    nr_of_chunks = nr_of_rows / minimum_rows_per_chunk;
+  search_pattern local = pattern;
+  local.re = pattern.re.clone(); // the lazy DFA of a regex cannot be shared between threads
+  if (nr_of_chunks < 2)
+    return _find_all_in_rows(content, local, 0, nr_of_rows);
+
+  std::vector<std::vector<search_match>> chunks(nr_of_chunks);
+  std::vector<std::thread> threads;
+  for (int64_t i = 1; i < nr_of_chunks; ++i)
+    {
+    threads.emplace_back([&, i]()
+      {
+      search_pattern chunk_pattern = local;
+      chunk_pattern.re = local.re.clone();
+      chunks[i] = _find_all_in_rows(content, chunk_pattern, (nr_of_rows * i) / nr_of_chunks, (nr_of_rows * (i + 1)) / nr_of_chunks);
+      });
+    }
+  chunks[0] = _find_all_in_rows(content, local, 0, nr_of_rows / nr_of_chunks);
+  for (auto& t : threads)
+    t.join();
+
+  std::vector<search_match> out = std::move(chunks[0]);
+  for (int64_t i = 1; i < nr_of_chunks; ++i)
+    {
+    const int64_t end_row = (nr_of_rows * (i + 1)) / nr_of_chunks;
+    const auto& chunk = chunks[i];
+    size_t j = 0;
+    /*
+    A match of a multi-line pattern can run into the next chunk, which has then searched rows that the
+    sequential search would have skipped. Redo the search after the overlap until it meets a match
+    that the chunk found as well, from there on both agree.
+    */
+    while (j < chunk.size() && !out.empty() && chunk[j].first <= out.back().last)
+      {
+      auto match = _find_next(content, local, _after(out.back()), true, end_row);
+      while (j < chunk.size() && chunk[j].first < (match ? match->first : position(end_row, 0)))
+        ++j;
+      if (!match || (j < chunk.size() && chunk[j].first == match->first))
+        break;
+      out.push_back(*match);
+      }
+    out.insert(out.end(), chunk.begin() + j, chunk.end());
+    }
+  return out;
+  }
+
+int64_t find_match(const std::vector<search_match>& matches, position first, position last)
+  {
+  auto it = std::lower_bound(matches.begin(), matches.end(), first, [](const search_match& m, const position& p) { return m.first < p; });
+  if (it != matches.end() && it->first == first && it->last == last)
+    return (int64_t)(it - matches.begin());
+  return -1;
+  }
+
+int64_t next_match(const std::vector<search_match>& matches, position pos)
+  {
+  auto it = std::lower_bound(matches.begin(), matches.end(), pos, [](const search_match& m, const position& p) { return m.first < p; });
+  return it == matches.end() ? -1 : (int64_t)(it - matches.begin());
+  }
+
+int64_t previous_match(const std::vector<search_match>& matches, position pos)
+  {
+  auto it = std::lower_bound(matches.begin(), matches.end(), pos, [](const search_match& m, const position& p) { return m.first < p; });
+  return (int64_t)(it - matches.begin()) - 1;
+  }
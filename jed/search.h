@@ -0,0 +1,73 @@
+#pragma once
+
+#include "buffer.h"
+#include "regex.h"
+
+#include <optional>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/*
+Search pattern, compiled once and matched against the rows of a text.
+A plain text pattern containing '\n' is split in parts: the first part has to end a row, the parts
+in between have to match complete rows, and the last part has to start a row.
+A regular expression pattern is matched inside single rows.
+*/
+struct search_pattern
+  {
+  std::vector<std::wstring> parts; // the pattern split at '\n'
+  uint32_t skip[256]; // Boyer-Moore-Horspool shifts for parts[0], indexed by the low byte of a character
+  regex re; // not empty for a regular expression search, parts is not used then
+  };
+
+struct search_match
+  {
+  position first, last; // last is the position of the last character of the match, or just before first if the match is empty
+  regex_match groups; // capture groups of a regular expression match
+  };
+
+/*
+The characters of txt up to get_last_position(txt) form the pattern, so a trailing '\n' on the
+last row is not part of it. This matches the way find_text always treated its argument.
+*/
+search_pattern make_search_pattern(text txt);
+
+search_pattern make_search_pattern(const std::wstring& wtxt);
+
+/*
+Compiles pattern as a regular expression. The last compiled pattern is cached, so that repeated searches
+reuse its DFA.
+*/
+search_pattern make_regex_search_pattern(bool& success, std::string& error_message, const std::wstring& pattern);
+
+bool empty(const search_pattern& pattern);
+
+/*
+Returns the first match that starts at or after pos, or std::nullopt if there is none.
+Empty matches of a regular expression are only returned if allow_empty is true.
+*/
+std::optional<search_match> find_next_match(const text& content, const search_pattern& pattern, position pos, bool allow_empty = false);
+
+/*
+Returns all non-overlapping matches that start at or after from and end at or before to, in order.
+Empty matches of a regular expression are included.
+*/
+std::vector<search_match> find_all_matches(const text& content, const search_pattern& pattern, position from, position to);
+
+/*
+Returns all non-overlapping matches in content, the same as find_all_matches from the first to the
+last position, sorted by position. The rows are split in ranges that are searched in parallel.
+Only copies of pattern are used, so pattern can be used by another thread in the meantime.
+*/
+std::vector<search_match> find_all_matches(const text& content, const search_pattern& pattern);
+
+/*
+Navigation in a sorted list of matches as returned by find_all_matches. The functions return an index
+in matches, or -1 if there is no such match.
+*/
+int64_t find_match(const std::vector<search_match>& matches, position first, position last); // the match from first to last
+
+int64_t next_match(const std::vector<search_match>& matches, position pos); // the first match starting at or after pos
+
+int64_t previous_match(const std::vector<search_match>& matches, position pos); // the last match starting before pos
@@ -11,6 +11,7 @@ settings::settings()
   use_spaces_for_tab = true;
   show_line_numbers = false;
   wrap = false;
+  regex_search = false;
   w = 80;
   h = 25;
   x = 100;
@@ -19,6 +20,9 @@ settings::settings()
   command_text = "New Open Save Exit";
   font_size = 17;
   mouse_scroll_steps = 3;
+  undo_memory_limit = 256;
+  piped_scrollback_rows = 100000;
+  open_files_in_new_window = false;
   startup_folder = "";
 
   color_editor_text = 0xffc0c0c0;
@@ -66,6 +70,9 @@ void update_settings_if_different(settings& s, const settings& new_settings, con
   if (new_settings.wrap != old_settings.wrap)
     s.wrap = new_settings.wrap;
 
+  if (new_settings.regex_search != old_settings.regex_search)
+    s.regex_search = new_settings.regex_search;
+
   if (new_settings.x != old_settings.x)
     s.x = new_settings.x;
 
@@ -84,6 +91,15 @@ void update_settings_if_different(settings& s, const settings& new_settings, con
   if (new_settings.mouse_scroll_steps != old_settings.mouse_scroll_steps)
     s.mouse_scroll_steps = new_settings.mouse_scroll_steps;
 
+  if (new_settings.undo_memory_limit != old_settings.undo_memory_limit)
+    s.undo_memory_limit = new_settings.undo_memory_limit;
+
+  if (new_settings.piped_scrollback_rows != old_settings.piped_scrollback_rows)
+    s.piped_scrollback_rows = new_settings.piped_scrollback_rows;
+
+  if (new_settings.open_files_in_new_window != old_settings.open_files_in_new_window)
+    s.open_files_in_new_window = new_settings.open_files_in_new_window;
+
   if (new_settings.startup_folder != old_settings.startup_folder)
     s.startup_folder = new_settings.startup_folder;
 
@@ -156,11 +172,15 @@ void update_settings(settings& s, const char* filename)
   f["y"] >> s.y;
   f["font_size"] >> s.font_size;
   f["mouse_scroll_steps"] >> s.mouse_scroll_steps;
+  f["undo_memory_limit"] >> s.undo_memory_limit;
+  f["piped_scrollback_rows"] >> s.piped_scrollback_rows;
+  f["open_files_in_new_window"] >> s.open_files_in_new_window;
   f["startup_folder"] >> s.startup_folder;
   f["last_find"] >> s.last_find;
   f["last_replace"] >> s.last_replace;
   f["show_line_numbers"] >> s.show_line_numbers;
   f["wrap"] >> s.wrap;
+  f["regex_search"] >> s.regex_search;
 
   f["color_editor_text"] >> s.color_editor_text;
   f["color_editor_background"] >> s.color_editor_background;
@@ -203,11 +223,15 @@ void write_settings(const settings& s, const char* filename)
   f << "y" << s.y;
   f << "font_size" << s.font_size;
   f << "mouse_scroll_steps" << s.mouse_scroll_steps;
+  f << "undo_memory_limit" << s.undo_memory_limit;
+  f << "piped_scrollback_rows" << s.piped_scrollback_rows;
+  f << "open_files_in_new_window" << s.open_files_in_new_window;
   f << "startup_folder" << s.startup_folder;
   f << "last_find" << s.last_find;
   f << "last_replace" << s.last_replace;
   f << "show_line_numbers" << s.show_line_numbers;
   f << "wrap" << s.wrap;
+  f << "regex_search" << s.regex_search;
 
   f << "color_editor_text" << s.color_editor_text;
   f << "color_editor_background" << s.color_editor_background;
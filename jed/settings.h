@@ -11,11 +11,15 @@ struct settings
   bool show_all_characters;
   bool show_line_numbers;
   bool wrap;
+  bool regex_search;
+  bool open_files_in_new_window; // start a new jed process per opened file instead of using the workspace
   int w, h, x, y;
   int command_buffer_rows;
   std::string command_text;
   int font_size;
   int mouse_scroll_steps;
+  int undo_memory_limit; // in MB
+  int piped_scrollback_rows; // piped windows keep at most this many rows of output
   std::string startup_folder;
   std::string last_find, last_replace;
 
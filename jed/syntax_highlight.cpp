@@ -1,6 +1,7 @@
 #include "syntax_highlight.h"
 #include "utils.h"
 
+#include <algorithm>
 #include <cassert>
 #include <fstream>
 #include <json.hpp>
@@ -332,6 +333,59 @@ namespace
     }
   }
 
+keyword_trie make_keyword_trie(const std::vector<std::wstring>& keywords_1, const std::vector<std::wstring>& keywords_2)
+  {
+  std::vector<std::map<wchar_t, uint32_t>> children(1);
+  std::vector<uint8_t> keyword_class(1, 0);
+  auto add = [&](const std::wstring& keyword, uint8_t cls)
+    {
+    if (keyword.empty())
+      return;
+    uint32_t current = 0;
+    for (wchar_t ch : keyword)
+      {
+      auto it = children[current].find(ch);
+      if (it == children[current].end())
+        {
+        uint32_t next = (uint32_t)children.size();
+        children[current][ch] = next;
+        children.emplace_back();
+        keyword_class.push_back(0);
+        current = next;
+        }
+      else
+        current = it->second;
+      }
+    keyword_class[current] = cls;
+    };
+  for (const auto& keyword : keywords_2)
+    add(keyword, 2);
+  for (const auto& keyword : keywords_1) // keywords_1 wins if a word is in both lists
+    add(keyword, 1);
+
+  keyword_trie trie;
+  std::fill(std::begin(trie.root_ascii), std::end(trie.root_ascii), 0);
+  if (children.size() == 1)
+    return trie;
+  trie.nodes.reserve(children.size());
+  for (uint32_t i = 0; i < (uint32_t)children.size(); ++i)
+    {
+    keyword_trie::node n;
+    n.first_edge = (uint32_t)trie.edges.size();
+    n.nr_of_edges = (uint32_t)children[i].size();
+    n.keyword_class = keyword_class[i];
+    for (const auto& child : children[i])
+      trie.edges.push_back(keyword_trie::edge{ child.first, child.second });
+    trie.nodes.push_back(n);
+    }
+  for (const auto& child : children[0])
+    {
+    if ((uint32_t)child.first < 128)
+      trie.root_ascii[(uint32_t)child.first] = child.second;
+    }
+  return trie;
+  }
+
 syntax_highlighter::syntax_highlighter()
   {
   extension_to_data = build_comment_data_hardcoded();
@@ -341,6 +395,7 @@ syntax_highlighter::syntax_highlighter()
     {
     std::sort(kd.second.keywords_1.begin(), kd.second.keywords_1.end());
     std::sort(kd.second.keywords_2.begin(), kd.second.keywords_2.end());
+    kd.second.trie = make_keyword_trie(kd.second.keywords_1, kd.second.keywords_2);
     }
   }
 
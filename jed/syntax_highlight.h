@@ -3,6 +3,7 @@
 #include <string>
 #include <map>
 #include <vector>
+#include <stdint.h>
 
 struct comment_data
   {
@@ -13,11 +14,82 @@ struct comment_data
   bool uses_quotes_for_chars;
   };
 
+/*
+Keywords compiled in a trie, so that the word at an iterator can be classified without copying it.
+Node 0 is the root. The children of a node are edges[first_edge, first_edge + nr_of_edges), sorted by character.
+*/
+struct keyword_trie
+  {
+  struct node
+    {
+    uint32_t first_edge, nr_of_edges;
+    uint8_t keyword_class; // 1 or 2 if a word of keywords_1 or keywords_2 ends here, 0 otherwise
+    };
+
+  struct edge
+    {
+    wchar_t character;
+    uint32_t target;
+    };
+
+  std::vector<node> nodes;
+  std::vector<edge> edges;
+  uint32_t root_ascii[128]; // child of the root per ascii character, 0 if there is none
+  };
+
 struct keyword_data
   {
   std::vector<std::wstring> keywords_1, keywords_2;
+  keyword_trie trie;
   };
 
+keyword_trie make_keyword_trie(const std::vector<std::wstring>& keywords_1, const std::vector<std::wstring>& keywords_2);
+
+inline bool is_word_delimiter(wchar_t ch)
+  {
+  switch (ch)
+    {
+    case L' ': case L',': case L'(': case L'{': case L')': case L'}': case L'[': case L']': case L'\n': case L'\t': case L'\r': return true;
+    default: return false;
+    }
+  }
+
+/*
+Reads the word that starts at it, up to the next word delimiter, and returns its keyword class
+(0 if the word is not a keyword). length is set to the number of characters in the word.
+*/
+template <class TIter>
+uint8_t classify_word(int64_t& length, TIter it, TIter it_end, const keyword_trie& trie)
+  {
+  length = 0;
+  bool in_trie = !trie.nodes.empty();
+  uint32_t current = 0;
+  for (; it != it_end && !is_word_delimiter(*it); ++it, ++length)
+    {
+    if (!in_trie)
+      continue;
+    const wchar_t ch = *it;
+    uint32_t next = 0;
+    if (current == 0 && (uint32_t)ch < 128)
+      next = trie.root_ascii[(uint32_t)ch];
+    else
+      {
+      const keyword_trie::node& n = trie.nodes[current];
+      for (uint32_t e = n.first_edge; e < n.first_edge + n.nr_of_edges && trie.edges[e].character <= ch; ++e)
+        {
+        if (trie.edges[e].character == ch)
+          {
+          next = trie.edges[e].target;
+          break;
+          }
+        }
+      }
+    in_trie = next != 0;
+    current = next;
+    }
+  return in_trie ? trie.nodes[current].keyword_class : 0;
+  }
+
 class syntax_highlighter
   {
   public:
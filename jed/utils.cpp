@@ -2,6 +2,11 @@
 
 #include <jtk/file_utils.h>
 #include <algorithm>
+#include <ctime>
+#include <mutex>
+#include <unordered_map>
+
+#include <sys/stat.h>
 
 std::string get_file_in_executable_path(const std::string& filename)
   {
@@ -175,6 +180,82 @@ namespace
       }
     return out;
     }
+
+  /*
+  The files of a folder, indexed by filename and by filename without extension. When several files share
+  a stem, the first one in the directory listing wins, as in the linear scan this replaces.
+  */
+  struct folder_index
+    {
+    std::time_t modification_time;
+    std::time_t build_time;
+    std::unordered_map<std::string, std::string> files;
+    };
+
+  bool _stat_path(std::time_t& modification_time, bool& is_folder, const std::string& path)
+    {
+#ifdef _WIN32
+    struct _stat64 st;
+    if (_stat64(path.c_str(), &st) != 0)
+      return false;
+    is_folder = (st.st_mode & _S_IFDIR) != 0;
+#else
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+      return false;
+    is_folder = S_ISDIR(st.st_mode);
+#endif
+    modification_time = st.st_mtime;
+    return true;
+    }
+
+  folder_index _build_folder_index(const std::string& folder, std::time_t modification_time)
+    {
+    folder_index index;
+    index.modification_time = modification_time;
+    index.build_time = std::time(nullptr);
+    for (const auto& path : jtk::get_files_from_directory(folder, false))
+      {
+      auto f = jtk::get_filename(path);
+      index.files.emplace(f, path);
+      index.files.emplace(jtk::remove_extension(f), path);
+      }
+    return index;
+    }
+
+  /*
+  Looks for filename in folder. An exact filename only costs a stat. Otherwise the folder's index is used,
+  which is rebuilt when the folder's modification time changes. The modification time has a resolution of
+  a second, so an index built in the same second as the last change of the folder is not trusted.
+  */
+  std::string _find_in_folder(const std::string& folder, const std::string& filename)
+    {
+    static std::mutex mut;
+    static std::unordered_map<std::string, folder_index> cache;
+
+    std::time_t modification_time;
+    bool is_folder;
+    if (!_stat_path(modification_time, is_folder, folder + filename))
+      {
+      if (!_stat_path(modification_time, is_folder, folder) || !is_folder)
+        return "";
+      }
+    else if (!is_folder)
+      return folder + filename;
+    else if (!_stat_path(modification_time, is_folder, folder))
+      return "";
+
+    std::scoped_lock lock(mut);
+    auto it = cache.find(folder);
+    if (it == cache.end() || it->second.modification_time != modification_time || it->second.build_time <= modification_time + 1)
+      {
+      if (cache.size() >= 256)
+        cache.clear();
+      it = cache.insert_or_assign(folder, _build_folder_index(folder, modification_time)).first;
+      }
+    auto found = it->second.files.find(filename);
+    return found == it->second.files.end() ? std::string() : found->second;
+    }
   }
 
 uint16_t ascii_to_utf16(unsigned char ch)
@@ -192,41 +273,25 @@ std::string get_file_path(const std::string& filename, const std::string& buffer
     if (jtk::is_directory(jtk::get_folder(filename)))
       return filename;
     }
+  if (filename.empty())
+    return "";
   if (!buffer_filename.empty())
     {
-    auto window_folder = jtk::get_folder(buffer_filename);
-    auto possible_executables = jtk::get_files_from_directory(window_folder, false);
-    for (const auto& path : possible_executables)
-      {
-      auto f = jtk::get_filename(path);
-      if (f == filename || jtk::remove_extension(f) == filename)
-        {
-        return path;
-        }
-      }
+    auto path = _find_in_folder(jtk::get_folder(buffer_filename), filename);
+    if (!path.empty())
+      return path;
     }
 
   std::string dir = jtk::get_cwd();
-  auto possible_executables = jtk::get_files_from_directory(dir, false);
-  for (const auto& path : possible_executables)
-    {
-    auto f = jtk::get_filename(path);
-    if (f == filename || jtk::remove_extension(f) == filename)
-      {
-      return path;
-      }
-    }
+  if (!dir.empty() && dir.back() != '/' && dir.back() != '\\')
+    dir.push_back('/');
+  auto found = _find_in_folder(dir, filename);
+  if (!found.empty())
+    return found;
 
-  auto executable_path = jtk::get_folder(jtk::get_executable_path());
-  possible_executables = jtk::get_files_from_directory(executable_path, false);
-  for (const auto& path : possible_executables)
-    {
-    auto f = jtk::get_filename(path);
-    if (f == filename || jtk::remove_extension(f) == filename)
-      {
-      return path;
-      }
-    }
+  found = _find_in_folder(jtk::get_folder(jtk::get_executable_path()), filename);
+  if (!found.empty())
+    return found;
 
   std::string path = jtk::getenv(std::string("PATH"));
 
@@ -242,15 +307,12 @@ std::string get_file_path(const std::string& filename, const std::string& buffer
   
   for (const auto& folder_in_path : path_list)
     {  
-    auto possible_files = jtk::get_files_from_directory(jtk::convert_wstring_to_string(folder_in_path), false);
-    for (const auto& possible_file : possible_files)
-      {
-      auto f = jtk::get_filename(possible_file);
-      if (f == filename || jtk::remove_extension(f) == filename)
-        {
-        return possible_file;
-        }
-      }
+    std::string folder = jtk::convert_wstring_to_string(folder_in_path);
+    if (!folder.empty() && folder.back() != '/' && folder.back() != '\\')
+      folder.push_back('/');
+    found = _find_in_folder(folder, filename);
+    if (!found.empty())
+      return found;
     }
   return "";
   }
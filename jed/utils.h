@@ -11,6 +11,7 @@ uint16_t ascii_to_utf16(unsigned char ch);
 Input is a filename and the filename of the window.
 This method will look for filename in the folder defined by the window_filename, or the executable path.
 Returns empty string if nothing was found, or returns the path of the file.
+The listings of the searched folders are cached and refreshed when a folder's modification time changes.
 */
 std::string get_file_path(const std::string& filename, const std::string& buffer_filename);
 
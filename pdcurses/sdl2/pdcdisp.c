@@ -142,6 +142,187 @@ static void _set_attr(chtype ch)
 
 #ifdef PDC_WIDE
 
+/* glyph atlas: each glyph is rendered once by SDL_ttf into a cell of
+   one atlas surface, and blitted from there afterwards. A glyph is
+   identified by its character, foreground color and font style. The
+   atlas is rebuilt when the font or its size changes, and emptied when
+   all its cells are in use. */
+
+#define ATLAS_SIZE 1024     /* width and height of the atlas in pixels */
+#define ATLAS_HASH 8192     /* size of the hash table, a power of 2 */
+
+typedef struct
+{
+    Uint32 ch;              /* character + 1, 0 for an unused entry */
+    Uint32 color;           /* foreground color as 0xRRGGBBAA */
+    int style;              /* TTF_GetFontStyle() */
+    int cell;               /* index of the cell in the atlas */
+} glyph_entry;
+
+bool pdc_glyph_atlas = TRUE;
+
+static SDL_Surface *atlas = NULL;
+static glyph_entry atlas_hash[ATLAS_HASH];
+static int atlas_cells = 0, atlas_capacity = 0, atlas_columns = 0;
+static TTF_Font *atlas_font = NULL;
+static int atlas_font_size = 0, atlas_fwidth = 0, atlas_fheight = 0;
+
+static void _atlas_clear(void)
+{
+    memset(atlas_hash, 0, sizeof(atlas_hash));
+    atlas_cells = 0;
+}
+
+static void _atlas_rebuild(void)
+{
+    int rows;
+
+    if (atlas)
+        SDL_FreeSurface(atlas);
+    atlas = NULL;
+
+    atlas_font = pdc_ttffont;
+    atlas_font_size = pdc_font_size;
+    atlas_fwidth = pdc_fwidth;
+    atlas_fheight = pdc_fheight;
+
+    _atlas_clear();
+
+    if (pdc_fwidth <= 0 || pdc_fheight <= 0)
+        return;
+
+    atlas_columns = max(ATLAS_SIZE / pdc_fwidth, 1);
+    rows = max(ATLAS_SIZE / pdc_fheight, 1);
+    atlas_capacity = min(atlas_columns * rows, ATLAS_HASH / 2);
+
+    atlas = SDL_CreateRGBSurfaceWithFormat(0, atlas_columns * pdc_fwidth,
+                                           rows * pdc_fheight, 32,
+                                           SDL_PIXELFORMAT_ARGB8888);
+    if (atlas)
+        SDL_SetSurfaceBlendMode(atlas, SDL_BLENDMODE_BLEND);
+}
+
+/* find the glyph for ch in the current foreground color and font style,
+   rendering it into the atlas if it isn't there yet; returns FALSE if
+   the atlas is switched off with pdc_glyph_atlas, if there is no atlas
+   or if the glyph could not be rendered */
+
+static bool _atlas_glyph(Uint16 ch, SDL_Rect *cell)
+{
+    SDL_Color fg = pdc_color[foregr];
+    Uint32 color = ((Uint32)fg.r << 24) | ((Uint32)fg.g << 16) |
+                   ((Uint32)fg.b << 8) | fg.a;
+    int style = TTF_GetFontStyle(pdc_ttffont);
+    Uint32 hash, h;
+    Uint16 chstr[2] = {0, 0};
+    SDL_Surface *glyph;
+    SDL_Rect src, dest;
+    int center;
+
+    if (!pdc_glyph_atlas)
+        return FALSE;
+
+    if (atlas_font != pdc_ttffont || atlas_font_size != pdc_font_size ||
+        atlas_fwidth != pdc_fwidth || atlas_fheight != pdc_fheight)
+        _atlas_rebuild();
+
+    if (!atlas)
+        return FALSE;
+
+    hash = (ch * 2654435761u ^ color * 40503u ^ (Uint32)style) & (ATLAS_HASH - 1);
+    h = hash;
+
+    while (atlas_hash[h].ch)
+    {
+        glyph_entry *e = atlas_hash + h;
+
+        if (e->ch == (Uint32)ch + 1 && e->color == color && e->style == style)
+            break;
+
+        h = (h + 1) & (ATLAS_HASH - 1);
+    }
+
+    if (!atlas_hash[h].ch)
+    {
+        if (atlas_cells == atlas_capacity)
+        {
+            _atlas_clear();
+            h = hash;
+        }
+
+        chstr[0] = ch;
+        glyph = TTF_RenderUNICODE_Blended(pdc_ttffont, chstr, fg);
+        if (!glyph)
+            return FALSE;
+
+        dest.x = atlas_cells % atlas_columns * pdc_fwidth;
+        dest.y = atlas_cells / atlas_columns * pdc_fheight;
+        dest.w = pdc_fwidth;
+        dest.h = pdc_fheight;
+        SDL_FillRect(atlas, &dest, 0);
+
+        /* the same part of the glyph and the same centering as when it
+           is blitted to the screen directly */
+
+        center = pdc_fwidth > glyph->w ? (pdc_fwidth - glyph->w) >> 1 : 0;
+        src.x = 0;
+        src.y = 0;
+        src.w = pdc_fwidth - center;
+        src.h = pdc_fheight;
+        dest.x += center;
+        SDL_SetSurfaceBlendMode(glyph, SDL_BLENDMODE_NONE);
+        SDL_BlitSurface(glyph, &src, atlas, &dest);
+        SDL_FreeSurface(glyph);
+
+        atlas_hash[h].ch = (Uint32)ch + 1;
+        atlas_hash[h].color = color;
+        atlas_hash[h].style = style;
+        atlas_hash[h].cell = atlas_cells++;
+    }
+
+    cell->x = atlas_hash[h].cell % atlas_columns * pdc_fwidth;
+    cell->y = atlas_hash[h].cell / atlas_columns * pdc_fheight;
+    cell->w = pdc_fwidth;
+    cell->h = pdc_fheight;
+
+    return TRUE;
+}
+
+/* draw the lowest h pixel rows of the glyph for ch at dest, which is the
+   top left corner of those rows on the screen */
+
+static void _draw_glyph(Uint16 ch, SDL_Rect dest, int h)
+{
+    SDL_Rect src;
+    Uint16 chstr[2] = {0, 0};
+
+    if (_atlas_glyph(ch, &src))
+    {
+        src.y += pdc_fheight - h;
+        src.h = h;
+        SDL_BlitSurface(atlas, &src, pdc_screen, &dest);
+        return;
+    }
+
+    /* no atlas: render the glyph directly */
+
+    chstr[0] = ch;
+    pdc_font = TTF_RenderUNICODE_Blended(pdc_ttffont, chstr,
+                                         pdc_color[foregr]);
+    if (pdc_font)
+    {
+        src.x = 0;
+        src.y = pdc_fheight - h;
+        src.w = pdc_fwidth;
+        src.h = h;
+        if (pdc_fwidth > pdc_font->w)
+            dest.x += (pdc_fwidth - pdc_font->w) >> 1;
+        SDL_BlitSurface(pdc_font, &src, pdc_screen, &dest);
+        SDL_FreeSurface(pdc_font);
+        pdc_font = NULL;
+    }
+}
+
 /* Draw some of the ACS_* "graphics" */
 
 bool _grprint(chtype ch, SDL_Rect dest)
@@ -257,9 +438,6 @@ void PDC_gotoyx(int row, int col)
     SDL_Rect src, dest;
     chtype ch;
     int oldrow, oldcol;
-#ifdef PDC_WIDE
-    Uint16 chstr[2] = {0, 0};
-#endif
 
     PDC_LOG(("PDC_gotoyx() - called: row %d col %d from row %d col %d\n",
              row, col, SP->cursrow, SP->curscol));
@@ -299,22 +477,7 @@ void PDC_gotoyx(int row, int col)
         if (ch & A_ALTCHARSET && !(ch & 0xff80))
             ch = acs_map[ch & 0x7f];
 
-        chstr[0] = ch & A_CHARTEXT;
-
-        pdc_font = TTF_RenderUNICODE_Blended(pdc_ttffont, chstr,
-                                             pdc_color[foregr]);
-        if (pdc_font)
-        {
-            int center = pdc_fwidth > pdc_font->w ?
-                        (pdc_fwidth - pdc_font->w) >> 1 : 0;
-            src.x = 0;
-            src.y = pdc_fheight - src.h;
-            dest.x += center;
-            SDL_BlitSurface(pdc_font, &src, pdc_screen, &dest);
-            dest.x -= center;
-            SDL_FreeSurface(pdc_font);
-            pdc_font = NULL;
-        }
+        _draw_glyph((Uint16)(ch & A_CHARTEXT), dest, src.h);
     }
 #else
     if (ch & A_ALTCHARSET && !(ch & 0xff80))
@@ -337,11 +500,11 @@ void PDC_gotoyx(int row, int col)
 
 void _new_packet(attr_t attr, int lineno, int x, int len, const chtype *srcp)
 {
-    SDL_Rect src, dest, lastrect;
-    int j;
-#ifdef PDC_WIDE
-    Uint16 chstr[2] = {0, 0};
+    SDL_Rect dest, lastrect;
+#ifndef PDC_WIDE
+    SDL_Rect src;
 #endif
+    int j;
     attr_t sysattrs = SP->termattrs;
     short hcol = SP->line_color;
     bool blink = blinked_off && (attr & A_BLINK) && (sysattrs & A_BLINK);
@@ -349,12 +512,10 @@ void _new_packet(attr_t attr, int lineno, int x, int len, const chtype *srcp)
     if (rectcount == MAXRECT)
         PDC_update_rects();
 
-#ifdef PDC_WIDE
-    src.x = 0;
-    src.y = 0;
-#endif
+#ifndef PDC_WIDE
     src.h = pdc_fheight;
     src.w = pdc_fwidth;
+#endif
 
     dest.y = pdc_fheight * lineno + pdc_yoffset;
     dest.x = pdc_fwidth * x + pdc_xoffset;
@@ -416,27 +577,7 @@ void _new_packet(attr_t attr, int lineno, int x, int len, const chtype *srcp)
         ch &= A_CHARTEXT;
 
         if (ch != ' ')
-        {
-            if (chstr[0] != ch)
-            {
-                chstr[0] = ch;
-
-                if (pdc_font)
-                    SDL_FreeSurface(pdc_font);
-
-                pdc_font = TTF_RenderUNICODE_Blended(pdc_ttffont, chstr,
-                                                     pdc_color[foregr]);
-            }
-
-            if (pdc_font)
-            {
-                int center = pdc_fwidth > pdc_font->w ?
-                    (pdc_fwidth - pdc_font->w) >> 1 : 0;
-                dest.x += center;
-                SDL_BlitSurface(pdc_font, &src, pdc_screen, &dest);
-                dest.x -= center;
-            }
-        }
+            _draw_glyph((Uint16)ch, dest, pdc_fheight);
 #else
         src.x = (ch & 0xff) % 32 * pdc_fwidth;
         src.y = (ch & 0xff) / 32 * pdc_fheight;
@@ -462,14 +603,6 @@ void _new_packet(attr_t attr, int lineno, int x, int len, const chtype *srcp)
         dest.x += pdc_fwidth;
     }
 
-#ifdef PDC_WIDE
-    if (pdc_font)
-    {
-        SDL_FreeSurface(pdc_font);
-        pdc_font = NULL;
-    }
-#endif
-
     if (!blink && (attr & A_UNDERLINE))
     {
         dest.y += pdc_fheight - pdc_fthick;
@@ -10,6 +10,9 @@
 #ifdef PDC_WIDE
 PDCEX  TTF_Font *pdc_ttffont;
 PDCEX  int pdc_font_size;
+PDCEX  bool pdc_glyph_atlas;          /* blit glyphs from the atlas instead
+                                        of rendering each one, see
+                                        pdcdisp.c */
 #endif
 PDCEX  SDL_Window *pdc_window;
 PDCEX  SDL_Surface *pdc_screen, *pdc_font, *pdc_icon, *pdc_back;